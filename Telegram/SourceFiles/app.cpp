@@ -104,7 +104,7 @@ namespace {
 	EmojiMap mainEmojiMap;
 	QMap<int32, EmojiMap> otherEmojiMap;
 
-	int32 serviceImageCacheSize = 0;
+	bool collectImageCacheAfterPaint = false;
 
 	typedef QLinkedList<PhotoData*> LastPhotosList;
 	LastPhotosList lastPhotos;
@@ -1137,6 +1137,8 @@ namespace {
 	}
 
 	void feedWereDeleted(ChannelId channelId, const QVector<MTPint> &msgsIds) {
+		Local::historyCacheMessagesDeleted(channelId, msgsIds);
+
 		MsgsData *data = fetchMsgsData(channelId, false);
 		if (!data) return;
 
@@ -1699,20 +1701,6 @@ namespace {
 		return i.value();
 	}
 
-	void forgetMedia() {
-		lastPhotos.clear();
-		lastPhotosMap.clear();
-		for (PhotosData::const_iterator i = ::photosData.cbegin(), e = ::photosData.cend(); i != e; ++i) {
-			i.value()->forget();
-		}
-		for (DocumentsData::const_iterator i = ::documentsData.cbegin(), e = ::documentsData.cend(); i != e; ++i) {
-			i.value()->forget();
-		}
-		for (LocationsData::const_iterator i = ::locationsData.cbegin(), e = ::locationsData.cend(); i != e; ++i) {
-			i.value()->thumb->forget();
-		}
-	}
-
 	MTPPhoto photoFromUserPhoto(MTPint userId, MTPint date, const MTPUserProfilePhoto &photo) {
 		if (photo.type() == mtpc_userProfilePhoto) {
 			const MTPDuserProfilePhoto &uphoto(photo.c_userProfilePhoto());
@@ -2058,8 +2046,6 @@ namespace {
 
 		clearStorageImages();
 		cSetServerBackgrounds(WallPapers());
-
-		serviceImageCacheSize = imageCacheSize();
 	}
 
 	void deinitMedia() {
@@ -2177,11 +2163,17 @@ namespace {
 	}
 
 	void checkImageCacheSize() {
-		int64 nowImageCacheSize = imageCacheSize();
-		if (nowImageCacheSize > serviceImageCacheSize + MemoryForImageCache) {
-			App::forgetMedia();
-			serviceImageCacheSize = imageCacheSize();
+		if (imageCacheSize() > MemoryForImageCache) {
+			::collectImageCacheAfterPaint = true;
+		}
+	}
+
+	void windowPainted() {
+		if (::collectImageCacheAfterPaint) { // the images on screen were just used, so they are kept
+			::collectImageCacheAfterPaint = false;
+			collectImageCache(MemoryForImageCache);
 		}
+		paintedImageCache();
 	}
 
 	bool isValidPhone(QString phone) {
@@ -160,7 +160,6 @@ namespace App {
 	WebPageData *webPage(const WebPageId &webPage);
 	WebPageData *webPageSet(const WebPageId &webPage, WebPageData *convert, const QString &, const QString &url, const QString &displayUrl, const QString &siteName, const QString &title, const QString &description, PhotoData *photo, DocumentData *doc, int32 duration, const QString &author, int32 pendingTill);
 	LocationData *location(const LocationCoords &coords);
-	void forgetMedia();
 
 	MTPPhoto photoFromUserPhoto(MTPint userId, MTPint date, const MTPUserProfilePhoto &photo);
 
@@ -223,7 +222,8 @@ namespace App {
 	void deinitMedia();
 	void playSound();
 
-	void checkImageCacheSize();
+	void checkImageCacheSize(); // decoded images over the budget are forgotten after the next paint
+	void windowPainted();
 
 	bool isValidPhone(QString phone);
 
@@ -36,6 +36,8 @@ static const wchar_t *AppFile = L"Telegram";
 enum {
 	MTPShortBufferSize = 65535, // of ints, 256 kb
 	MTPPacketSizeMax = 67108864, // 64 mb
+	MTPLongBufferKeepSize = 262144, // of ints, 1 mb of long packet buffer is kept for the next long packet
+	MTPRecycledBuffersPerSize = 4, // each connection keeps up to 4 received packet buffers of each size class for reuse
 	MTPIdsBufferSize = 400, // received msgIds and wereAcked msgIds count stored
 	MTPCheckResendTimeout = 10000, // how much time passed from send till we resend request or check it's state, in ms
 	MTPCheckResendWaiting = 1000, // how much time to wait for some more requests, when resending request or checking it's state, in ms
@@ -51,9 +53,12 @@ enum {
 	MTPIPv4ConnectionWaitTimeout = 1000, // 1 seconds waiting for ipv4, until we accept ipv6
 	MTPMillerRabinIterCount = 30, // 30 Miller-Rabin iterations for dh_prime primality check
 
-	MTPUploadSessionsCount = 2, // max 2 upload sessions is created
+	MTPUploadSessionsCount = 4, // max 4 upload sessions is created
 	MTPDownloadSessionsCount = 2, // max 2 download sessions is created
 	MTPKillFileSessionTimeout = 5000, // how much time without upload / download causes additional session kill
+	MTPRequestsShardsCount = 16, // sent requests and their handlers are stored in 16 separately locked tables
+	MTPParseStatsLogPeriod = 60000, // responses parse time is written to the debug log once a minute
+	MTPArenaChunkSize = 16 * 1024, // objects read from one response are allocated by 16 kb chunks
 
 	MTPEnumDCTimeout = 8000, // 8 seconds timeout for help_getConfig to work (then move to other dc)
 
@@ -154,6 +159,10 @@ enum {
 	MaxMessageSize = 4096,
 	MaxHttpRedirects = 5, // when getting external data/images
 
+	ShapedTextCacheSize = 4 * 1024 * 1024, // shaped text blocks are kept for reuse up to 4 mb
+	ShapedTextCacheMaxLength = 512, // longer text blocks are not cached
+	ShapedTextCacheLogPeriod = 10000, // hits and misses of the shaped text cache are written to the debug log each 10000 lookups
+
 	WriteMapTimeout = 1000,
 	SaveDraftTimeout = 1000, // save draft after 1 secs of not changing text
 	SaveDraftAnywayTimeout = 5000, // or save anyway each 5 secs
@@ -345,15 +354,31 @@ enum {
 
 	MessagesFirstLoad = 30, // first history part size requested
 	MessagesPerPage = 50, // next history part size
+	HistoryCacheMessagesCount = 100, // latest messages of each chat kept in local history cache
 
 	FileLoaderQueueStopTimeout = 5000,
+	FilePrepareThreadsMax = 8, // files to send are prepared in up to 8 threads, but not more than cores count
+	OverviewThumbThreadsMax = 4, // shared media photos are decoded in up to 4 threads, but not more than cores count
+
+	PackedCacheEntryMaxSize = 256 * 1024, // cache entries up to 256kb are appended to packed segment files
+	PackedCacheSegmentMaxSize = 64 * 1024 * 1024, // start a new packed cache segment after 64mb
+	CacheWriteQueueMaxSize = 16 * 1024 * 1024, // block cache writes while 16mb are waiting to be written
+	CacheStreamChunkSize = 64 * 1024, // large cache entries are encrypted by 64kb chunks
+	CacheStreamChunkMaxSize = 1024 * 1024, // sanity check of chunk size read from a cache stream
 
 	DownloadPartSize = 64 * 1024, // 64kb for photo
 	DocumentDownloadPartSize = 128 * 1024, // 128kb for document
+	DocumentDownloadPartSizeMax = 512 * 1024, // server allows up to 512kb parts, part size grows with measured bandwidth
+	DocumentResumeCheckpointSize = 2 * 1024 * 1024, // downloaded parts are flushed to the file and saved for resume every 2mb
 	MaxUploadPhotoSize = 256 * 1024 * 1024, // 256mb photos max
     MaxUploadDocumentSize = 1500 * 1024 * 1024, // 1500mb documents max
     UseBigFilesFrom = 10 * 1024 * 1024, // mtp big files methods used for files greater than 10mb
 	MaxFileQueries = 16, // max 16 file parts downloaded at the same time
+	MaxFileQueriesAdaptive = 64, // in-flight window can grow up to 64 parts when the connection is latency-bound
+	DownloadStatsPeriod = 1000, // download throughput of a dc is measured once a second
+	MediaPrefetchScreens = 1, // media is auto loaded one screen above and below the visible area
+	MediaPrefetchAheadTime = 1000, // and as far as the user scrolls in a second in the scroll direction
+	MediaPrefetchMaxScreens = 6, // but not further than six screens away
 	MaxWebFileQueries = 8, // max 8 http[s] files downloaded at the same time
 
 	UploadPartSize = 32 * 1024, // 32kb for photo
@@ -363,7 +388,12 @@ enum {
     DocumentUploadPartSize2 = 128 * 1024, // 128kb for small document ( <= 375mb )
     DocumentUploadPartSize3 = 256 * 1024, // 256kb for medium document ( <= 750mb )
     DocumentUploadPartSize4 = 512 * 1024, // 512kb for large document ( <= 1500mb )
-    MaxUploadFileParallelSize = MTPUploadSessionsCount * 512 * 1024, // max 512kb uploaded at the same time in each session
+    MaxUploadFileParallelSize = MTPUploadSessionsCount * 256 * 1024, // 256kb uploaded at the same time in each session at start
+    MaxUploadFileParallelSizeAdaptive = MTPUploadSessionsCount * 2 * 1024 * 1024, // in-flight window grows up to 2mb in each session on fast connections
+    MaxUploadFilesInFlight = 4, // parts of up to 4 files are uploaded at the same time
+    UploadReadAheadParts = 4, // document parts are read and hashed up to 4 parts ahead
+    UploadStatsPeriod = 1000, // upload throughput is measured once a second
+    UploadedPartsKeepTime = 12 * 3600, // not finished uploads are continued within 12 hours after the last sent part
     UploadRequestInterval = 500, // one part each half second, if not uploaded faster
 
 	MaxPhotosInMemory = 50, // try to clear some memory after 50 photos are created
@@ -372,7 +402,7 @@ enum {
 	WaitForSkippedTimeout = 1000, // 1s wait for skipped seq or pts in updates
 	WaitForChannelGetDifference = 1000, // 1s wait after show channel history before sending getChannelDifference
 
-	MemoryForImageCache = 64 * 1024 * 1024, // after 64mb of unpacked images we try to clear some memory
+	MemoryForImageCache = 64 * 1024 * 1024, // least recently used unpacked images are forgotten above 64mb
 	NotifyWindowsCount = 3, // 3 desktop notifies at the same time
 	NotifySettingSaveTimeout = 1000, // wait 1 second before saving notify setting to server
 	NotifyDeletePhotoAfter = 60000, // delete notify photo after 1 minute
@@ -20,8 +20,76 @@ Copyright (c) 2014-2016 John Preston, https://desktop.telegram.org
 */
 #include "stdafx.h"
 #include "fileuploader.h"
+#include "localstorage.h"
 
-FileUploader::FileUploader() : sentSize(0) {
+namespace {
+	class UploadPartsReadTask : public Task {
+	public:
+
+		UploadPartsReadTask(FileUploader *uploader, const FullMsgId &msgId, const FileUploader::PartsReaderPtr &reader, int32 count) : _uploader(uploader)
+			, _msgId(msgId)
+			, _reader(reader)
+			, _count(count) {
+		}
+
+		void process() {
+			FileUploader::PartsReader &r(*_reader);
+			if (r.content.isEmpty() && !r.file.isOpen()) {
+				if (!r.file.open(QIODevice::ReadOnly) || !skipSentParts(r)) {
+					r.failed = true;
+					return;
+				}
+			}
+			for (int32 i = 0; i < _count && r.partsRead < r.partsCount; ++i) {
+				QByteArray part = r.content.isEmpty() ? r.file.read(r.partSize) : r.content.mid(r.partsRead * r.partSize, r.partSize);
+				if (part.size() > r.partSize || (part.size() < r.partSize && r.partsRead + 1 != r.partsCount)) {
+					r.failed = true;
+					return;
+				}
+				if (r.hash) {
+					r.md5Hash.feed(part.constData(), part.size());
+				}
+				_parts.push_back(part);
+				++r.partsRead;
+			}
+		}
+		void finish() {
+			_uploader->partsRead(_msgId, _reader, _parts);
+		}
+
+	private:
+		bool skipSentParts(FileUploader::PartsReader &r) { // continued upload, the md5 still must cover the whole file
+			qint64 skip = qint64(r.partsRead) * r.partSize;
+			if (!r.hash) {
+				return r.file.seek(skip);
+			}
+			while (skip > 0) {
+				QByteArray part = r.file.read(qMin(skip, qint64(r.partSize)));
+				if (part.isEmpty()) {
+					return false;
+				}
+				r.md5Hash.feed(part.constData(), part.size());
+				skip -= part.size();
+			}
+			return true;
+		}
+
+		FileUploader *_uploader;
+		FullMsgId _msgId;
+		FileUploader::PartsReaderPtr _reader;
+		int32 _count;
+		QList<QByteArray> _parts;
+
+	};
+}
+
+FileUploader::FileUploader() : sentSize(0)
+, sentLimit(MaxUploadFileParallelSize)
+, _statsStart(0)
+, _statsBytes(0)
+, _speed(0)
+, _rtt(0)
+, _reader(new TaskQueue(this, FileLoaderQueueStopTimeout)) {
 	memset(sentSizes, 0, sizeof(sentSizes));
 	nextTimer.setSingleShot(true);
 	connect(&nextTimer, SIGNAL(timeout()), this, SLOT(sendNext()));
@@ -74,8 +142,8 @@ void FileUploader::upload(const FullMsgId &msgId, const FileLoadResultPtr &file)
 	sendNext();
 }
 
-void FileUploader::currentFailed() {
-	Queue::iterator j = queue.find(uploading);
+void FileUploader::fileFailed(const FullMsgId &msgId) {
+	Queue::iterator j = queue.find(msgId);
 	if (j != queue.end()) {
 		if (j->type() == PreparePhoto) {
 			emit photoFailed(j.key());
@@ -86,16 +154,19 @@ void FileUploader::currentFailed() {
 			}
 			emit documentFailed(j.key());
 		}
+		Local::clearUploadedParts(j->docResumePath());
 		queue.erase(j);
 	}
 
-	requestsSent.clear();
-	docRequestsSent.clear();
-	dcMap.clear();
-	uploading = FullMsgId();
-	sentSize = 0;
-	for (int i = 0; i < MTPUploadSessionsCount; ++i) {
-		sentSizes[i] = 0;
+	for (SentParts::iterator i = requestsSent.begin(); i != requestsSent.end();) {
+		if (i->msgId == msgId) {
+			MTP::cancel(i.key());
+			sentSize -= i->size;
+			sentSizes[i->dc] -= i->size;
+			i = requestsSent.erase(i);
+		} else {
+			++i;
+		}
 	}
 
 	sendNext();
@@ -108,7 +179,7 @@ void FileUploader::killSessions() {
 }
 
 void FileUploader::sendNext() {
-	if (sentSize >= MaxUploadFileParallelSize || _paused.msg) return;
+	if (_paused.msg) return;
 
 	bool killing = killSessionsTimer.isActive();
 	if (queue.isEmpty()) {
@@ -121,13 +192,26 @@ void FileUploader::sendNext() {
 	if (killing) {
 		killSessionsTimer.stop();
 	}
-	Queue::iterator i = uploading.msg ? queue.find(uploading) : queue.begin();
-	if (!uploading.msg) {
-		uploading = i.key();
-	} else if (i == queue.end()) {
-		i = queue.begin();
-		uploading = i.key();
+
+	// the files are sent in the queue order, the next file starts
+	// while the last parts of the previous one are still in flight
+	int32 filesInFlight = 0;
+	for (Queue::iterator i = queue.begin(), e = queue.end(); i != e && filesInFlight < MaxUploadFilesInFlight; ++i) {
+		if (i->sent()) continue;
+
+		++filesInFlight;
+		while (sentSize < sentLimit && sendPart(i)) {
+		}
+		readAhead(i);
 	}
+	sendReady();
+
+	if (!requestsSent.isEmpty()) {
+		nextTimer.start(UploadRequestInterval);
+	}
+}
+
+bool FileUploader::sendPart(Queue::iterator i) {
 	int todc = 0;
 	for (int dc = 1; dc < MTPUploadSessionsCount; ++dc) {
 		if (sentSizes[dc] < sentSizes[todc]) {
@@ -135,88 +219,188 @@ void FileUploader::sendNext() {
 		}
 	}
 
-	UploadFileParts &parts(i->file ? (i->type() == PreparePhoto ? i->file->fileparts : i->file->thumbparts) : i->media.parts);
+	uint64 ms = getms();
+	if (requestsSent.isEmpty()) { // measure only the time while something is being uploaded
+		_statsStart = ms;
+		_statsBytes = 0;
+	}
+
+	UploadFileParts &parts(i->parts());
 	uint64 partsOfId(i->file ? (i->type() == PreparePhoto ? i->file->id : i->file->thumbId) : i->media.thumbId);
+	mtpRequestId requestId;
 	if (parts.isEmpty()) {
-		if (i->docSentParts >= i->docPartsCount) {
-			if (requestsSent.isEmpty() && docRequestsSent.isEmpty()) {
-				bool silent = i->file && i->file->to.silent;
-				if (i->type() == PreparePhoto) {
-					emit photoReady(uploading, silent, MTP_inputFile(MTP_long(i->id()), MTP_int(i->partsCount), MTP_string(i->filename()), MTP_string(i->file ? i->file->filemd5 : i->media.jpeg_md5)));
-				} else if (i->type() == PrepareDocument || i->type() == PrepareAudio) {
-					QByteArray docMd5(32, Qt::Uninitialized);
-					hashMd5Hex(i->md5Hash.result(), docMd5.data());
-
-					MTPInputFile doc = (i->docSize > UseBigFilesFrom) ? MTP_inputFileBig(MTP_long(i->id()), MTP_int(i->docPartsCount), MTP_string(i->filename())) : MTP_inputFile(MTP_long(i->id()), MTP_int(i->docPartsCount), MTP_string(i->filename()), MTP_string(docMd5));
-					if (i->partsCount) {
-						emit thumbDocumentReady(uploading, silent, doc, MTP_inputFile(MTP_long(i->thumbId()), MTP_int(i->partsCount), MTP_string(i->file ? i->file->thumbname : (qsl("thumb.") + i->media.thumbExt)), MTP_string(i->file ? i->file->thumbmd5 : i->media.jpeg_md5)));
-					} else {
-						emit documentReady(uploading, silent, doc);
-					}
-				}
-				queue.remove(uploading);
-				uploading = FullMsgId();
-				sendNext();
-			}
-			return;
+		if (i->docSentParts >= i->docPartsCount || i->docReadParts.isEmpty()) {
+			return false;
 		}
 
-		QByteArray &content(i->file ? i->file->content : i->media.data);
-		QByteArray toSend;
-		if (content.isEmpty()) {
-			if (!i->docFile) {
-				i->docFile.reset(new QFile(i->file ? i->file->filepath : i->media.file));
-				if (!i->docFile->open(QIODevice::ReadOnly)) {
-					currentFailed();
-					return;
-				}
-			}
-			toSend = i->docFile->read(i->docPartSize);
-			if (i->docSize <= UseBigFilesFrom) {
-				i->md5Hash.feed(toSend.constData(), toSend.size());
-			}
-		} else {
-			toSend = content.mid(i->docSentParts * i->docPartSize, i->docPartSize);
-			if ((i->type() == PrepareDocument || i->type() == PrepareAudio) && i->docSentParts <= UseBigFilesFrom) {
-				i->md5Hash.feed(toSend.constData(), toSend.size());
-			}
-		}
-		if (toSend.size() > i->docPartSize || (toSend.size() < i->docPartSize && i->docSentParts + 1 != i->docPartsCount)) {
-			currentFailed();
-			return;
-		}
-		mtpRequestId requestId;
+		QByteArray toSend = i->docReadParts.front();
+		i->docReadParts.pop_front();
 		if (i->docSize > UseBigFilesFrom) {
-			requestId = MTP::send(MTPupload_SaveBigFilePart(MTP_long(i->id()), MTP_int(i->docSentParts), MTP_int(i->docPartsCount), MTP_string(toSend)), rpcDone(&FileUploader::partLoaded), rpcFail(&FileUploader::partFailed), MTP::uplDcId(todc));
+			requestId = MTP::send(MTPupload_SaveBigFilePart(MTP_long(i->docFileId), MTP_int(i->docSentParts), MTP_int(i->docPartsCount), MTP_string(toSend)), rpcDone(&FileUploader::partLoaded), rpcFail(&FileUploader::partFailed), MTP::uplDcId(todc));
 		} else {
-			requestId = MTP::send(MTPupload_SaveFilePart(MTP_long(i->id()), MTP_int(i->docSentParts), MTP_string(toSend)), rpcDone(&FileUploader::partLoaded), rpcFail(&FileUploader::partFailed), MTP::uplDcId(todc));
+			requestId = MTP::send(MTPupload_SaveFilePart(MTP_long(i->docFileId), MTP_int(i->docSentParts), MTP_string(toSend)), rpcDone(&FileUploader::partLoaded), rpcFail(&FileUploader::partFailed), MTP::uplDcId(todc));
 		}
-		docRequestsSent.insert(requestId, i->docSentParts);
-		dcMap.insert(requestId, todc);
+		requestsSent.insert(requestId, SentPart(i.key(), i->docSentParts, i->docPartSize, todc, true, ms));
 		sentSize += i->docPartSize;
 		sentSizes[todc] += i->docPartSize;
 
-		i->docSentParts++;
+		++i->docSentParts;
+		++i->docPartsSending;
 	} else {
 		UploadFileParts::iterator part = parts.begin();
 
-		mtpRequestId requestId = MTP::send(MTPupload_SaveFilePart(MTP_long(partsOfId), MTP_int(part.key()), MTP_string(part.value())), rpcDone(&FileUploader::partLoaded), rpcFail(&FileUploader::partFailed), MTP::uplDcId(todc));
-		requestsSent.insert(requestId, part.value());
-		dcMap.insert(requestId, todc);
+		requestId = MTP::send(MTPupload_SaveFilePart(MTP_long(partsOfId), MTP_int(part.key()), MTP_string(part.value())), rpcDone(&FileUploader::partLoaded), rpcFail(&FileUploader::partFailed), MTP::uplDcId(todc));
+		requestsSent.insert(requestId, SentPart(i.key(), part.key(), part.value().size(), todc, false, ms));
 		sentSize += part.value().size();
 		sentSizes[todc] += part.value().size();
 
 		parts.erase(part);
+		++i->partsSending;
 	}
-	nextTimer.start(UploadRequestInterval);
+	return true;
+}
+
+void FileUploader::readAhead(Queue::iterator i) {
+	if (i->docReading || i->docPartsCount <= 0) return;
+
+	if (!i->docReader) {
+		if (!resumeUpload(i)) {
+			// nothing was sent yet, so the part size can be chosen for the current connection speed
+			i->setDocSize(i->docSize, preferredPartSize());
+		}
+
+		const QByteArray &content(i->file ? i->file->content : i->media.data);
+		i->docReader = PartsReaderPtr(new PartsReader(i->docResumePath(), content, i->docPartSize, i->docPartsCount, i->docSize <= UseBigFilesFrom));
+		i->docReader->partsRead = i->docSentParts;
+	}
+
+	int32 count = qMin(int32(UploadReadAheadParts) - i->docReadParts.size(), i->docPartsCount - i->docSentParts - i->docReadParts.size());
+	if (count > 0) {
+		i->docReading = true;
+		_reader->addTask(new UploadPartsReadTask(this, i.key(), i->docReader, count));
+	}
+}
+
+bool FileUploader::resumeUpload(Queue::iterator i) {
+	QString path = i->docResumePath();
+	if (path.isEmpty()) return false;
+
+	uint64 fileId = 0;
+	int32 partSize = 0, partsCount = 0, sentParts = 0;
+	if (!Local::readUploadedParts(path, i->docSize, fileId, partSize, partsCount, sentParts)) {
+		return false;
+	}
+	for (Queue::const_iterator j = queue.cbegin(), e = queue.cend(); j != e; ++j) {
+		if (j->docFileId == fileId) { // the same file is being uploaded right now
+			return false;
+		}
+	}
+
+	LOG(("Upload Info: continuing upload of %1 from part %2 of %3").arg(path).arg(sentParts).arg(partsCount));
+	i->docFileId = fileId;
+	i->docPartSize = partSize;
+	i->docPartsCount = partsCount;
+	i->docSentParts = i->docConfirmedParts = sentParts;
+	return true;
+}
+
+void FileUploader::docPartConfirmed(Queue::iterator i, int32 part) {
+	if (part < i->docConfirmedParts) return;
+
+	i->docConfirmedAhead.insert(part);
+	int32 was = i->docConfirmedParts;
+	while (i->docConfirmedAhead.remove(i->docConfirmedParts)) {
+		++i->docConfirmedParts;
+	}
+	if (i->docConfirmedParts > was && i->docConfirmedParts < i->docPartsCount) {
+		Local::writeUploadedParts(i->docResumePath(), i->docFileId, i->docSize, i->docPartSize, i->docPartsCount, i->docConfirmedParts);
+	}
+}
+
+void FileUploader::partsRead(const FullMsgId &msgId, const PartsReaderPtr &reader, const QList<QByteArray> &parts) {
+	Queue::iterator i = queue.find(msgId);
+	if (i == queue.end() || i->docReader != reader) return;
+
+	i->docReading = false;
+	if (reader->failed) {
+		fileFailed(msgId);
+		return;
+	}
+	i->docReadParts.append(parts);
+	sendNext();
+}
+
+void FileUploader::sendReady() {
+	// files are reported in the queue order, so the messages are sent in the order they were added
+	while (!queue.isEmpty() && !_paused.msg) {
+		Queue::iterator i = queue.begin();
+		if (!i->uploaded() || i->docReading) break;
+
+		FullMsgId msgId = i.key();
+		bool silent = i->file && i->file->to.silent;
+		if (i->type() == PreparePhoto) {
+			emit photoReady(msgId, silent, MTP_inputFile(MTP_long(i->id()), MTP_int(i->partsCount), MTP_string(i->filename()), MTP_string(i->file ? i->file->filemd5 : i->media.jpeg_md5)));
+		} else if (i->type() == PrepareDocument || i->type() == PrepareAudio) {
+			QByteArray docMd5(32, Qt::Uninitialized);
+			if (i->docReader) {
+				hashMd5Hex(i->docReader->md5Hash.result(), docMd5.data());
+			} else {
+				hashMd5Hex(HashMd5().result(), docMd5.data());
+			}
+
+			MTPInputFile doc = (i->docSize > UseBigFilesFrom) ? MTP_inputFileBig(MTP_long(i->docFileId), MTP_int(i->docPartsCount), MTP_string(i->filename())) : MTP_inputFile(MTP_long(i->docFileId), MTP_int(i->docPartsCount), MTP_string(i->filename()), MTP_string(docMd5));
+			Local::clearUploadedParts(i->docResumePath());
+			if (i->partsCount) {
+				emit thumbDocumentReady(msgId, silent, doc, MTP_inputFile(MTP_long(i->thumbId()), MTP_int(i->partsCount), MTP_string(i->file ? i->file->thumbname : (qsl("thumb.") + i->media.thumbExt)), MTP_string(i->file ? i->file->thumbmd5 : i->media.jpeg_md5)));
+			} else {
+				emit documentReady(msgId, silent, doc);
+			}
+		}
+		queue.remove(msgId);
+	}
+	if (queue.isEmpty() && _speed) {
+		LOG(("Upload Info: queue finished, speed %1 kb/s, round trip %2 ms").arg(_speed / 1024).arg(_rtt));
+	}
+}
+
+void FileUploader::partSent(const SentPart &part, uint64 ms) {
+	sentSize -= part.size;
+	sentSizes[part.dc] -= part.size;
+
+	int32 rtt = int32(ms - part.sent);
+	_rtt = _rtt ? ((_rtt * 3 + rtt) / 4) : rtt;
+	_statsBytes += part.size;
+	if (ms >= _statsStart + UploadStatsPeriod) {
+		_speed = int32(_statsBytes * 1000 / int64(ms - _statsStart));
+		_statsStart = ms;
+		_statsBytes = 0;
+
+		// keep twice the bandwidth-delay product in flight
+		sentLimit = snap(uint32(int64(_speed) * _rtt * 2 / 1000), uint32(MaxUploadFileParallelSize), uint32(MaxUploadFileParallelSizeAdaptive));
+		DEBUG_LOG(("Upload Info: speed %1 kb/s, round trip %2 ms, in-flight limit %3 kb").arg(_speed / 1024).arg(_rtt).arg(sentLimit / 1024));
+	}
+}
+
+int32 FileUploader::preferredPartSize() const {
+	// a part in each session is uploaded about a quarter of a second
+	int32 wanted = _speed / (4 * MTPUploadSessionsCount), result = DocumentUploadPartSize0;
+	while (result < DocumentUploadPartSize4 && result * 2 <= wanted) {
+		result *= 2;
+	}
+	return result;
 }
 
 void FileUploader::cancel(const FullMsgId &msgId) {
 	uploaded.remove(msgId);
-	if (uploading == msgId) {
-		currentFailed();
+
+	Queue::iterator i = queue.find(msgId);
+	if (i == queue.end()) return;
+
+	bool started = (i->parts().size() != i->partsCount) || i->partsSending || i->docSentParts || i->docPartsSending || i->docReading;
+	if (started) {
+		fileFailed(msgId);
 	} else {
-		queue.remove(msgId);
+		queue.erase(i);
 	}
 }
 
@@ -235,15 +419,10 @@ void FileUploader::confirm(const FullMsgId &msgId) {
 void FileUploader::clear() {
 	uploaded.clear();
 	queue.clear();
-	for (QMap<mtpRequestId, QByteArray>::const_iterator i = requestsSent.cbegin(), e = requestsSent.cend(); i != e; ++i) {
+	for (SentParts::const_iterator i = requestsSent.cbegin(), e = requestsSent.cend(); i != e; ++i) {
 		MTP::cancel(i.key());
 	}
 	requestsSent.clear();
-	for (QMap<mtpRequestId, int32>::const_iterator i = docRequestsSent.cbegin(), e = docRequestsSent.cend(); i != e; ++i) {
-		MTP::cancel(i.key());
-	}
-	docRequestsSent.clear();
-	dcMap.clear();
 	sentSize = 0;
 	for (int32 i = 0; i < MTPUploadSessionsCount; ++i) {
 		MTP::stopSession(MTP::uplDcId(i));
@@ -253,37 +432,26 @@ void FileUploader::clear() {
 }
 
 void FileUploader::partLoaded(const MTPBool &result, mtpRequestId requestId) {
-	QMap<mtpRequestId, int32>::iterator j = docRequestsSent.end();
-	QMap<mtpRequestId, QByteArray>::iterator i = requestsSent.find(requestId);
-	if (i == requestsSent.cend()) {
-		j = docRequestsSent.find(requestId);
-	}
-	if (i != requestsSent.cend() || j != docRequestsSent.cend()) {
-		if (mtpIsFalse(result)) { // failed to upload current file
-			currentFailed();
-			return;
-		} else {
-			QMap<mtpRequestId, int32>::iterator dcIt = dcMap.find(requestId);
-			if (dcIt == dcMap.cend()) { // must not happen
-				currentFailed();
+	SentParts::iterator i = requestsSent.find(requestId);
+	if (i != requestsSent.cend()) {
+		SentPart part = i.value();
+		requestsSent.erase(i);
+		partSent(part, getms());
+
+		Queue::iterator k = queue.find(part.msgId);
+		if (k != queue.end()) {
+			if (mtpIsFalse(result)) { // failed to upload this file
+				fileFailed(part.msgId);
 				return;
 			}
-			int32 dc = dcIt.value();
-			dcMap.erase(dcIt);
-
-			int32 sentPartSize = 0;
-			Queue::const_iterator k = queue.constFind(uploading);
-			if (i != requestsSent.cend()) {
-				sentPartSize = i.value().size();
-				requestsSent.erase(i);
+			if (part.doc) {
+				--k->docPartsSending;
+				docPartConfirmed(k, part.part);
 			} else {
-				sentPartSize = k->docPartSize;
-				docRequestsSent.erase(j);
+				--k->partsSending;
 			}
-			sentSize -= sentPartSize;
-			sentSizes[dc] -= sentPartSize;
 			if (k->type() == PreparePhoto) {
-				k->fileSentSize += sentPartSize;
+				k->fileSentSize += part.size;
 				PhotoData *photo = App::photo(k->id());
 				if (photo->uploading() && k->file) {
 					photo->uploadingData->size = k->file->partssize;
@@ -293,7 +461,7 @@ void FileUploader::partLoaded(const MTPBool &result, mtpRequestId requestId) {
 			} else if (k->type() == PrepareDocument || k->type() == PrepareAudio) {
 				DocumentData *doc = App::document(k->id());
 				if (doc->uploading()) {
-					doc->uploadOffset = (k->docSentParts - docRequestsSent.size()) * k->docPartSize;
+					doc->uploadOffset = (k->docSentParts - k->docPartsSending) * k->docPartSize;
 					if (doc->uploadOffset > doc->size) {
 						doc->uploadOffset = doc->size;
 					}
@@ -309,8 +477,14 @@ void FileUploader::partLoaded(const MTPBool &result, mtpRequestId requestId) {
 bool FileUploader::partFailed(const RPCError &error, mtpRequestId requestId) {
 	if (mtpIsFlood(error)) return false;
 
-	if (requestsSent.constFind(requestId) != requestsSent.cend() || docRequestsSent.constFind(requestId) != docRequestsSent.cend()) { // failed to upload current file
-		currentFailed();
+	SentParts::iterator i = requestsSent.find(requestId);
+	if (i != requestsSent.cend()) { // failed to upload this file
+		FullMsgId msgId = i->msgId;
+		sentSize -= i->size;
+		sentSizes[i->dc] -= i->size;
+		requestsSent.erase(i);
+		fileFailed(msgId);
+		return true;
 	}
 	sendNext();
 	return true;
@@ -33,6 +33,9 @@ public:
 
 	int32 currentOffset(const FullMsgId &msgId) const; // -1 means file not found
 	int32 fullSize(const FullMsgId &msgId) const;
+	int32 currentSpeed() const { // bytes per second of all the uploads together
+		return _speed;
+	}
 
 	void cancel(const FullMsgId &msgId);
 	void pause(const FullMsgId &msgId);
@@ -40,6 +43,26 @@ public:
 
 	void clear();
 
+	// document parts are read and hashed in the uploader thread
+	struct PartsReader {
+		PartsReader(const QString &filepath, const QByteArray &content, int32 partSize, int32 partsCount, bool hash)
+			: file(filepath)
+			, content(content)
+			, partSize(partSize)
+			, partsCount(partsCount)
+			, partsRead(0)
+			, hash(hash)
+			, failed(false) {
+		}
+		QFile file;
+		QByteArray content;
+		HashMd5 md5Hash;
+		int32 partSize, partsCount, partsRead;
+		bool hash, failed;
+	};
+	typedef QSharedPointer<PartsReader> PartsReaderPtr;
+	void partsRead(const FullMsgId &msgId, const PartsReaderPtr &reader, const QList<QByteArray> &parts);
+
 public slots:
 
 	void unpause();
@@ -61,15 +84,17 @@ signals:
 private:
 
 	struct File {
-		File(const ReadyLocalMedia &media) : media(media), docSentParts(0) {
+		File(const ReadyLocalMedia &media) : media(media), fileSentSize(0), partsSending(0), docSentParts(0), docConfirmedParts(0), docPartsSending(0), docReading(false) {
 			partsCount = media.parts.size();
+			docFileId = id();
 			if (type() == PrepareDocument || type() == PrepareAudio) {
 				setDocSize(media.file.isEmpty() ? media.data.size() : media.filesize);
 			} else {
 				docSize = docPartSize = docPartsCount = 0;
 			}
 		}
-		File(const FileLoadResultPtr &file) : file(file), docSentParts(0) {
+		File(const FileLoadResultPtr &file) : file(file), fileSentSize(0), partsSending(0), docSentParts(0), docConfirmedParts(0), docPartsSending(0), docReading(false) {
+			docFileId = file->id;
 			partsCount = (type() == PreparePhoto) ? file->fileparts.size() : file->thumbparts.size();
 			if (type() == PrepareDocument || type() == PrepareAudio) {
 				setDocSize(file->filesize);
@@ -77,7 +102,7 @@ private:
 				docSize = docPartSize = docPartsCount = 0;
 			}
 		}
-		void setDocSize(int32 size) {
+		void setDocSize(int32 size, int32 minPartSize = 0) {
 			docSize = size;
 			if (docSize >= 1024 * 1024 || !setPartSize(DocumentUploadPartSize0)) {
 				if (docSize > 32 * 1024 * 1024 || !setPartSize(DocumentUploadPartSize1)) {
@@ -90,6 +115,9 @@ private:
 					}
 				}
 			}
+			if (minPartSize > docPartSize && docSize > docPartSize) { // fast connection, send less parts of a larger size
+				setPartSize(qMin(minPartSize, int32(DocumentUploadPartSize4)));
+			}
 		}
 		bool setPartSize(uint32 partSize) {
 			docPartSize = partSize;
@@ -101,6 +129,7 @@ private:
 		ReadyLocalMedia media;
 		int32 partsCount;
 		mutable int32 fileSentSize;
+		int32 partsSending;
 
 		uint64 id() const {
 			return file ? file->id : media.id;
@@ -114,31 +143,70 @@ private:
 		const QString &filename() const {
 			return file ? file->filename : media.filename;
 		}
+		UploadFileParts &parts() {
+			return file ? (type() == PreparePhoto ? file->fileparts : file->thumbparts) : media.parts;
+		}
+		bool sent() { // all parts were sent, some of them may be still not confirmed
+			return parts().isEmpty() && docSentParts >= docPartsCount;
+		}
+		bool uploaded() {
+			return sent() && !partsSending && !docPartsSending;
+		}
+		QString docResumePath() const { // uploads of local files can be continued after the app restart
+			return (file ? file->content : media.data).isEmpty() ? (file ? file->filepath : media.file) : QString();
+		}
 
-		HashMd5 md5Hash;
-
-		QSharedPointer<QFile> docFile;
+		PartsReaderPtr docReader;
+		QList<QByteArray> docReadParts; // read ahead parts waiting to be sent
+		uint64 docFileId; // differs from id() if the upload is continued
 		int32 docSentParts;
+		int32 docConfirmedParts; // all parts before it were confirmed by the server
+		QSet<int32> docConfirmedAhead;
+		int32 docPartsSending;
 		int32 docSize;
 		int32 docPartSize;
 		int32 docPartsCount;
+		bool docReading;
 	};
 	typedef QMap<FullMsgId, File> Queue;
 
+	struct SentPart {
+		SentPart(const FullMsgId &msgId = FullMsgId(), int32 part = 0, int32 size = 0, int32 dc = 0, bool doc = false, uint64 sent = 0) : msgId(msgId), part(part), size(size), dc(dc), doc(doc), sent(sent) {
+		}
+		FullMsgId msgId;
+		int32 part, size, dc;
+		bool doc;
+		uint64 sent;
+	};
+	typedef QMap<mtpRequestId, SentPart> SentParts;
+
+	bool sendPart(Queue::iterator i);
+	void readAhead(Queue::iterator i);
+	bool resumeUpload(Queue::iterator i);
+	void docPartConfirmed(Queue::iterator i, int32 part);
+	void sendReady();
+	void partSent(const SentPart &part, uint64 ms);
+	int32 preferredPartSize() const;
+
 	void partLoaded(const MTPBool &result, mtpRequestId requestId);
 	bool partFailed(const RPCError &err, mtpRequestId requestId);
 
-	void currentFailed();
+	void fileFailed(const FullMsgId &msgId);
 
-	QMap<mtpRequestId, QByteArray> requestsSent;
-	QMap<mtpRequestId, int32> docRequestsSent;
-	QMap<mtpRequestId, int32> dcMap;
-	uint32 sentSize;
+	SentParts requestsSent;
+	uint32 sentSize, sentLimit;
 	uint32 sentSizes[MTPUploadSessionsCount];
 
-	FullMsgId uploading, _paused;
+	// throughput of all the uploads, in-flight limit is adjusted to cover the round trip time
+	uint64 _statsStart;
+	int64 _statsBytes;
+	int32 _speed, _rtt;
+
+	FullMsgId _paused;
 	Queue queue;
 	Queue uploaded;
 	QTimer nextTimer, killSessionsTimer;
 
+	TaskQueue *_reader;
+
 };
@@ -592,8 +592,9 @@ void FlatTextarea::parseLinks() { // some code is duplicated in text.cpp!
 
 	int32 len = text.size();
 	const QChar *start = text.unicode(), *end = start + text.size();
+	TextEntitySearch searchDomain(reDomain(), text, QChar('.'));
 	for (int32 offset = 0, matchOffset = offset; offset < len;) {
-		QRegularExpressionMatch m = reDomain().match(text, matchOffset);
+		QRegularExpressionMatch m = searchDomain.match(matchOffset);
 		if (!m.hasMatch()) break;
 
 		int32 domainOffset = m.capturedStart();
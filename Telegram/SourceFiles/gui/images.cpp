@@ -43,6 +43,11 @@ namespace {
 
 	int64 globalAcquiredSize = 0;
 
+	// images holding decoded pixmaps, least recently used first
+	typedef QLinkedList<const Image*> CachedImages;
+	CachedImages cachedImages;
+	uint32 cacheGeneration = 1; // increased after each paint of the main window, see paintedImageCache()
+
 	static const uint64 BlurredCacheSkip = 0x1000000000000000LLU;
 	static const uint64 ColoredCacheSkip = 0x2000000000000000LLU;
 	static const uint64 BlurredColoredCacheSkip = 0x3000000000000000LLU;
@@ -67,7 +72,7 @@ Image::Image(const QString &file, QByteArray fmt) : _forgot(false) {
 	_data = QPixmap::fromImage(App::readImage(file, &fmt, false, 0, &_saved), Qt::ColorOnly);
 	_format = fmt;
 	if (!_data.isNull()) {
-		globalAcquiredSize += int64(_data.width()) * _data.height() * 4;
+		acquire(_data);
 	}
 }
 
@@ -76,13 +81,13 @@ Image::Image(const QByteArray &filecontent, QByteArray fmt) : _forgot(false) {
 	_format = fmt;
 	_saved = filecontent;
 	if (!_data.isNull()) {
-		globalAcquiredSize += int64(_data.width()) * _data.height() * 4;
+		acquire(_data);
 	}
 }
 
 Image::Image(const QPixmap &pixmap, QByteArray format) : _format(format), _forgot(false), _data(pixmap) {
 	if (!_data.isNull()) {
-		globalAcquiredSize += int64(_data.width()) * _data.height() * 4;
+		acquire(_data);
 	}
 }
 
@@ -91,12 +96,13 @@ Image::Image(const QByteArray &filecontent, QByteArray fmt, const QPixmap &pixma
 	_format = fmt;
 	_saved = filecontent;
 	if (!_data.isNull()) {
-		globalAcquiredSize += int64(_data.width()) * _data.height() * 4;
+		acquire(_data);
 	}
 }
 
 const QPixmap &Image::pix(int32 w, int32 h) const {
 	checkload();
+	touch();
 
 	if (w <= 0 || !width() || !height()) {
         w = width();
@@ -111,7 +117,7 @@ const QPixmap &Image::pix(int32 w, int32 h) const {
         if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
 		i = _sizesCache.insert(k, p);
 		if (!p.isNull()) {
-			globalAcquiredSize += int64(p.width()) * p.height() * 4;
+			acquire(p);
 		}
 	}
 	return i.value();
@@ -119,6 +125,7 @@ const QPixmap &Image::pix(int32 w, int32 h) const {
 
 const QPixmap &Image::pixRounded(int32 w, int32 h) const {
 	checkload();
+	touch();
 
 	if (w <= 0 || !width() || !height()) {
 		w = width();
@@ -133,7 +140,7 @@ const QPixmap &Image::pixRounded(int32 w, int32 h) const {
 		if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
 		i = _sizesCache.insert(k, p);
 		if (!p.isNull()) {
-			globalAcquiredSize += int64(p.width()) * p.height() * 4;
+			acquire(p);
 		}
 	}
 	return i.value();
@@ -141,6 +148,7 @@ const QPixmap &Image::pixRounded(int32 w, int32 h) const {
 
 const QPixmap &Image::pixCircled(int32 w, int32 h) const {
 	checkload();
+	touch();
 
 	if (w <= 0 || !width() || !height()) {
 		w = width();
@@ -155,7 +163,7 @@ const QPixmap &Image::pixCircled(int32 w, int32 h) const {
 		if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
 		i = _sizesCache.insert(k, p);
 		if (!p.isNull()) {
-			globalAcquiredSize += int64(p.width()) * p.height() * 4;
+			acquire(p);
 		}
 	}
 	return i.value();
@@ -163,6 +171,7 @@ const QPixmap &Image::pixCircled(int32 w, int32 h) const {
 
 const QPixmap &Image::pixBlurred(int32 w, int32 h) const {
 	checkload();
+	touch();
 
 	if (w <= 0 || !width() || !height()) {
 		w = width() * cIntRetinaFactor();
@@ -177,7 +186,7 @@ const QPixmap &Image::pixBlurred(int32 w, int32 h) const {
 		if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
 		i = _sizesCache.insert(k, p);
 		if (!p.isNull()) {
-			globalAcquiredSize += int64(p.width()) * p.height() * 4;
+			acquire(p);
 		}
 	}
 	return i.value();
@@ -185,6 +194,7 @@ const QPixmap &Image::pixBlurred(int32 w, int32 h) const {
 
 const QPixmap &Image::pixColored(const style::color &add, int32 w, int32 h) const {
 	checkload();
+	touch();
 
 	if (w <= 0 || !width() || !height()) {
 		w = width() * cIntRetinaFactor();
@@ -199,7 +209,7 @@ const QPixmap &Image::pixColored(const style::color &add, int32 w, int32 h) cons
 		if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
 		i = _sizesCache.insert(k, p);
 		if (!p.isNull()) {
-			globalAcquiredSize += int64(p.width()) * p.height() * 4;
+			acquire(p);
 		}
 	}
 	return i.value();
@@ -207,6 +217,7 @@ const QPixmap &Image::pixColored(const style::color &add, int32 w, int32 h) cons
 
 const QPixmap &Image::pixBlurredColored(const style::color &add, int32 w, int32 h) const {
 	checkload();
+	touch();
 
 	if (w <= 0 || !width() || !height()) {
 		w = width() * cIntRetinaFactor();
@@ -221,7 +232,7 @@ const QPixmap &Image::pixBlurredColored(const style::color &add, int32 w, int32
 		if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
 		i = _sizesCache.insert(k, p);
 		if (!p.isNull()) {
-			globalAcquiredSize += int64(p.width()) * p.height() * 4;
+			acquire(p);
 		}
 	}
 	return i.value();
@@ -229,6 +240,7 @@ const QPixmap &Image::pixBlurredColored(const style::color &add, int32 w, int32
 
 const QPixmap &Image::pixSingle(int32 w, int32 h, int32 outerw, int32 outerh) const {
 	checkload();
+	touch();
 
 	if (w <= 0 || !width() || !height()) {
 		w = width() * cIntRetinaFactor();
@@ -240,13 +252,13 @@ const QPixmap &Image::pixSingle(int32 w, int32 h, int32 outerw, int32 outerh) co
 	Sizes::const_iterator i = _sizesCache.constFind(k);
 	if (i == _sizesCache.cend() || i->width() != (outerw * cIntRetinaFactor()) || i->height() != (outerh * cIntRetinaFactor())) {
 		if (i != _sizesCache.cend()) {
-			globalAcquiredSize -= int64(i->width()) * i->height() * 4;
+			release(*i);
 		}
 		QPixmap p(pixNoCache(w, h, ImagePixSmooth | ImagePixRounded, outerw, outerh));
 		if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
 		i = _sizesCache.insert(k, p);
 		if (!p.isNull()) {
-			globalAcquiredSize += int64(p.width()) * p.height() * 4;
+			acquire(p);
 		}
 	}
 	return i.value();
@@ -254,6 +266,7 @@ const QPixmap &Image::pixSingle(int32 w, int32 h, int32 outerw, int32 outerh) co
 
 const QPixmap &Image::pixBlurredSingle(int w, int h, int32 outerw, int32 outerh) const {
 	checkload();
+	touch();
 
 	if (w <= 0 || !width() || !height()) {
 		w = width() * cIntRetinaFactor();
@@ -265,13 +278,13 @@ const QPixmap &Image::pixBlurredSingle(int w, int h, int32 outerw, int32 outerh)
 	Sizes::const_iterator i = _sizesCache.constFind(k);
 	if (i == _sizesCache.cend() || i->width() != (outerw * cIntRetinaFactor()) || i->height() != (outerh * cIntRetinaFactor())) {
 		if (i != _sizesCache.cend()) {
-			globalAcquiredSize -= int64(i->width()) * i->height() * 4;
+			release(*i);
 		}
 		QPixmap p(pixNoCache(w, h, ImagePixSmooth | ImagePixBlurred | ImagePixRounded, outerw, outerh));
 		if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
 		i = _sizesCache.insert(k, p);
 		if (!p.isNull()) {
-			globalAcquiredSize += int64(p.width()) * p.height() * 4;
+			acquire(p);
 		}
 	}
 	return i.value();
@@ -541,6 +554,7 @@ QPixmap imagePix(QImage img, int32 w, int32 h, ImagePixOptions options, int32 ou
 QPixmap Image::pixNoCache(int w, int h, ImagePixOptions options, int outerw, int outerh) const {
 	if (!loading()) const_cast<Image*>(this)->load();
 	restore();
+	touch();
 
 	if (_data.isNull()) {
 		if (h <= 0 && height() > 0) {
@@ -583,6 +597,7 @@ QPixmap Image::pixNoCache(int w, int h, ImagePixOptions options, int outerw, int
 QPixmap Image::pixColoredNoCache(const style::color &add, int32 w, int32 h, bool smooth) const {
 	const_cast<Image*>(this)->load();
 	restore();
+	touch();
 	if (_data.isNull()) return blank()->pix();
 
 	QImage img = _data.toImage();
@@ -596,6 +611,7 @@ QPixmap Image::pixColoredNoCache(const style::color &add, int32 w, int32 h, bool
 QPixmap Image::pixBlurredColoredNoCache(const style::color &add, int32 w, int32 h) const {
 	const_cast<Image*>(this)->load();
 	restore();
+	touch();
 	if (_data.isNull()) return blank()->pix();
 
 	QImage img = imageBlur(_data.toImage());
@@ -624,7 +640,7 @@ void Image::forget() const {
 			}
 		}
 	}
-	globalAcquiredSize -= int64(_data.width()) * _data.height() * 4;
+	release(_data);
 	_data = QPixmap();
 	_forgot = true;
 }
@@ -640,7 +656,7 @@ void Image::restore() const {
 	_data = QPixmap::fromImageReader(&reader, Qt::ColorOnly);
 
 	if (!_data.isNull()) {
-		globalAcquiredSize += int64(_data.width()) * _data.height() * 4;
+		acquire(_data);
 	}
 	_forgot = false;
 }
@@ -648,16 +664,47 @@ void Image::restore() const {
 void Image::invalidateSizeCache() const {
 	for (Sizes::const_iterator i = _sizesCache.cbegin(), e = _sizesCache.cend(); i != e; ++i) {
 		if (!i->isNull()) {
-			globalAcquiredSize -= int64(i->width()) * i->height() * 4;
+			release(*i);
 		}
 	}
 	_sizesCache.clear();
 }
 
+void Image::acquire(const QPixmap &pixmap) const {
+	int64 size = int64(pixmap.width()) * pixmap.height() * 4;
+	if (!size) return;
+
+	if (!_acquiredSize) {
+		_cachedIt = cachedImages.insert(cachedImages.end(), this);
+	}
+	_acquiredSize += size;
+	globalAcquiredSize += size;
+	touch();
+}
+
+void Image::release(const QPixmap &pixmap) const {
+	int64 size = int64(pixmap.width()) * pixmap.height() * 4;
+	if (!size) return;
+
+	_acquiredSize -= size;
+	globalAcquiredSize -= size;
+	if (!_acquiredSize) {
+		cachedImages.erase(_cachedIt);
+	}
+}
+
+void Image::touch() const {
+	if (_acquiredSize && _usedGeneration != cacheGeneration) { // move to back
+		cachedImages.erase(_cachedIt);
+		_cachedIt = cachedImages.insert(cachedImages.end(), this);
+	}
+	_usedGeneration = cacheGeneration;
+}
+
 Image::~Image() {
 	invalidateSizeCache();
 	if (!_data.isNull()) {
-		globalAcquiredSize -= int64(_data.width()) * _data.height() * 4;
+		release(_data);
 	}
 }
 
@@ -719,6 +766,26 @@ int64 imageCacheSize() {
 	return globalAcquiredSize;
 }
 
+void collectImageCache(int64 budget) {
+	CachedImages::iterator i = cachedImages.begin();
+	for (int left = cachedImages.size(); left > 0 && globalAcquiredSize > budget && i != cachedImages.end(); --left) {
+		const Image *image = *i;
+		if (image->_usedGeneration == cacheGeneration) {
+			break; // this and all the following images were used after the previous paint
+		}
+		++i; // forgetting the image removes it from the list
+
+		image->invalidateSizeCache();
+		if (!image->_saved.isEmpty()) { // others would be encoded to be restored later, keep them
+			image->forget();
+		}
+	}
+}
+
+void paintedImageCache() {
+	++cacheGeneration;
+}
+
 void RemoteImage::doCheckload() const {
 	if (!amLoading() || !_loader->done()) return;
 
@@ -731,14 +798,14 @@ void RemoteImage::doCheckload() const {
 	}
 
 	if (!_data.isNull()) {
-		globalAcquiredSize -= int64(_data.width()) * _data.height() * 4;
+		release(_data);
 	}
 
 	_format = _loader->imageFormat();
 	_data = data;
 	_saved = _loader->bytes();
 	const_cast<RemoteImage*>(this)->setInformation(_saved.size(), _data.width(), _data.height());
-	globalAcquiredSize += int64(_data.width()) * _data.height() * 4;
+	acquire(_data);
 
 	invalidateSizeCache();
 
@@ -760,12 +827,12 @@ void RemoteImage::setData(QByteArray &bytes, const QByteArray &bytesFormat) {
 	QBuffer buffer(&bytes);
 
 	if (!_data.isNull()) {
-		globalAcquiredSize -= int64(_data.width()) * _data.height() * 4;
+		release(_data);
 	}
 	QByteArray fmt(bytesFormat);
 	_data = QPixmap::fromImage(App::readImage(bytes, &fmt, false), Qt::ColorOnly);
 	if (!_data.isNull()) {
-		globalAcquiredSize += int64(_data.width()) * _data.height() * 4;
+		acquire(_data);
 		setInformation(bytes.size(), _data.width(), _data.height());
 	}
 
@@ -783,6 +850,13 @@ void RemoteImage::setData(QByteArray &bytes, const QByteArray &bytesFormat) {
 void RemoteImage::automaticLoad(const HistoryItem *item) {
 	if (loaded()) return;
 
+	startAutomaticLoad(item);
+	if (amLoading() && !_loader->onScreen()) {
+		_loader->schedule(LoadPriorityOnScreen); // it is shown right now, so it goes before all prefetched ones
+	}
+}
+
+void RemoteImage::startAutomaticLoad(const HistoryItem *item) {
 	if (_loader != CancelledFileLoader && item) {
 		bool loadFromCloud = false;
 		if (item->history()->peer->isUser()) {
@@ -795,7 +869,7 @@ void RemoteImage::automaticLoad(const HistoryItem *item) {
 			if (loadFromCloud) _loader->permitLoadFromCloud();
 		} else {
 			_loader = createLoader(loadFromCloud ? LoadFromCloudOrLocal : LoadFromLocalOnly, true);
-			if (_loader) _loader->start();
+			if (_loader) _loader->schedule(LoadPriorityPrefetch);
 		}
 	}
 }
@@ -805,6 +879,26 @@ void RemoteImage::automaticLoadSettingsChanged() {
 	_loader = 0;
 }
 
+void RemoteImage::prefetch(const HistoryItem *item, uint64 deadline) {
+	if (loaded() || _loader == CancelledFileLoader) return;
+
+	if (!_loader) {
+		startAutomaticLoad(item);
+	}
+	if (amLoading() && _loader->priorityClass() == LoadPriorityPrefetch && (_loader->loading() || _loader->paused())) {
+		_loader->schedule(LoadPriorityPrefetch, deadline);
+	}
+}
+
+void RemoteImage::cancelPrefetch() {
+	if (!amLoading() || !_loader->loading() || _loader->priorityClass() != LoadPriorityPrefetch) return;
+
+	// keep the loaders that already got some bytes, they will be finished
+	if (!_loader->loadingLocal() && !_loader->currentOffset(true)) {
+		_loader->pause();
+	}
+}
+
 void RemoteImage::load(bool loadFirst, bool prior) {
 	if (loaded()) return;
 
@@ -822,9 +916,6 @@ void RemoteImage::loadEvenCancelled(bool loadFirst, bool prior) {
 }
 
 RemoteImage::~RemoteImage() {
-	if (!_data.isNull()) {
-		globalAcquiredSize -= int64(_data.width()) * _data.height() * 4;
-	}
 	if (amLoading()) {
 		_loader->deleteLater();
 		_loader->stop();
@@ -132,6 +132,10 @@ public:
 	}
 	virtual void automaticLoadSettingsChanged() {
 	}
+	virtual void prefetch(const HistoryItem *item, uint64 deadline) { // auto load photo before it is shown, deadline - getms() when it is expected on screen
+	}
+	virtual void cancelPrefetch() {
+	}
 
 	virtual bool loaded() const {
 		return true;
@@ -210,6 +214,11 @@ protected:
 	}
 	void invalidateSizeCache() const;
 
+	// counts the decoded pixmap in the image cache size, see collectImageCache()
+	void acquire(const QPixmap &pixmap) const;
+	void release(const QPixmap &pixmap) const;
+	void touch() const;
+
 	virtual int32 countWidth() const {
 		restore();
 		return _data.width();
@@ -229,6 +238,13 @@ private:
 	typedef QMap<uint64, QPixmap> Sizes;
 	mutable Sizes _sizesCache;
 
+	// position in the least recently used list of images holding decoded pixmaps
+	mutable QLinkedList<const Image*>::iterator _cachedIt;
+	mutable int64 _acquiredSize = 0;
+	mutable uint32 _usedGeneration = 0;
+
+	friend void collectImageCache(int64 budget);
+
 };
 
 Image *getImage(const QString &file, QByteArray format);
@@ -259,6 +275,8 @@ public:
 
 	void automaticLoad(const HistoryItem *item); // auto load photo
 	void automaticLoadSettingsChanged();
+	void prefetch(const HistoryItem *item, uint64 deadline);
+	void cancelPrefetch();
 
 	bool loaded() const;
 	bool loading() const {
@@ -291,6 +309,7 @@ private:
 		return _loader && _loader != CancelledFileLoader;
 	}
 	void doCheckload() const;
+	void startAutomaticLoad(const HistoryItem *item);
 
 };
 
@@ -410,6 +429,11 @@ void clearStorageImages();
 void clearAllImages();
 int64 imageCacheSize();
 
+// forgets the least recently used decoded images until imageCacheSize() fits in the budget,
+// images used after the previous paintedImageCache() call are never forgotten
+void collectImageCache(int64 budget);
+void paintedImageCache(); // called after each paint of the main window, the images on screen were just used
+
 class PsFileBookmark;
 class ReadAccessEnabler {
 public:
@@ -79,6 +79,27 @@ const QRegularExpression &reBotCommand() {
 	return _reBotCommand;
 }
 
+TextEntitySearch::TextEntitySearch(const QRegularExpression &re, const QString &text, QChar required, bool enabled) : _re(re)
+, _text(text)
+, _offset(-1)
+, _enabled(enabled && text.indexOf(required) >= 0) {
+}
+
+const QRegularExpressionMatch &TextEntitySearch::match(int offset) {
+	if (!_enabled) {
+		return _match;
+	}
+	// the match starting at some position does not depend on the offset the search started from
+	// (lookbehinds see the text before it and '^' never matches there), so while the offset
+	// stays between the previous search offset and the found match start, the result is the same
+	bool valid = (_offset >= 0 && _offset <= offset && (!_match.hasMatch() || offset <= _match.capturedStart()));
+	if (!valid) {
+		_match = _re.match(_text, offset);
+		_offset = offset;
+	}
+	return _match;
+}
+
 const style::textStyle *textstyleCurrent() {
 	return _textStyle;
 }
@@ -3495,6 +3516,43 @@ private:
 
 };
 
+namespace {
+
+	// the same names, dates and short texts are laid out again and again in messages and dialogs,
+	// so the words of shaped blocks are kept and reused, used only in the main thread
+	struct ShapedBlockKey {
+		style::FontData *font;
+		int32 minResizeWidth; // QFixed value
+		bool link; // no line breaks after '/' in links
+		QString text;
+	};
+	inline bool operator==(const ShapedBlockKey &a, const ShapedBlockKey &b) {
+		return (a.font == b.font) && (a.minResizeWidth == b.minResizeWidth) && (a.link == b.link) && (a.text == b.text);
+	}
+	inline uint qHash(const ShapedBlockKey &key, uint seed = 0) {
+		return ::qHash(key.text, seed) ^ ::qHash(quintptr(key.font)) ^ uint(key.minResizeWidth) ^ (key.link ? 0x80000000U : 0U);
+	}
+
+	struct ShapedBlock {
+		QFixed width, lpadding, rpadding;
+		QVector<TextWord> words; // word positions are counted from the block start
+	};
+	QCache<ShapedBlockKey, ShapedBlock> shapedBlocks(ShapedTextCacheSize);
+	int32 shapedBlocksHits = 0, shapedBlocksMisses = 0;
+
+	void shapedBlocksLookedUp(bool hit) {
+		if (hit) {
+			++shapedBlocksHits;
+		} else {
+			++shapedBlocksMisses;
+		}
+		if ((shapedBlocksHits + shapedBlocksMisses) % ShapedTextCacheLogPeriod == 0) {
+			DEBUG_LOG(("Text Info: shaped blocks cache %1 hits, %2 misses, %3 blocks cached").arg(shapedBlocksHits).arg(shapedBlocksMisses).arg(shapedBlocks.count()));
+		}
+	}
+
+}
+
 TextBlock::TextBlock(const style::font &font, const QString &str, QFixed minResizeWidth, uint16 from, uint16 length, uchar flags, const style::color &color, uint16 lnkIndex) : ITextBlock(font, str, from, length, flags, color, lnkIndex) {
 	_flags |= ((TextBlockTText & 0x0F) << 8);
 	if (length) {
@@ -3526,6 +3584,23 @@ TextBlock::TextBlock(const style::font &font, const QString &str, QFixed minResi
 		}
 
 		QString part = str.mid(_from, length);
+		bool cacheShaped = (part.size() <= ShapedTextCacheMaxLength);
+		ShapedBlockKey key = { blockFont.v(), minResizeWidth.value(), lnkIndex > 0, part };
+		if (cacheShaped) {
+			const ShapedBlock *shaped = shapedBlocks.object(key);
+			shapedBlocksLookedUp(shaped != 0);
+			if (shaped) {
+				_width = shaped->width;
+				_lpadding = shaped->lpadding;
+				_rpadding = shaped->rpadding;
+				_words = shaped->words;
+				for (TextWords::iterator i = _words.begin(), e = _words.end(); i != e; ++i) {
+					i->from += _from;
+				}
+				return;
+			}
+		}
+
 		QStackTextEngine engine(part, blockFont->f);
 		engine.itemize();
 
@@ -3543,6 +3618,18 @@ TextBlock::TextBlock(const style::font &font, const QString &str, QFixed minResi
 		}
 
 		layout.endLayout();
+
+		if (cacheShaped) {
+			ShapedBlock *shaped = new ShapedBlock();
+			shaped->width = _width;
+			shaped->lpadding = _lpadding;
+			shaped->rpadding = _rpadding;
+			shaped->words = _words;
+			for (QVector<TextWord>::iterator i = shaped->words.begin(), e = shaped->words.end(); i != e; ++i) {
+				i->from -= _from;
+			}
+			shapedBlocks.insert(key, shaped, sizeof(ShapedBlock) + part.size() * sizeof(QChar) + shaped->words.size() * sizeof(TextWord));
+		}
 	}
 }
 
@@ -4809,6 +4896,7 @@ EntitiesInText textParseEntities(QString &text, int32 flags, bool rich) { // som
 
 	if (withMono) { // parse mono entities (code and pre)
 		QString newText;
+		TextEntitySearch searchPre(_rePre, text, QChar('`')), searchCode(_reCode, text, QChar('`'));
 
 		int32 offset = 0, matchOffset = offset, len = text.size(), commandOffset = rich ? 0 : len;
 		bool inLink = false, commandIsLink = false;
@@ -4827,8 +4915,8 @@ EntitiesInText textParseEntities(QString &text, int32 flags, bool rich) { // som
 					commandIsLink = false;
 				}
 			}
-			QRegularExpressionMatch mPre = _rePre.match(text, matchOffset);
-			QRegularExpressionMatch mCode = _reCode.match(text, matchOffset), mTag;
+			QRegularExpressionMatch mPre = searchPre.match(matchOffset);
+			QRegularExpressionMatch mCode = searchCode.match(matchOffset), mTag;
 			if (!mPre.hasMatch() && !mCode.hasMatch()) break;
 
 			int32 preStart = mPre.hasMatch() ? mPre.capturedStart() : INT_MAX,
@@ -4926,6 +5014,10 @@ EntitiesInText textParseEntities(QString &text, int32 flags, bool rich) { // som
 	int32 len = text.size(), commandOffset = rich ? 0 : len;
 	bool inLink = false, commandIsLink = false;
 	const QChar *start = text.constData(), *end = start + text.size();
+	TextEntitySearch searchDomain(_reDomain, text, QChar('.')), searchExplicitDomain(_reExplicitDomain, text, QChar(':'));
+	TextEntitySearch searchHashtag(_reHashtag, text, QChar('#'), withHashtags);
+	TextEntitySearch searchMention(_reMention, text, QChar('@'), withMentions);
+	TextEntitySearch searchBotCommand(_reBotCommand, text, QChar('/'), withBotCommands);
 	for (int32 offset = 0, matchOffset = offset, mentionSkip = 0; offset < len;) {
 		if (commandOffset <= offset) {
 			for (commandOffset = offset; commandOffset < len; ++commandOffset) {
@@ -4936,11 +5028,11 @@ EntitiesInText textParseEntities(QString &text, int32 flags, bool rich) { // som
 				}
 			}
 		}
-		QRegularExpressionMatch mDomain = _reDomain.match(text, matchOffset);
-		QRegularExpressionMatch mExplicitDomain = _reExplicitDomain.match(text, matchOffset);
-		QRegularExpressionMatch mHashtag = withHashtags ? _reHashtag.match(text, matchOffset) : QRegularExpressionMatch();
-		QRegularExpressionMatch mMention = withMentions ? _reMention.match(text, qMax(mentionSkip, matchOffset)) : QRegularExpressionMatch();
-		QRegularExpressionMatch mBotCommand = withBotCommands ? _reBotCommand.match(text, matchOffset) : QRegularExpressionMatch();
+		QRegularExpressionMatch mDomain = searchDomain.match(matchOffset);
+		QRegularExpressionMatch mExplicitDomain = searchExplicitDomain.match(matchOffset);
+		QRegularExpressionMatch mHashtag = searchHashtag.match(matchOffset);
+		QRegularExpressionMatch mMention = searchMention.match(qMax(mentionSkip, matchOffset));
+		QRegularExpressionMatch mBotCommand = searchBotCommand.match(matchOffset);
 
 		EntityInTextType lnkType = EntityInTextUrl;
 		int32 lnkStart = 0, lnkLength = 0;
@@ -4971,7 +5063,7 @@ EntitiesInText textParseEntities(QString &text, int32 flags, bool rich) { // som
 			}
 			if (!(start + mentionStart + 1)->isLetter() || !(start + mentionEnd - 1)->isLetterOrNumber()) {
 				mentionSkip = mentionEnd;
-				mMention = _reMention.match(text, qMax(mentionSkip, matchOffset));
+				mMention = searchMention.match(qMax(mentionSkip, matchOffset));
 				if (mMention.hasMatch()) {
 					mentionStart = mMention.capturedStart();
 					mentionEnd = mMention.capturedEnd();
@@ -729,6 +729,25 @@ const QRegularExpression &reMailStart();
 const QRegularExpression &reHashtag();
 const QRegularExpression &reBotCommand();
 
+// remembers the first match of the regexp at or after the last offset and returns it
+// again while the offset does not pass the match start, so scanning the text with
+// growing offsets walks it only once, not from each offset to the next match
+class TextEntitySearch {
+public:
+	// required is a char every match contains, if the text has none it is not searched at all
+	TextEntitySearch(const QRegularExpression &re, const QString &text, QChar required, bool enabled = true);
+
+	const QRegularExpressionMatch &match(int offset);
+
+private:
+	const QRegularExpression &_re;
+	const QString &_text;
+	QRegularExpressionMatch _match;
+	int _offset; // offset _match was searched from, -1 if it was not searched yet
+	bool _enabled;
+
+};
+
 // text style
 const style::textStyle *textstyleCurrent();
 void textstyleSet(const style::textStyle *style);
@@ -2375,10 +2375,11 @@ MsgId History::msgIdForRead() const {
 	return result;
 }
 
-int History::resizeGetHeight(int newWidth) {
-	bool resizeAllItems = (_flags | Flag::f_pending_resize) || (width != newWidth);
+int History::resizeGetHeight(int newWidth, int visibleTop, int visibleBottom) {
+	bool resizeAllItems = (_flags & Flag::f_pending_resize) || (width != newWidth);
+	bool lazy = (visibleBottom >= visibleTop);
 
-	if (!resizeAllItems && !hasPendingResizedItems()) {
+	if (!resizeAllItems && !hasPendingResizedItems() && !hasLazyResizedBlocks(visibleTop, visibleBottom)) {
 		return height;
 	}
 	_flags &= ~(Flag::f_pending_resize | Flag::f_has_pending_resized_items);
@@ -2386,13 +2387,32 @@ int History::resizeGetHeight(int newWidth) {
 	width = newWidth;
 	int y = 0;
 	for_const (HistoryBlock *block, blocks) {
+		bool visible = !lazy || (block->y < visibleBottom && block->y + block->height > visibleTop);
+		if (!visible && block->resizeLazily(resizeAllItems)) {
+			block->y = y;
+			y += block->height;
+			continue;
+		}
+		bool resizeBlock = resizeAllItems || block->lazyResized;
+		block->lazyResized = false;
 		block->y = y;
-		y += block->resizeGetHeight(newWidth, resizeAllItems);
+		y += block->resizeGetHeight(newWidth, resizeBlock);
 	}
 	height = y;
 	return height;
 }
 
+bool History::hasLazyResizedBlocks(int visibleTop, int visibleBottom) const {
+	bool all = (visibleBottom < visibleTop);
+	for_const (HistoryBlock *block, blocks) {
+		if (!all && block->y >= visibleBottom) break;
+		if (block->lazyResized && (all || block->y + block->height > visibleTop)) {
+			return true;
+		}
+	}
+	return false;
+}
+
 ChannelHistory *History::asChannelHistory() {
 	return isChannel() ? static_cast<ChannelHistory*>(this) : 0;
 }
@@ -2635,6 +2655,21 @@ int HistoryBlock::resizeGetHeight(int newWidth, bool resizeAllItems) {
 	return height;
 }
 
+// returns false if some of the items were never laid out and can't be skipped
+bool HistoryBlock::resizeLazily(bool resizeAllItems) {
+	for_const (HistoryItem *item, items) {
+		if (item->pendingInitDimensions()) {
+			return false;
+		} else if (item->pendingResize()) {
+			resizeAllItems = true;
+		}
+	}
+	if (resizeAllItems) {
+		lazyResized = true;
+	}
+	return true;
+}
+
 void HistoryBlock::clear(bool leaveItems) {
 	Items lst;
 	std::swap(lst, items);
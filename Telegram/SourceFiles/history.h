@@ -304,7 +304,10 @@ public:
 	MsgId maxMsgId() const;
 	MsgId msgIdForRead() const;
 
-	int resizeGetHeight(int newWidth);
+	// if visibleBottom >= visibleTop only the blocks intersecting [visibleTop, visibleBottom)
+	// are laid out for the new width, the rest keep their heights as estimates until they get there
+	int resizeGetHeight(int newWidth, int visibleTop = 0, int visibleBottom = -1);
+	bool hasLazyResizedBlocks(int visibleTop, int visibleBottom) const; // any block if visibleBottom < visibleTop
 
 	void removeNotification(HistoryItem *item) {
 		if (!notifies.isEmpty()) {
@@ -925,9 +928,13 @@ public:
 	void removeItem(HistoryItem *item);
 
 	int resizeGetHeight(int newWidth, bool resizeAllItems);
+	bool resizeLazily(bool resizeAllItems);
 	int32 y, height;
 	History *history;
 
+	// items were not laid out for the current width yet, height is an estimate
+	bool lazyResized = false;
+
 	HistoryBlock *previous() const {
 		t_assert(_indexInHistory >= 0);
 
@@ -1700,6 +1707,11 @@ public:
 	virtual void stopInline(HistoryItem *item) {
 	}
 
+	virtual void prefetch(const HistoryItem *parent, uint64 deadline) { // start auto loads of the media that is going to be drawn soon
+	}
+	virtual void cancelPrefetch() {
+	}
+
 	virtual void attachToItem(HistoryItem *item) {
 	}
 
@@ -1857,6 +1869,13 @@ public:
 
 	void updateFrom(const MTPMessageMedia &media, HistoryItem *parent) override;
 
+	void prefetch(const HistoryItem *parent, uint64 deadline) override {
+		_data->prefetch(parent, deadline);
+	}
+	void cancelPrefetch() override {
+		_data->cancelPrefetch();
+	}
+
 	void attachToItem(HistoryItem *item) override;
 	void detachFromItem(HistoryItem *item) override;
 
@@ -1926,6 +1945,13 @@ public:
 		return _data->uploading();
 	}
 
+	void prefetch(const HistoryItem *parent, uint64 deadline) override {
+		_data->prefetch(parent, deadline);
+	}
+	void cancelPrefetch() override {
+		_data->cancelPrefetch();
+	}
+
 	void attachToItem(HistoryItem *item) override;
 	void detachFromItem(HistoryItem *item) override;
 
@@ -2041,6 +2067,13 @@ public:
 		return _data;
 	}
 
+	void prefetch(const HistoryItem *parent, uint64 deadline) override {
+		_data->prefetch(parent, deadline);
+	}
+	void cancelPrefetch() override {
+		_data->cancelPrefetch();
+	}
+
 	void attachToItem(HistoryItem *item) override;
 	void detachFromItem(HistoryItem *item) override;
 
@@ -2130,6 +2163,13 @@ public:
 	bool playInline(HistoryItem *item, bool autoplay) override;
 	void stopInline(HistoryItem *item) override;
 
+	void prefetch(const HistoryItem *parent, uint64 deadline) override {
+		_data->prefetch(parent, deadline);
+	}
+	void cancelPrefetch() override {
+		_data->cancelPrefetch();
+	}
+
 	void attachToItem(HistoryItem *item) override;
 	void detachFromItem(HistoryItem *item) override;
 
@@ -2340,6 +2380,13 @@ public:
 		if (_attach) _attach->stopInline(item);
 	}
 
+	void prefetch(const HistoryItem *parent, uint64 deadline) override {
+		if (_attach) _attach->prefetch(parent, deadline);
+	}
+	void cancelPrefetch() override {
+		if (_attach) _attach->cancelPrefetch();
+	}
+
 	void attachToItem(HistoryItem *item) override;
 	void detachFromItem(HistoryItem *item) override;
 
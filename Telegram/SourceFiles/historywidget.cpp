@@ -192,6 +192,92 @@ void HistoryInner::enumerateUserpicsInHistory(History *h, int htop, Method metho
 	}
 }
 
+template <typename Method>
+void HistoryInner::enumerateItemsInHistory(History *h, int htop, int from, int till, Method method) {
+	if (htop < 0 || h->isEmpty() || till <= htop || from >= htop + h->height) {
+		return;
+	}
+
+	// binary search for the block and the item that contain the top line
+	int blockIndex = binarySearchBlocksOrItems(h->blocks, from - htop + 1);
+	HistoryBlock *block = h->blocks.at(blockIndex);
+	int blocktop = htop + block->y;
+	int itemIndex = binarySearchBlocksOrItems(block->items, from - blocktop + 1);
+
+	while (true) {
+		for (int itemsCount = block->items.size(); itemIndex < itemsCount; ++itemIndex) {
+			HistoryItem *item = block->items.at(itemIndex);
+			int itemtop = blocktop + item->y;
+			if (itemtop >= till) {
+				return;
+			}
+			method(item, itemtop);
+		}
+		if (++blockIndex >= h->blocks.size()) {
+			return;
+		}
+		block = h->blocks.at(blockIndex);
+		blocktop = htop + block->y;
+		itemIndex = 0;
+	}
+}
+
+void HistoryInner::prefetchMedia() {
+	uint64 ms = getms();
+	if (_prefetchTime && ms > _prefetchTime) {
+		float64 speed = float64(_visibleAreaTop - _prefetchTop) / (ms - _prefetchTime);
+		_prefetchSpeed = (ms - _prefetchTime < uint64(MediaPrefetchAheadTime)) ? (_prefetchSpeed + speed) / 2. : speed;
+	}
+	_prefetchTop = _visibleAreaTop;
+	_prefetchTime = ms;
+
+	int screen = qMax(_visibleAreaBottom - _visibleAreaTop, 1);
+	int ahead = qMin(int(qAbs(_prefetchSpeed) * MediaPrefetchAheadTime), screen * (MediaPrefetchMaxScreens - MediaPrefetchScreens));
+	int from = _visibleAreaTop - screen * MediaPrefetchScreens - (_prefetchSpeed < 0 ? ahead : 0);
+	int till = _visibleAreaBottom + screen * MediaPrefetchScreens + (_prefetchSpeed > 0 ? ahead : 0);
+
+	// items are expected on screen not later than in a second for each screen of distance
+	float64 minSpeed = float64(screen) / MediaPrefetchAheadTime;
+
+	OrderedSet<HistoryItem*> prefetched;
+	auto method = [this, ms, minSpeed, &prefetched](HistoryItem *item, int itemtop) {
+		HistoryMedia *media = item->getMedia();
+		if (!media) return;
+
+		prefetched.insert(item);
+		if (_prefetched.contains(item)) return;
+
+		int itembottom = itemtop + item->height();
+		if (itembottom > _visibleAreaTop && itemtop < _visibleAreaBottom) return; // visible media is loaded by draw()
+
+		bool below = (itemtop >= _visibleAreaBottom);
+		int distance = below ? (itemtop - _visibleAreaBottom) : (_visibleAreaTop - itembottom);
+		float64 speed = (below == (_prefetchSpeed > 0)) ? qMax(qAbs(_prefetchSpeed), minSpeed) : minSpeed;
+		media->prefetch(item, ms + uint64(distance / speed));
+	};
+	enumerateItemsInHistory(_migrated, migratedTop(), from, till, method);
+	enumerateItemsInHistory(_history, historyTop(), from, till, method);
+
+	// stop loading media that went out of the prefetch area without being loaded
+	for (OrderedSet<HistoryItem*>::const_iterator i = _prefetched.cbegin(), e = _prefetched.cend(); i != e; ++i) {
+		if (!prefetched.contains(*i)) {
+			if (HistoryMedia *media = (*i)->getMedia()) {
+				media->cancelPrefetch();
+			}
+		}
+	}
+	_prefetched = prefetched;
+}
+
+void HistoryInner::cancelPrefetches() {
+	for (OrderedSet<HistoryItem*>::const_iterator i = _prefetched.cbegin(), e = _prefetched.cend(); i != e; ++i) {
+		if (HistoryMedia *media = (*i)->getMedia()) {
+			media->cancelPrefetch();
+		}
+	}
+	_prefetched.clear();
+}
+
 void HistoryInner::paintEvent(QPaintEvent *e) {
 	if (!App::main() || (App::wnd() && App::wnd()->contentOverlapped(this, e))) {
 		return;
@@ -760,6 +846,8 @@ void HistoryInner::onDragExec() {
 }
 
 void HistoryInner::itemRemoved(HistoryItem *item) {
+	_prefetched.remove(item);
+
 	SelectedItems::iterator i = _selected.find(item);
 	if (i != _selected.cend()) {
 		_selected.erase(i);
@@ -1306,9 +1394,22 @@ void HistoryInner::recountHeight() {
 	}
 	if (wasYSkip < minadd) wasYSkip = minadd;
 
-	_history->resizeGetHeight(_scroll->width());
+	// only the blocks within a screen from the visible area are laid out right away,
+	// the rest are laid out when they come close to it, see hasLazyResizedBlocks()
+	// until the visible area is known everything is laid out exactly
+	bool lazy = (_visibleAreaBottom > _visibleAreaTop);
+	int visibleTop = _visibleAreaTop - _scroll->height(), visibleBottom = _visibleAreaBottom + _scroll->height();
+	if (lazy && htop >= 0) {
+		_history->resizeGetHeight(_scroll->width(), visibleTop - htop, visibleBottom - htop);
+	} else {
+		_history->resizeGetHeight(_scroll->width());
+	}
 	if (_migrated) {
-		_migrated->resizeGetHeight(_scroll->width());
+		if (lazy && mtop >= 0) {
+			_migrated->resizeGetHeight(_scroll->width(), visibleTop - mtop, visibleBottom - mtop);
+		} else {
+			_migrated->resizeGetHeight(_scroll->width());
+		}
 	}
 
 	// with migrated history we perhaps do not need to display first _history message
@@ -1454,6 +1555,8 @@ void HistoryInner::visibleAreaUpdated(int top, int bottom) {
 		return;
 	}
 
+	prefetchMedia();
+
 	if (bottom >= historyHeight()) {
 		_history->forgetScrollState();
 		if (_migrated) {
@@ -1478,6 +1581,15 @@ void HistoryInner::visibleAreaUpdated(int top, int bottom) {
 	}
 }
 
+bool HistoryInner::hasLazyResizedBlocks() const {
+	int visibleTop = _visibleAreaTop - _scroll->height(), visibleBottom = _visibleAreaBottom + _scroll->height();
+	int htop = historyTop(), mtop = migratedTop();
+	if (htop >= 0 && _history->hasLazyResizedBlocks(visibleTop - htop, visibleBottom - htop)) {
+		return true;
+	}
+	return (mtop >= 0 && _migrated->hasLazyResizedBlocks(visibleTop - mtop, visibleBottom - mtop));
+}
+
 void HistoryInner::updateSize() {
 	int32 ph = _scroll->height(), minadd = 0;
 	int32 newYSkip = ph - historyHeight() - st::historyPadding;
@@ -1536,6 +1648,7 @@ void HistoryInner::leaveEvent(QEvent *e) {
 }
 
 HistoryInner::~HistoryInner() {
+	cancelPrefetches();
 	delete _menu;
 	_dragAction = NoDrag;
 }
@@ -2826,7 +2939,7 @@ HistoryWidget::HistoryWidget(QWidget *parent) : TWidget(parent)
 , _emojiPan(this)
 , _attachDragDocument(this)
 , _attachDragPhoto(this)
-, _fileLoader(this, FileLoaderQueueStopTimeout)
+, _fileLoader(this, FileLoaderQueueStopTimeout, qBound(1, QThread::idealThreadCount(), int(FilePrepareThreadsMax)))
 , _a_show(animation(this, &HistoryWidget::step_show))
 , _sideShadow(this, st::shadowColor)
 , _topShadow(this, st::shadowColor) {
@@ -3265,7 +3378,7 @@ void HistoryWidget::onRecordDone(QByteArray result, VoiceWaveform waveform, qint
 
 	App::wnd()->activateWindow();
 	int32 duration = samples / AudioVoiceMsgFrequency;
-	_fileLoader.addTask(new FileLoadTask(result, duration, waveform, FileLoadTo(_peer->id, _broadcast.checked(), _silent.checked(), replyToId())));
+	_fileLoader.addTask(new FileLoadTask(result, duration, waveform, FileLoadTo(_peer->id, _broadcast.checked(), _silent.checked(), replyToId())), TaskPriorityHigh); // a recorded voice is small, don't wait for the files
 	cancelReply(lastForceReplyReplied());
 }
 
@@ -3756,8 +3869,6 @@ void HistoryWidget::showHistory(const PeerId &peerId, MsgId showAtMsgId, bool re
 	App::mousedItem(0);
 
 	if (_peer) {
-		App::forgetMedia();
-		_serviceImageCacheSize = imageCacheSize();
 		MTP::clearLoaderPriorities();
 
 		_history = App::history(_peer->id);
@@ -4343,7 +4454,7 @@ void HistoryWidget::messagesReceived(PeerData *peer, const MTPmessages_Messages
 	} break;
 	}
 
-	if (_preloadRequest == requestId) {
+	if (!_firstLoadFromCache && _preloadRequest == requestId) {
 		addMessagesToFront(peer, *histList, histCollapsed);
 		_preloadRequest = 0;
 		preloadHistoryIfNeeded();
@@ -4351,27 +4462,38 @@ void HistoryWidget::messagesReceived(PeerData *peer, const MTPmessages_Messages
 			updateReportSpamStatus();
 			if (_reportSpamStatus != dbiprsUnknown) updateControlsVisibility();
 		}
-	} else if (_preloadDownRequest == requestId) {
+	} else if (!_firstLoadFromCache && _preloadDownRequest == requestId) {
+		if (!toMigrated) {
+			Local::appendHistoryCache(peer->id, messages, _history->maxMsgId());
+		}
 		addMessagesToBack(peer, *histList, histCollapsed);
 		_preloadDownRequest = 0;
 		preloadHistoryIfNeeded();
 		if (_history->loadedAtBottom() && App::wnd()) App::wnd()->checkHistoryActivation();
-	} else if (_firstLoadRequest == requestId) {
+	} else if (_firstLoadFromCache || _firstLoadRequest == requestId) {
 		if (toMigrated) {
 			_history->clear(true);
 		} else if (_migrated) {
 			_migrated->clear(true);
 		}
+		bool fromCache = _firstLoadFromCache;
+		if (_firstLoadFromEnd && !toMigrated && !fromCache) {
+			Local::writeHistoryCache(peer->id, messages);
+		}
 		addMessagesToFront(peer, *histList, histCollapsed);
 		if (_fixedInScrollMsgId && _history->isChannel()) {
 			_history->asChannelHistory()->insertCollapseItem(_fixedInScrollMsgId);
 		}
 		_firstLoadRequest = 0;
+		_firstLoadFromCache = false;
 		if (_history->loadedAtTop()) {
 			if (_history->unreadCount > count) {
 				_history->setUnreadCount(count);
 			}
 			if (_history->isEmpty() && count > 0) {
+				if (fromCache) { // nothing was added from the local cache
+					Local::clearHistoryCache(peer->id);
+				}
 				firstLoadMessages();
 				return;
 			}
@@ -4510,6 +4632,20 @@ void HistoryWidget::firstLoadMessages() {
 		}
 	}
 
+	_firstLoadFromEnd = (!loadImportant && !offset_id && !offset && from == _peer && !_migrated);
+	if (_firstLoadFromEnd && _history->isEmpty()) {
+		MTPmessages_Messages cached;
+		if (Local::readHistoryCache(_peer->id, cached)) {
+			// paint the cached slice right away and request only newer messages
+			_history->setNotLoadedAtBottom();
+			_firstLoadFromCache = true;
+			messagesReceived(_peer, cached, 0);
+			_firstLoadFromCache = false;
+			preloadHistoryIfNeeded();
+			return;
+		}
+	}
+
 	if (loadImportant) {
 		_firstLoadRequest = MTP::send(MTPchannels_GetImportantHistory(from->asChannel()->inputChannel, MTP_int(offset_id), MTP_int(0), MTP_int(offset), MTP_int(loadCount), MTP_int(0), MTP_int(0)), rpcDone(&HistoryWidget::messagesReceived, from), rpcFail(&HistoryWidget::messagesFailed));
 	} else {
@@ -4641,6 +4777,12 @@ void HistoryWidget::visibleAreaUpdated() {
 	if (_list && !_scroll.isHidden()) {
 		int st = _scroll.scrollTop();
 		_list->visibleAreaUpdated(st, st + _scroll.height());
+
+		// off-screen blocks get their exact heights when scrolled close to,
+		// updateListSize() keeps the scrollTopItem in place while doing that
+		if (_list->hasLazyResizedBlocks()) {
+			updateListSize();
+		}
 	}
 }
 
@@ -6424,7 +6566,7 @@ MsgId HistoryWidget::replyToId() const {
 
 void HistoryWidget::updateListSize(bool initial, bool loadedDown, const ScrollChange &change) {
 	if (!_history || (initial && _histInited) || (!initial && !_histInited)) return;
-	if (_firstLoadRequest || _a_show.animating()) {
+	if (_firstLoadRequest || _firstLoadFromCache || _a_show.animating()) {
 		return; // scrollTopMax etc are not working after recountHeight()
 	}
 
@@ -6618,7 +6760,7 @@ int HistoryWidget::unreadBarTop() const {
 void HistoryWidget::addMessagesToFront(PeerData *peer, const QVector<MTPMessage> &messages, const QVector<MTPMessageGroup> *collapsed) {
 	int oldH = _list->historyHeight();
 	_list->messagesReceived(peer, messages, collapsed);
-	if (!_firstLoadRequest) {
+	if (!_firstLoadRequest && !_firstLoadFromCache) {
 		updateListSize();
 		if (_animActiveTimer.isActive() && _activeAnimMsgId > 0 && _migrated && !_migrated->isEmpty() && _migrated->loadedAtBottom() && _migrated->blocks.back()->items.back()->isGroupMigrate() && _list->historyTop() != _list->historyDrawTop() && _history) {
 			HistoryItem *animActiveItem = App::histItemById(_history->channelId(), _activeAnimMsgId);
@@ -6632,7 +6774,7 @@ void HistoryWidget::addMessagesToFront(PeerData *peer, const QVector<MTPMessage>
 
 void HistoryWidget::addMessagesToBack(PeerData *peer, const QVector<MTPMessage> &messages, const QVector<MTPMessageGroup> *collapsed) {
 	_list->messagesReceivedDown(peer, messages, collapsed);
-	if (!_firstLoadRequest) {
+	if (!_firstLoadRequest && !_firstLoadFromCache) {
 		updateListSize(false, true, { ScrollChangeNoJumpToBottom, 0 });
 	}
 }
@@ -67,6 +67,7 @@ public:
 	QPoint mapMouseToItem(QPoint p, HistoryItem *item);
 
 	void recountHeight();
+	bool hasLazyResizedBlocks() const;
 	void updateSize();
 
 	void repaintItem(const HistoryItem *item);
@@ -222,6 +223,20 @@ private:
 	int _visibleAreaTop = 0;
 	int _visibleAreaBottom = 0;
 
+	// auto load media of the items that are going to be shown by scrolling
+	// the area grows in the scroll direction with the scroll speed
+	void prefetchMedia();
+	void cancelPrefetches();
+	OrderedSet<HistoryItem*> _prefetched;
+	int _prefetchTop = 0;
+	uint64 _prefetchTime = 0;
+	float64 _prefetchSpeed = 0.; // pixels per ms, positive when scrolling down
+
+	// enumerate the items of the passed history with passed top offset that intersect [from, till)
+	// from the top to the bottom, method has "void (*Method)(HistoryItem *item, int itemtop)" signature
+	template <typename Method>
+	void enumerateItemsInHistory(History *h, int htop, int from, int till, Method method);
+
 	// this function finds all userpics on the left that are displayed and calls template method
 	// for each found userpic (from the bottom to the top) in the passed history with passed top offset
 	//
@@ -911,6 +926,8 @@ private:
 	int32 _fixedInScrollMsgTop = 0;
 
 	mtpRequestId _firstLoadRequest = 0;
+	bool _firstLoadFromEnd = false; // first load requests the bottom slice, it is written to the local history cache
+	bool _firstLoadFromCache = false; // the cached bottom slice is being applied as the first load response
 	mtpRequestId _preloadRequest = 0;
 	mtpRequestId _preloadDownRequest = 0;
 
@@ -987,7 +1004,6 @@ private:
 	TaskQueue _fileLoader;
 	int32 _textUpdateEventsFlags = (TextUpdateEventsSaveDraft | TextUpdateEventsSendTyping);
 
-	int64 _serviceImageCacheSize = 0;
 	QString _confirmSource;
 
 	uint64 _confirmWithTextId = 0;
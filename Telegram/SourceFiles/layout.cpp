@@ -312,10 +312,77 @@ void LayoutOverviewDate::paint(Painter &p, const QRect &clip, uint32 selection,
 	}
 }
 
-LayoutOverviewPhoto::LayoutOverviewPhoto(PhotoData *photo, HistoryItem *parent) : LayoutMediaItem(parent)
+namespace {
+	QImage overviewPhotoThumb(QImage img, int32 size, bool good) {
+		if (!good) {
+			img = imageBlur(img);
+		}
+		if (img.width() == img.height()) {
+			if (img.width() != size) {
+				img = img.scaled(size, size, Qt::KeepAspectRatioByExpanding, Qt::SmoothTransformation);
+			}
+		} else if (img.width() > img.height()) {
+			img = img.copy((img.width() - img.height()) / 2, 0, img.height(), img.height()).scaled(size, size, Qt::KeepAspectRatioByExpanding, Qt::SmoothTransformation);
+		} else {
+			img = img.copy(0, (img.height() - img.width()) / 2, img.width(), img.width()).scaled(size, size, Qt::KeepAspectRatioByExpanding, Qt::SmoothTransformation);
+		}
+		img.setDevicePixelRatio(cRetinaFactor());
+		return img;
+	}
+
+	class OverviewPhotoThumbTask : public Task {
+	public:
+
+		OverviewPhotoThumbTask(LayoutOverviewPhoto *layout, const QByteArray &bytes, const QByteArray &format, int32 size, bool good) : _layout(layout)
+		, _bytes(bytes)
+		, _format(format)
+		, _size(size)
+		, _good(good) {
+		}
+
+		void process() {
+			QBuffer buffer(&_bytes);
+			QImageReader reader(&buffer, _format);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+			reader.setAutoTransform(true);
+#endif
+			// let the decoder skip the detail we don't need (jpeg is decoded at 1/2, 1/4 or 1/8 scale),
+			// the blurred thumb is small already and its blur radius depends on its size
+			QSize original = reader.size();
+			if (_good && original.isValid()) {
+				QSize scaled = original.scaled(_size, _size, Qt::KeepAspectRatioByExpanding);
+				if (scaled.width() < original.width()) {
+					reader.setScaledSize(scaled);
+				}
+			}
+			QImage img = reader.read();
+			if (!img.isNull()) {
+				_thumb = overviewPhotoThumb(img, _size, _good);
+			}
+		}
+
+		void finish() {
+			_layout->thumbReady(_thumb, _good);
+		}
+
+	private:
+		LayoutOverviewPhoto *_layout;
+		QByteArray _bytes, _format;
+		int32 _size;
+		bool _good;
+		QImage _thumb;
+
+	};
+}
+
+LayoutOverviewPhoto::LayoutOverviewPhoto(PhotoData *photo, HistoryItem *parent, TaskQueue *thumbsLoader) : LayoutMediaItem(parent)
 , _data(photo)
 , _link(new PhotoLink(photo))
-, _goodLoaded(false) {
+, _goodLoaded(false)
+, _thumbsLoader(thumbsLoader)
+, _thumbTask(0)
+, _thumbTaskSize(0)
+, _thumbTaskGood(false) {
 
 }
 
@@ -333,41 +400,37 @@ int32 LayoutOverviewPhoto::resizeGetHeight(int32 width) {
 	return _height;
 }
 
+void LayoutOverviewPhoto::prefetch(uint64 deadline) {
+	if (!_data->loaded()) {
+		_data->medium->prefetch(_parent, deadline);
+	}
+}
+
+void LayoutOverviewPhoto::cancelPrefetch() {
+	_data->medium->cancelPrefetch();
+}
+
 void LayoutOverviewPhoto::paint(Painter &p, const QRect &clip, uint32 selection, const PaintContext *context) const {
 	bool good = _data->loaded();
 	if (!good) {
 		_data->medium->automaticLoad(_parent);
 		good = _data->medium->loaded();
 	}
-	if ((good && !_goodLoaded) || _pix.width() != _width * cIntRetinaFactor()) {
-		_goodLoaded = good;
-
-		int32 size = _width * cIntRetinaFactor();
-		if (_goodLoaded || _data->thumb->loaded()) {
-			QImage img = (_data->loaded() ? _data->full : (_data->medium->loaded() ? _data->medium : _data->thumb))->pix().toImage();
-			if (!_goodLoaded) {
-				img = imageBlur(img);
-			}
-			if (img.width() == img.height()) {
-				if (img.width() != size) {
-					img = img.scaled(size, size, Qt::KeepAspectRatioByExpanding, Qt::SmoothTransformation);
-				}
-			} else if (img.width() > img.height()) {
-				img = img.copy((img.width() - img.height()) / 2, 0, img.height(), img.height()).scaled(size, size, Qt::KeepAspectRatioByExpanding, Qt::SmoothTransformation);
-			} else {
-				img = img.copy(0, (img.height() - img.width()) / 2, img.width(), img.width()).scaled(size, size, Qt::KeepAspectRatioByExpanding, Qt::SmoothTransformation);
-			}
-			img.setDevicePixelRatio(cRetinaFactor());
-			_data->forget();
-
-			_pix = QPixmap::fromImage(img, Qt::ColorOnly);
-		} else if (!_pix.isNull()) {
-			_pix = QPixmap();
+	int32 size = _width * cIntRetinaFactor();
+	if ((good && !_goodLoaded) || _pix.width() != size) {
+		if (_thumbTask && (_thumbTaskSize != size || _thumbTaskGood != good)) {
+			_thumbsLoader->cancelTask(_thumbTask);
+			_thumbTask = 0;
+		}
+		if (!_thumbTask) {
+			prepareThumb(size, good, true);
 		}
 	}
 
 	if (_pix.isNull()) {
 		p.fillRect(0, 0, _width, _height, st::overviewPhotoBg);
+	} else if (_pix.width() != size) { // the thumb for the new size is not ready yet
+		p.drawPixmap(QRect(0, 0, _width, _height), _pix);
 	} else {
 		p.drawPixmap(0, 0, _pix);
 	}
@@ -380,6 +443,43 @@ void LayoutOverviewPhoto::paint(Painter &p, const QRect &clip, uint32 selection,
 	}
 }
 
+void LayoutOverviewPhoto::prepareThumb(int32 size, bool good, bool inBackground) const {
+	if (!good && !_data->thumb->loaded()) {
+		_goodLoaded = false;
+		_pix = QPixmap();
+		return;
+	}
+
+	ImagePtr image = _data->loaded() ? _data->full : (_data->medium->loaded() ? _data->medium : _data->thumb);
+	QByteArray bytes = image->savedData();
+	if (inBackground && _thumbsLoader && !bytes.isEmpty()) {
+		_thumbTask = _thumbsLoader->addTask(new OverviewPhotoThumbTask(const_cast<LayoutOverviewPhoto*>(this), bytes, image->savedFormat(), size, good));
+		_thumbTaskSize = size;
+		_thumbTaskGood = good;
+	} else {
+		_goodLoaded = good;
+		_pix = QPixmap::fromImage(overviewPhotoThumb(image->pix().toImage(), size, good), Qt::ColorOnly);
+	}
+	_data->forget();
+}
+
+void LayoutOverviewPhoto::thumbReady(const QImage &thumb, bool good) {
+	_thumbTask = 0;
+	if (thumb.isNull()) { // could not read the saved data, scale the decoded image
+		prepareThumb(_thumbTaskSize, good, false);
+	} else {
+		_goodLoaded = good;
+		_pix = QPixmap::fromImage(thumb, Qt::ColorOnly);
+	}
+	Ui::repaintHistoryItem(_parent);
+}
+
+LayoutOverviewPhoto::~LayoutOverviewPhoto() {
+	if (_thumbTask) {
+		_thumbsLoader->cancelTask(_thumbTask);
+	}
+}
+
 void LayoutOverviewPhoto::getState(TextLinkPtr &link, HistoryCursorState &cursor, int32 x, int32 y) const {
 	if (hasPoint(x, y)) {
 		link = _link;
@@ -190,6 +190,11 @@ public:
 		return _parent;
 	}
 
+	virtual void prefetch(uint64 deadline) { // auto load media before it is shown, deadline - getms() when it is expected on screen
+	}
+	virtual void cancelPrefetch() {
+	}
+
 protected:
 	HistoryItem *_parent;
 
@@ -300,15 +305,24 @@ private:
 
 };
 
+class TaskQueue;
 class LayoutOverviewPhoto : public LayoutMediaItem {
 public:
-	LayoutOverviewPhoto(PhotoData *photo, HistoryItem *parent);
+	// thumbs are decoded and scaled in thumbsLoader threads, if it is set
+	LayoutOverviewPhoto(PhotoData *photo, HistoryItem *parent, TaskQueue *thumbsLoader = 0);
 
 	virtual void initDimensions();
 	virtual int32 resizeGetHeight(int32 width);
 	virtual void paint(Painter &p, const QRect &clip, uint32 selection, const PaintContext *context) const;
 	virtual void getState(TextLinkPtr &link, HistoryCursorState &cursor, int32 x, int32 y) const;
 
+	virtual void prefetch(uint64 deadline);
+	virtual void cancelPrefetch();
+
+	void thumbReady(const QImage &thumb, bool good); // called from the thumb task finish()
+
+	~LayoutOverviewPhoto();
+
 private:
 	PhotoData *_data;
 	TextLinkPtr _link;
@@ -316,6 +330,13 @@ private:
 	mutable QPixmap _pix;
 	mutable bool _goodLoaded;
 
+	void prepareThumb(int32 size, bool good, bool inBackground) const;
+
+	TaskQueue *_thumbsLoader;
+	mutable TaskId _thumbTask;
+	mutable int32 _thumbTaskSize;
+	mutable bool _thumbTaskGood;
+
 };
 
 class LayoutOverviewVideo : public LayoutAbstractFileItem {
@@ -29,7 +29,10 @@ Copyright (c) 2014-2016 John Preston, https://desktop.telegram.org
 #include "lang.h"
 #include "boxes/confirmbox.h"
 
-TaskQueue::TaskQueue(QObject *parent, int32 stopTimeoutMs) : QObject(parent), _thread(0), _worker(0), _stopTimer(0) {
+TaskQueue::TaskQueue(QObject *parent, int32 stopTimeoutMs, int32 workersCount) : QObject(parent)
+, _workersCount(qMax(workersCount, 1))
+, _nextWorker(0)
+, _stopTimer(0) {
 	if (stopTimeoutMs > 0) {
 		_stopTimer = new QTimer(this);
 		connect(_stopTimer, SIGNAL(timeout()), this, SLOT(stop()));
@@ -38,94 +41,131 @@ TaskQueue::TaskQueue(QObject *parent, int32 stopTimeoutMs) : QObject(parent), _t
 	}
 }
 
-TaskId TaskQueue::addTask(TaskPtr task) {
-	{
-		QMutexLocker lock(&_tasksToProcessMutex);
-		_tasksToProcess.push_back(task);
-	}
-
-	wakeThread();
+TaskId TaskQueue::addTask(TaskPtr task, TaskPriority priority) {
+	pushTask(task, priority);
+	wakeThreads();
 
 	return task->id();
 }
 
-void TaskQueue::addTasks(const TasksList &tasks) {
-	{
-		QMutexLocker lock(&_tasksToProcessMutex);
-		_tasksToProcess.append(tasks);
+void TaskQueue::addTasks(const TasksList &tasks, TaskPriority priority) {
+	for (TasksList::const_iterator i = tasks.cbegin(), e = tasks.cend(); i != e; ++i) {
+		pushTask(*i, priority);
 	}
-
-	wakeThread();
+	wakeThreads();
 }
 
-void TaskQueue::wakeThread() {
-	if (!_thread) {
-		_thread = new QThread();
+void TaskQueue::pushTask(const TaskPtr &task, TaskPriority priority) {
+	if (_workers.isEmpty()) {
+		_threads.reserve(_workersCount);
+		_workers.reserve(_workersCount);
+		for (int32 i = 0; i < _workersCount; ++i) {
+			QThread *thread = new QThread();
+			TaskQueueWorker *worker = new TaskQueueWorker(this, i);
+			worker->moveToThread(thread);
 
-		_worker = new TaskQueueWorker(this);
-		_worker->moveToThread(_thread);
+			connect(this, SIGNAL(taskAdded()), worker, SLOT(onTaskAdded()));
+			connect(worker, SIGNAL(taskProcessed()), this, SLOT(onTaskProcessed()));
 
-		connect(this, SIGNAL(taskAdded()), _worker, SLOT(onTaskAdded()));
-		connect(_worker, SIGNAL(taskProcessed()), this, SLOT(onTaskProcessed()));
-
-		_thread->start();
+			_threads.push_back(thread);
+			_workers.push_back(worker);
+		}
+		for (int32 i = 0; i < _workersCount; ++i) {
+			_threads.at(i)->start();
+		}
 	}
+
+	EntryPtr entry(new Entry(task, priority));
+	_tasks.insert(task->id(), entry);
+	_finishOrder[priority].push_back(entry);
+
+	// tasks are spread between the workers, an idle worker steals them from the others
+	TaskQueueWorker *worker = _workers.at(_nextWorker);
+	_nextWorker = (_nextWorker + 1) % _workersCount;
+
+	QMutexLocker lock(&worker->_tasksMutex);
+	worker->_tasks[priority].push_back(entry);
+}
+
+void TaskQueue::wakeThreads() {
 	if (_stopTimer) _stopTimer->stop();
 	emit taskAdded();
 }
 
-void TaskQueue::cancelTask(TaskId id) {
-	{
-		QMutexLocker lock(&_tasksToProcessMutex);
-		for (int32 i = 0, l = _tasksToProcess.size(); i != l; ++i) {
-			if (_tasksToProcess.at(i)->id() == id) {
-				_tasksToProcess.removeAt(i);
-				return;
+TaskQueue::EntryPtr TaskQueue::takeTask(int32 workerIndex) {
+	for (int32 priority = 0; priority < TaskPrioritiesCount; ++priority) {
+		for (int32 i = 0; i < _workersCount; ++i) {
+			TaskQueueWorker *worker = _workers.at((workerIndex + i) % _workersCount);
+
+			QMutexLocker lock(&worker->_tasksMutex);
+			QList<EntryPtr> &list(worker->_tasks[priority]);
+			while (!list.isEmpty()) {
+				EntryPtr entry = i ? list.takeLast() : list.takeFirst();
+				if (entry->state.testAndSetOrdered(Entry::Waiting, Entry::Processing)) {
+					return entry;
+				}
 			}
 		}
 	}
-	QMutexLocker lock(&_tasksToFinishMutex);
-	for (int32 i = 0, l = _tasksToFinish.size(); i != l; ++i) {
-		if (_tasksToFinish.at(i)->id() == id) {
-			_tasksToFinish.removeAt(i);
-			return;
-		}
+	return EntryPtr();
+}
+
+void TaskQueue::cancelTask(TaskId id) {
+	// the task is only marked, the workers and onTaskProcessed() skip it
+	EntryPtr entry = _tasks.take(id);
+	if (entry) {
+		entry->state.fetchAndStoreOrdered(Entry::Cancelled);
+		stopIfEmpty();
 	}
 }
 
 void TaskQueue::onTaskProcessed() {
-	do {
-		TaskPtr task;
-		{
-			QMutexLocker lock(&_tasksToFinishMutex);
-			if (_tasksToFinish.isEmpty()) break;
-			task = _tasksToFinish.front();
-			_tasksToFinish.pop_front();
+	for (int32 priority = 0; priority < TaskPrioritiesCount; ++priority) {
+		QList<EntryPtr> &list(_finishOrder[priority]);
+		while (!list.isEmpty()) {
+			EntryPtr entry = list.front();
+			int state = entry->state.loadAcquire();
+			if (state == Entry::Processed) {
+				list.pop_front();
+				_tasks.remove(entry->task->id());
+				entry->task->finish();
+			} else if (state == Entry::Cancelled) {
+				list.pop_front();
+			} else { // wait for the previous task to be processed
+				break;
+			}
 		}
-		task->finish();
-	} while (true);
+	}
+	stopIfEmpty();
+}
 
-	if (_stopTimer) {
-		QMutexLocker lock(&_tasksToProcessMutex);
-		if (_tasksToProcess.isEmpty()) {
-			_stopTimer->start();
-		}
+void TaskQueue::stopIfEmpty() {
+	if (_stopTimer && _tasks.isEmpty()) {
+		_stopTimer->start();
 	}
 }
 
 void TaskQueue::stop() {
-	if (_thread) {
-		_thread->requestInterruption();
-		_thread->quit();
+	for (int32 i = 0, l = _threads.size(); i != l; ++i) {
+		_threads.at(i)->requestInterruption();
+		_threads.at(i)->quit();
+	}
+	if (!_threads.isEmpty()) {
 		DEBUG_LOG(("Waiting for taskThread to finish"));
-		_thread->wait();
-		delete _worker;
-		delete _thread;
-		_worker = 0;
-		_thread = 0;
 	}
-	_tasksToProcess.clear();
-	_tasksToFinish.clear();
+	for (int32 i = 0, l = _threads.size(); i != l; ++i) {
+		_threads.at(i)->wait();
+		delete _workers.at(i);
+		delete _threads.at(i);
+	}
+	_workers.clear();
+	_threads.clear();
+	_nextWorker = 0;
+
+	for (int32 priority = 0; priority < TaskPrioritiesCount; ++priority) {
+		_finishOrder[priority].clear();
+	}
+	_tasks.clear();
 }
 
 TaskQueue::~TaskQueue() {
@@ -137,36 +177,16 @@ void TaskQueueWorker::onTaskAdded() {
 	if (_inTaskAdded) return;
 	_inTaskAdded = true;
 
-	bool someTasksLeft = false;
-	do {
-		TaskPtr task;
-		{
-			QMutexLocker lock(&_queue->_tasksToProcessMutex);
-			if (!_queue->_tasksToProcess.isEmpty()) {
-				task = _queue->_tasksToProcess.front();
-			}
-		}
+	while (!thread()->isInterruptionRequested()) {
+		TaskQueue::EntryPtr entry = _queue->takeTask(_index);
+		if (!entry) break;
 
-		if (task) {
-			task->process();
-			bool emitTaskProcessed = false;
-			{
-				QMutexLocker lockToProcess(&_queue->_tasksToProcessMutex);
-				if (!_queue->_tasksToProcess.isEmpty() && _queue->_tasksToProcess.front() == task) {
-					_queue->_tasksToProcess.pop_front();
-					someTasksLeft = !_queue->_tasksToProcess.isEmpty();
-
-					QMutexLocker lockToFinish(&_queue->_tasksToFinishMutex);
-					emitTaskProcessed = _queue->_tasksToFinish.isEmpty();
-					_queue->_tasksToFinish.push_back(task);
-				}
-			}
-			if (emitTaskProcessed) {
-				emit taskProcessed();
-			}
+		entry->task->process();
+		if (entry->state.testAndSetOrdered(TaskQueue::Entry::Processing, TaskQueue::Entry::Processed)) {
+			emit taskProcessed();
 		}
 		QCoreApplication::processEvents();
-	} while (someTasksLeft && !thread()->isInterruptionRequested());
+	}
 
 	_inTaskAdded = false;
 }
@@ -102,24 +102,47 @@ public:
 typedef QSharedPointer<Task> TaskPtr;
 typedef QList<TaskPtr> TasksList;
 
+enum TaskPriority { // tasks of a higher priority are processed first
+	TaskPriorityHigh,
+	TaskPriorityNormal,
+	TaskPriorityLow,
+
+	TaskPrioritiesCount
+};
+
 class TaskQueueWorker;
 class TaskQueue : public QObject {
 	Q_OBJECT
 
 public:
 
-	TaskQueue(QObject *parent, int32 stopTimeoutMs = 0); // <= 0 - never stop worker
+	TaskQueue(QObject *parent, int32 stopTimeoutMs = 0, int32 workersCount = 1); // <= 0 - never stop workers
 
-	TaskId addTask(TaskPtr task);
-	void addTasks(const TasksList &tasks);
+	TaskId addTask(TaskPtr task, TaskPriority priority = TaskPriorityNormal);
+	void addTasks(const TasksList &tasks, TaskPriority priority = TaskPriorityNormal);
 	void cancelTask(TaskId id); // this task finish() won't be called
 
-	TaskId addTask(Task *task) {
-		return addTask(TaskPtr(task));
+	TaskId addTask(Task *task, TaskPriority priority = TaskPriorityNormal) {
+		return addTask(TaskPtr(task), priority);
 	}
 
 	~TaskQueue();
 
+	struct Entry {
+		enum State {
+			Waiting,
+			Processing,
+			Processed,
+			Cancelled,
+		};
+		Entry(const TaskPtr &task, TaskPriority priority) : task(task), priority(priority), state(Waiting) {
+		}
+		TaskPtr task;
+		TaskPriority priority;
+		QAtomicInt state;
+	};
+	typedef QSharedPointer<Entry> EntryPtr;
+
 signals:
 
 	void taskAdded();
@@ -133,12 +156,18 @@ private:
 
 	friend class TaskQueueWorker;
 
-	void wakeThread();
+	void pushTask(const TaskPtr &task, TaskPriority priority);
+	void wakeThreads();
+	void stopIfEmpty();
+	EntryPtr takeTask(int32 workerIndex); // from the worker own list or stolen from the other workers
 
-	TasksList _tasksToProcess, _tasksToFinish;
-	QMutex _tasksToProcessMutex, _tasksToFinishMutex;
-	QThread *_thread;
-	TaskQueueWorker *_worker;
+	// finish() of tasks with the same priority is called in the order they were added
+	QList<EntryPtr> _finishOrder[TaskPrioritiesCount];
+	QHash<TaskId, EntryPtr> _tasks; // not finished and not cancelled tasks
+
+	int32 _workersCount, _nextWorker;
+	QVector<QThread*> _threads;
+	QVector<TaskQueueWorker*> _workers;
 	QTimer *_stopTimer;
 
 };
@@ -148,7 +177,7 @@ class TaskQueueWorker : public QObject {
 
 public:
 
-	TaskQueueWorker(TaskQueue *queue) : _queue(queue), _inTaskAdded(false) {
+	TaskQueueWorker(TaskQueue *queue, int32 index) : _queue(queue), _index(index), _inTaskAdded(false) {
 	}
 
 signals:
@@ -160,9 +189,17 @@ public slots:
 	void onTaskAdded();
 
 private:
+
+	friend class TaskQueue;
+
 	TaskQueue *_queue;
+	int32 _index;
 	bool _inTaskAdded;
 
+	// own tasks are taken from the front, other workers steal from the back
+	QMutex _tasksMutex;
+	QList<TaskQueue::EntryPtr> _tasks[TaskPrioritiesCount];
+
 };
 
 struct FileLoadTo {
@@ -77,6 +77,7 @@ namespace {
 	bool _started = false;
 	_local_inner::Manager *_manager = 0;
 	TaskQueue *_localLoader = 0;
+	TaskQueue *_localWriter = 0; // cache writes are encrypted and written here
 
 	bool _working() {
 		return _manager && !_basePath.isEmpty();
@@ -101,6 +102,12 @@ namespace {
 		return false;
 	}
 
+	// small cache entries live in packed segment files, see PackedCache
+	bool _packedCacheContains(const FileKey &key);
+	bool _packedCacheRemove(const FileKey &key);
+	void _cacheWriterCancel(const FileKey &key);
+	bool _cacheWriterContains(const FileKey &key);
+
 	FileKey genKey(int options = UserPath | SafePath) {
 		if (options & UserPath) {
 			if (!_userWorking()) return 0;
@@ -116,12 +123,12 @@ namespace {
 			result = rand_value<FileKey>();
 			path.resize(base.size());
 			path += toFilePart(result);
-		} while (!result || keyAlreadyUsed(path, options));
+		} while (!result || keyAlreadyUsed(path, options) || ((options & UserPath) && (_packedCacheContains(result) || _cacheWriterContains(result))));
 
 		return result;
 	}
 
-	void clearKey(const FileKey &key, int options = UserPath | SafePath) {
+	void clearKeyFiles(const FileKey &key, int options = UserPath | SafePath) {
 		if (options & UserPath) {
 			if (!_userWorking()) return;
 		} else {
@@ -138,6 +145,16 @@ namespace {
 		}
 	}
 
+	void clearKey(const FileKey &key, int options = UserPath | SafePath) {
+		if (options & UserPath) {
+			_cacheWriterCancel(key);
+			if (_packedCacheRemove(key)) {
+				return;
+			}
+		}
+		clearKeyFiles(key, options);
+	}
+
 	bool _checkStreamStatus(QDataStream &stream) {
 		if (stream.status() != QDataStream::Ok) {
 			LOG(("Bad data stream status: %1").arg(stream.status()));
@@ -284,8 +301,9 @@ namespace {
 		}
 		static QByteArray prepareEncrypted(EncryptedDescriptor &data, const MTP::AuthKey &key = _localKey) {
 			data.finish();
-			QByteArray &toEncrypt(data.data);
-
+			return prepareEncrypted(data.data, key);
+		}
+		static QByteArray prepareEncrypted(QByteArray &toEncrypt, const MTP::AuthKey &key = _localKey) {
 			// prepare for encryption
 			uint32 size = toEncrypt.size(), fullSize = size;
 			if (fullSize & 0x0F) {
@@ -534,10 +552,820 @@ namespace {
 		return true;
 	}
 
+	class PackedCache {
+	public:
+
+		PackedCache() : _started(false), _activeSegment(0) {
+		}
+
+		void start(const QString &basePath) {
+			QMutexLocker lock(&_mutex);
+			if (_started) return;
+
+			_basePath = basePath;
+			_segments.clear();
+			QDir dir(_basePath);
+			QStringList names = dir.entryList(QStringList(segmentPrefix() + '*'), QDir::Files);
+			for (QStringList::const_iterator i = names.cbegin(), e = names.cend(); i != e; ++i) {
+				bool ok = false;
+				quint32 index = i->mid(segmentPrefix().size()).toUInt(&ok);
+				if (!ok) continue;
+
+				Segment &segment(_segments[index]);
+				segment.size = QFileInfo(dir.filePath(*i)).size();
+				segment.live = 0;
+			}
+			for (Entries::iterator i = _entries.begin(); i != _entries.end();) {
+				Segments::iterator j = _segments.find(i.value().segment);
+				if (j == _segments.cend() || i.value().offset + i.value().size > j.value().size) {
+					i = _entries.erase(i);
+				} else {
+					j.value().live += i.value().size;
+					++i;
+				}
+			}
+
+			// segments without any indexed entries were left by a lost or reset map
+			for (Segments::iterator i = _segments.begin(); i != _segments.end();) {
+				if (i.value().live) {
+					++i;
+				} else {
+					QFile::remove(segmentPath(i.key()));
+					i = _segments.erase(i);
+				}
+			}
+			_activeSegment = _segments.isEmpty() ? 0 : (_segments.cend() - 1).key();
+			_started = true;
+		}
+
+		void finish() {
+			QMutexLocker lock(&_mutex);
+			for (Segments::iterator i = _segments.begin(), e = _segments.end(); i != e; ++i) {
+				delete i.value().file;
+				i.value().file = 0;
+			}
+		}
+
+		// removes all the segments, used when the cache is cleared or reset
+		void clear() {
+			QMutexLocker lock(&_mutex);
+			for (Segments::iterator i = _segments.begin(), e = _segments.end(); i != e; ++i) {
+				delete i.value().file;
+				QFile::remove(segmentPath(i.key()));
+			}
+			_segments.clear();
+			_entries.clear();
+			_activeSegment = 0;
+		}
+
+		bool contains(const FileKey &key) {
+			QMutexLocker lock(&_mutex);
+			return _entries.constFind(key) != _entries.cend();
+		}
+
+		bool write(const FileKey &key, const QByteArray &encrypted) {
+			QMutexLocker lock(&_mutex);
+			if (!_started) return false;
+
+			Entry entry;
+			if (!append(key, AppVersion, encrypted, entry)) {
+				return false;
+			}
+			Entries::iterator i = _entries.find(key);
+			if (i != _entries.cend()) {
+				markDead(i.value());
+				i.value() = entry;
+			} else {
+				_entries.insert(key, entry);
+			}
+			return true;
+		}
+
+		bool read(const FileKey &key, qint32 &version, QByteArray &encrypted) {
+			QMutexLocker lock(&_mutex);
+			Entries::const_iterator i = _entries.constFind(key);
+			if (i == _entries.cend()) return false;
+
+			QByteArray bytes;
+			if (!readRaw(i.value(), bytes)) {
+				return false;
+			}
+			quint64 entryKey = 0;
+			quint32 entrySize = 0;
+			memcpy(&version, bytes.constData(), sizeof(qint32));
+			memcpy(&entryKey, bytes.constData() + sizeof(qint32), sizeof(quint64));
+			memcpy(&entrySize, bytes.constData() + sizeof(qint32) + sizeof(quint64), sizeof(quint32));
+			if (entryKey != key || entrySize + EntryHeaderSize != i.value().size || version > AppVersion) {
+				LOG(("App Error: bad packed cache entry for key %1").arg(toFilePart(key)));
+				return false;
+			}
+			encrypted = bytes.mid(EntryHeaderSize);
+			return true;
+		}
+
+		bool remove(const FileKey &key) {
+			QMutexLocker lock(&_mutex);
+			Entries::iterator i = _entries.find(key);
+			if (i == _entries.cend()) return false;
+
+			markDead(i.value());
+			_entries.erase(i);
+			return true;
+		}
+
+		bool needsCompaction() {
+			QMutexLocker lock(&_mutex);
+			return findSegmentToCompact() != _segments.cend();
+		}
+
+		// moves live entries of one sparse segment to a new one and removes it,
+		// the segment files are read and written without holding the lock
+		bool compact() {
+			typedef QList<QPair<FileKey, Entry> > MovedEntries;
+			MovedEntries moving;
+			quint32 index = 0, target = 0;
+			{
+				QMutexLocker lock(&_mutex);
+				Segments::iterator segment = findSegmentToCompact();
+				if (segment == _segments.cend()) return false;
+
+				index = segment.key();
+				for (Entries::const_iterator i = _entries.cbegin(), e = _entries.cend(); i != e; ++i) {
+					if (i.value().segment == index) {
+						moving.push_back(qMakePair(i.key(), i.value()));
+					}
+				}
+				target = qMax((_segments.cend() - 1).key(), _activeSegment) + 1;
+				_segments.insert(target, Segment()); // reserved, appendRaw() skips it
+				_compacting = true;
+				_compactTarget = target;
+			}
+
+			// the segment being compacted is not active, so nobody appends to it meanwhile
+			QFile from(segmentPath(index)), to(segmentPath(target));
+			bool ok = from.open(QIODevice::ReadOnly) && to.open(QIODevice::WriteOnly);
+			MovedEntries moved;
+			quint32 offset = 0;
+			for (MovedEntries::const_iterator i = moving.cbegin(), e = moving.cend(); ok && i != e; ++i) {
+				const Entry &entry(i->second);
+				QByteArray bytes;
+				if (entry.size >= EntryHeaderSize && from.seek(entry.offset)) {
+					bytes = from.read(entry.size);
+				}
+				if (bytes.size() != int(entry.size) || to.write(bytes) != bytes.size()) {
+					ok = false;
+					break;
+				}
+				Entry result;
+				result.segment = target;
+				result.offset = offset;
+				result.size = entry.size;
+				moved.push_back(qMakePair(i->first, result));
+				offset += entry.size;
+			}
+			if (ok && !to.flush()) ok = false;
+			from.close();
+			to.close();
+
+			QMutexLocker lock(&_mutex);
+			_compacting = false;
+			Segments::iterator reserved = _segments.find(target);
+			if (!ok || reserved == _segments.cend()) { // failed or the cache was cleared meanwhile
+				if (!ok) LOG(("App Error: could not compact packed cache segment %1").arg(index));
+				if (reserved != _segments.cend()) _segments.erase(reserved);
+				QFile::remove(segmentPath(target));
+				return false;
+			}
+			reserved.value().size = offset;
+
+			// entries rewritten or removed while we were copying already are dead in the new segment
+			for (int32 i = 0, l = moved.size(); i < l; ++i) {
+				Entries::iterator j = _entries.find(moved.at(i).first);
+				if (j == _entries.cend()) continue;
+
+				const Entry &was(moving.at(i).second);
+				if (j.value().segment == was.segment && j.value().offset == was.offset && j.value().size == was.size) {
+					j.value() = moved.at(i).second;
+					reserved.value().live += j.value().size;
+				}
+			}
+			if (!reserved.value().live) {
+				_segments.erase(reserved);
+				QFile::remove(segmentPath(target));
+			}
+
+			Segments::iterator segment = _segments.find(index);
+			if (segment != _segments.cend()) {
+				delete segment.value().file;
+				_segments.erase(segment);
+				QFile::remove(segmentPath(index));
+			}
+			return true;
+		}
+
+		uint32 indexSize() {
+			QMutexLocker lock(&_mutex);
+			return sizeof(quint32) + _entries.size() * (sizeof(quint64) + sizeof(quint32) * 3);
+		}
+
+		void writeIndex(QDataStream &stream) {
+			QMutexLocker lock(&_mutex);
+			stream << quint32(_entries.size());
+			for (Entries::const_iterator i = _entries.cbegin(), e = _entries.cend(); i != e; ++i) {
+				stream << quint64(i.key()) << quint32(i.value().segment) << quint32(i.value().offset) << quint32(i.value().size);
+			}
+		}
+
+		void readIndex(QDataStream &stream) {
+			QMutexLocker lock(&_mutex);
+			_entries.clear();
+
+			quint32 count = 0;
+			stream >> count;
+			for (quint32 i = 0; i < count; ++i) {
+				quint64 key;
+				Entry entry;
+				stream >> key >> entry.segment >> entry.offset >> entry.size;
+				_entries.insert(key, entry);
+			}
+		}
+
+		bool isEmpty() {
+			QMutexLocker lock(&_mutex);
+			return _entries.isEmpty();
+		}
+
+		~PackedCache() {
+			finish();
+		}
+
+	private:
+
+		// each entry is stored as app version + key + encrypted size + encrypted data
+		static const quint32 EntryHeaderSize = sizeof(qint32) + sizeof(quint64) + sizeof(quint32);
+
+		struct Entry {
+			Entry() : segment(0), offset(0), size(0) {
+			}
+			quint32 segment, offset, size;
+		};
+		typedef QMap<FileKey, Entry> Entries;
+
+		struct Segment {
+			Segment() : file(0), size(0), live(0) {
+			}
+			QFile *file;
+			qint64 size, live;
+		};
+		typedef QMap<quint32, Segment> Segments;
+
+		static QString segmentPrefix() {
+			return qsl("packed_");
+		}
+
+		QString segmentPath(quint32 index) const {
+			return _basePath + segmentPrefix() + QString::number(index);
+		}
+
+		QFile *segmentFile(quint32 index) {
+			Segment &segment(_segments[index]);
+			if (!segment.file) {
+				segment.file = new QFile(segmentPath(index));
+				if (!segment.file->open(QIODevice::ReadWrite)) {
+					LOG(("App Error: could not open packed cache segment %1").arg(index));
+					delete segment.file;
+					segment.file = 0;
+				}
+			}
+			return segment.file;
+		}
+
+		void markDead(const Entry &entry) {
+			Segments::iterator i = _segments.find(entry.segment);
+			if (i != _segments.cend()) {
+				i.value().live -= entry.size;
+			}
+		}
+
+		Segments::iterator findSegmentToCompact() {
+			for (Segments::iterator i = _segments.begin(), e = _segments.end(); i != e; ++i) {
+				if (i.key() != _activeSegment && (!_compacting || i.key() != _compactTarget) && i.value().live * 2 < i.value().size) {
+					return i;
+				}
+			}
+			return _segments.end();
+		}
+
+		bool readRaw(const Entry &entry, QByteArray &bytes) {
+			QFile *file = segmentFile(entry.segment);
+			if (!file || entry.size < EntryHeaderSize || !file->seek(entry.offset)) {
+				return false;
+			}
+			bytes = file->read(entry.size);
+			return (bytes.size() == int(entry.size));
+		}
+
+		bool append(const FileKey &key, qint32 version, const QByteArray &encrypted, Entry &entry) {
+			QByteArray bytes(EntryHeaderSize + encrypted.size(), Qt::Uninitialized);
+			quint64 entryKey = key;
+			quint32 entrySize = encrypted.size();
+			memcpy(bytes.data(), &version, sizeof(qint32));
+			memcpy(bytes.data() + sizeof(qint32), &entryKey, sizeof(quint64));
+			memcpy(bytes.data() + sizeof(qint32) + sizeof(quint64), &entrySize, sizeof(quint32));
+			memcpy(bytes.data() + EntryHeaderSize, encrypted.constData(), encrypted.size());
+			return appendRaw(bytes, entry);
+		}
+
+		bool appendRaw(const QByteArray &bytes, Entry &entry) {
+			Segments::iterator active = _segments.find(_activeSegment);
+			if (active != _segments.cend() && active.value().size + bytes.size() > PackedCacheSegmentMaxSize) {
+				++_activeSegment;
+				if (_compacting && _activeSegment == _compactTarget) ++_activeSegment;
+			}
+			QFile *file = segmentFile(_activeSegment);
+			if (!file) return false;
+
+			Segment &segment(_segments[_activeSegment]);
+			if (!file->seek(segment.size) || file->write(bytes) != bytes.size() || !file->flush()) {
+				LOG(("App Error: could not write to packed cache segment %1").arg(_activeSegment));
+				return false;
+			}
+			entry.segment = _activeSegment;
+			entry.offset = segment.size;
+			entry.size = bytes.size();
+			segment.size += bytes.size();
+			segment.live += bytes.size();
+			return true;
+		}
+
+		QMutex _mutex;
+		bool _started;
+		QString _basePath;
+		Entries _entries;
+		Segments _segments;
+		quint32 _activeSegment;
+		bool _compacting = false;
+		quint32 _compactTarget = 0; // segment written by compact() outside of the lock
+
+	};
+	PackedCache _packedCache;
+	bool _packedCacheCompacting = false;
+
+	bool _packedCacheContains(const FileKey &key) {
+		return _packedCache.contains(key);
+	}
+
+	bool _packedCacheRemove(const FileKey &key) {
+		return _packedCache.remove(key);
+	}
+
+	// writes a cache entry to the packed segments if it is small enough or to a separate file
+	void _writeCacheEntryNow(const FileKey &key, QByteArray &data) {
+		QByteArray encrypted = FileWriteDescriptor::prepareEncrypted(data);
+		if (encrypted.size() <= PackedCacheEntryMaxSize && _packedCache.write(key, encrypted)) {
+			clearKeyFiles(key, UserPath); // could be stored in a separate file before
+			return;
+		}
+		_packedCache.remove(key);
+
+		FileWriteDescriptor file(key, UserPath);
+		file.writeData(encrypted);
+	}
+
+	// large cache entries are split to chunks encrypted separately, so they can be read by parts, see CacheStreamReader
+	// file: magic, version, chunk size, content size, chunks: [ 128bit of sha1 - key128 ] [ encrypted chunk block ]
+	// chunk block: [ quint32 index ] [ quint32 len ] [ quint64 content size ] [ len bytes of content ] [ random padding ]
+	static const char tdfStreamMagic[] = { 'T', 'D', 'F', 's' };
+	static const int32 tdfStreamHeaderLen = tdfMagicLen + sizeof(qint32) + sizeof(quint32) + sizeof(quint64);
+	static const int32 tdfStreamChunkHeaderLen = sizeof(quint32) + sizeof(quint32) + sizeof(quint64);
+
+	uint32 _cacheStreamBlockSize(uint32 len) {
+		uint32 result = tdfStreamChunkHeaderLen + len;
+		if (result & 0x0F) result += 0x10 - (result & 0x0F);
+		return result;
+	}
+
+	qint64 _cacheStreamFileSize(quint64 size, quint32 chunkSize) {
+		quint64 full = size / chunkSize, last = size % chunkSize;
+		qint64 result = tdfStreamHeaderLen + full * (0x10 + _cacheStreamBlockSize(chunkSize));
+		if (last) result += 0x10 + _cacheStreamBlockSize(last);
+		return result;
+	}
+
+	void _writeCacheStreamNow(const FileKey &key, const QByteArray &content) {
+		if (!_userWorking()) return;
+
+		_packedCache.remove(key);
+
+		QFile f(_userBasePath + toFilePart(key) + '0');
+		if (!f.open(QIODevice::WriteOnly)) {
+			LOG(("App Error: could not open '%1' for writing a cache stream").arg(f.fileName()));
+			return;
+		}
+
+		qint32 version = AppVersion;
+		quint32 chunkSize = CacheStreamChunkSize;
+		quint64 size = content.size();
+		f.write(tdfStreamMagic, tdfMagicLen);
+		f.write((const char*)&version, sizeof(version));
+		f.write((const char*)&chunkSize, sizeof(chunkSize));
+		f.write((const char*)&size, sizeof(size));
+
+		QByteArray block(_cacheStreamBlockSize(chunkSize), Qt::Uninitialized), encrypted(0x10 + block.size(), Qt::Uninitialized);
+		uchar sha1Buffer[20];
+		quint32 index = 0;
+		for (quint64 offset = 0; offset < size; offset += chunkSize, ++index) {
+			quint32 len = quint32(qMin(quint64(chunkSize), size - offset));
+			uint32 blockSize = _cacheStreamBlockSize(len);
+			char *data = block.data();
+			*(quint32*)data = index;
+			*(quint32*)(data + sizeof(quint32)) = len;
+			*(quint64*)(data + 2 * sizeof(quint32)) = size;
+			memcpy(data + tdfStreamChunkHeaderLen, content.constData() + offset, len);
+			if (tdfStreamChunkHeaderLen + len < blockSize) {
+				memset_rand(data + tdfStreamChunkHeaderLen + len, blockSize - tdfStreamChunkHeaderLen - len);
+			}
+
+			memcpy(encrypted.data(), hashSha1(data, blockSize, sha1Buffer), 0x10);
+			MTP::aesEncryptLocal(data, encrypted.data() + 0x10, blockSize, &_localKey, encrypted.constData());
+			if (f.write(encrypted.constData(), 0x10 + blockSize) != 0x10 + blockSize) {
+				LOG(("App Error: could not write a cache stream chunk to '%1'").arg(f.fileName()));
+				f.close();
+				QFile::remove(f.fileName());
+				return;
+			}
+		}
+	}
+
+	struct CacheWrite {
+		CacheWrite() : streamed(false) {
+		}
+		CacheWrite(const QByteArray &data, bool streamed) : data(data), streamed(streamed) {
+		}
+		QByteArray data;
+		bool streamed; // raw content for _writeCacheStreamNow(), otherwise EncryptedDescriptor data
+	};
+
+	void _writeCacheNow(const FileKey &key, CacheWrite &write) {
+		if (write.streamed) {
+			_writeCacheStreamNow(key, write.data);
+		} else {
+			_writeCacheEntryNow(key, write.data);
+		}
+	}
+
+	// write-behind queue for cache entries, the data is encrypted and written in _localWriter thread
+	class CacheWriter {
+	public:
+
+		CacheWriter() : _queuedBytes(0), _draining(false), _writesCount(0), _writesTime(0) {
+		}
+
+		// blocks while too much data is waiting to be written
+		bool push(const FileKey &key, const QByteArray &data, bool streamed) {
+			QMutexLocker lock(&_mutex);
+			if (!_localWriter) return false;
+
+			Queue::iterator i = _queue.find(key);
+			if (i != _queue.cend()) { // coalesce with the not yet written data
+				_queuedBytes += data.size() - i.value().data.size();
+				i.value() = CacheWrite(data, streamed);
+				return true;
+			}
+			while (_queuedBytes > 0 && _queuedBytes + data.size() > CacheWriteQueueMaxSize) {
+				_written.wait(&_mutex);
+			}
+			_queue.insert(key, CacheWrite(data, streamed));
+			_order.push_back(key);
+			_queuedBytes += data.size();
+			if (!_draining) {
+				_draining = true;
+				_localWriter->addTask(new CacheWriteTask());
+			}
+			return true;
+		}
+
+		// data that was not written yet is returned to readers as is
+		bool pending(const FileKey &key, QByteArray &data, bool &streamed) {
+			QMutexLocker lock(&_mutex);
+			Queue::const_iterator i = _queue.constFind(key);
+			if (i == _queue.cend()) {
+				i = _writing.constFind(key);
+				if (i == _writing.cend()) {
+					return false;
+				}
+			}
+			data = i.value().data;
+			streamed = i.value().streamed;
+			return true;
+		}
+
+		// waits for the write in progress so that the cleared entry won't appear again
+		void cancel(const FileKey &key) {
+			QMutexLocker lock(&_mutex);
+			Queue::iterator i = _queue.find(key);
+			if (i != _queue.cend()) {
+				_queuedBytes -= i.value().data.size();
+				_queue.erase(i);
+				_order.removeOne(key);
+				_written.wakeAll();
+			}
+			while (_writing.contains(key)) {
+				_written.wait(&_mutex);
+			}
+		}
+
+		bool contains(const FileKey &key) {
+			QMutexLocker lock(&_mutex);
+			return _queue.contains(key) || _writing.contains(key);
+		}
+
+		void clear() {
+			QMutexLocker lock(&_mutex);
+			_queue.clear();
+			_order.clear();
+			_queuedBytes = 0;
+			_written.wakeAll();
+			while (!_writing.isEmpty()) {
+				_written.wait(&_mutex);
+			}
+		}
+
+		// writes everything that is left in the queue, used when the writer thread is stopped
+		void flush() {
+			FileKey key;
+			CacheWrite write;
+			while (takeNext(key, write)) {
+				uint64 ms = getms();
+				_writeCacheNow(key, write);
+				written(key, getms() - ms);
+			}
+			QMutexLocker lock(&_mutex);
+			_draining = false;
+		}
+
+		bool takeNext(FileKey &key, CacheWrite &write) {
+			QMutexLocker lock(&_mutex);
+			if (_order.isEmpty()) {
+				_draining = false;
+				return false;
+			}
+			key = _order.front();
+			_order.pop_front();
+
+			Queue::iterator i = _queue.find(key);
+			write = i.value();
+			_queuedBytes -= write.data.size();
+			_writing.insert(key, write);
+			_queue.erase(i);
+			return true;
+		}
+
+		void written(const FileKey &key, uint64 ms) {
+			QMutexLocker lock(&_mutex);
+			_writing.remove(key);
+			++_writesCount;
+			_writesTime += ms;
+			_written.wakeAll();
+		}
+
+		qint64 queuedBytes() {
+			QMutexLocker lock(&_mutex);
+			return _queuedBytes;
+		}
+
+		float64 averageWriteTime() {
+			QMutexLocker lock(&_mutex);
+			return _writesCount ? (float64(_writesTime) / _writesCount) : 0.;
+		}
+
+	private:
+
+		class CacheWriteTask : public Task {
+		public:
+			void process();
+			void finish() {
+			}
+		};
+
+		typedef QMap<FileKey, CacheWrite> Queue;
+		QMutex _mutex;
+		QWaitCondition _written;
+		Queue _queue, _writing;
+		QList<FileKey> _order;
+		qint64 _queuedBytes;
+		bool _draining;
+		uint64 _writesCount, _writesTime;
+
+	};
+	CacheWriter _cacheWriter;
+
+	void CacheWriter::CacheWriteTask::process() {
+		FileKey key;
+		CacheWrite write;
+		while (_cacheWriter.takeNext(key, write)) {
+			uint64 ms = getms();
+			_writeCacheNow(key, write);
+			_cacheWriter.written(key, getms() - ms);
+		}
+	}
+
+	void _cacheWriterCancel(const FileKey &key) {
+		_cacheWriter.cancel(key);
+	}
+
+	bool _cacheWriterContains(const FileKey &key) {
+		return _cacheWriter.contains(key);
+	}
+
+	// random access to the content of a cache entry written by writeCacheStream()
+	// only one decrypted chunk is kept in memory, the entry is read from the write queue if it is not written yet
+	class CacheStreamReader : public QIODevice {
+	public:
+
+		CacheStreamReader(const FileKey &key) : _key(key), _size(0), _chunkSize(0), _chunkIndex(-1) {
+		}
+
+		bool open(OpenMode mode) override {
+			if (mode != QIODevice::ReadOnly || isOpen()) return false;
+
+			bool streamed = false;
+			if (_cacheWriter.pending(_key, _pending, streamed)) {
+				if (!streamed) return false;
+				_size = _pending.size();
+				return QIODevice::open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+			}
+			_pending = QByteArray();
+
+			if (!_userWorking()) return false;
+			_file.setFileName(_userBasePath + toFilePart(_key) + '0');
+			if (!_file.open(QIODevice::ReadOnly)) {
+				return false;
+			}
+
+			char magic[tdfMagicLen];
+			qint32 version = 0;
+			quint32 chunkSize = 0;
+			quint64 size = 0;
+			if (_file.read(magic, tdfMagicLen) != tdfMagicLen || memcmp(magic, tdfStreamMagic, tdfMagicLen)) {
+				_file.close();
+				return false;
+			}
+			if (_file.read((char*)&version, sizeof(version)) != sizeof(version) || version > AppVersion) {
+				LOG(("App Error: bad version %1 in cache stream '%2'").arg(version).arg(_file.fileName()));
+				_file.close();
+				return false;
+			}
+			if (_file.read((char*)&chunkSize, sizeof(chunkSize)) != sizeof(chunkSize) || _file.read((char*)&size, sizeof(size)) != sizeof(size)) {
+				_file.close();
+				return false;
+			}
+			if (!chunkSize || (chunkSize & 0x0F) || chunkSize > CacheStreamChunkMaxSize || size > quint64(INT_MAX) || _file.size() != _cacheStreamFileSize(size, chunkSize)) {
+				LOG(("App Error: bad cache stream '%1', chunk size %2, size %3, file size %4").arg(_file.fileName()).arg(chunkSize).arg(size).arg(_file.size()));
+				_file.close();
+				return false;
+			}
+			_chunkSize = chunkSize;
+			_size = size;
+			_chunkIndex = -1;
+			return QIODevice::open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+		}
+
+		void close() override {
+			if (isOpen()) QIODevice::close();
+			_file.close();
+			_pending = QByteArray();
+			_block = _encrypted = QByteArray();
+			_chunkIndex = -1;
+		}
+
+		qint64 size() const override {
+			return _size;
+		}
+
+		~CacheStreamReader() {
+			close();
+		}
+
+	protected:
+
+		qint64 readData(char *data, qint64 maxlen) override {
+			qint64 position = pos(), result = 0;
+			if (!_pending.isNull()) {
+				result = qMax(qMin(maxlen, _size - position), qint64(0));
+				memcpy(data, _pending.constData() + position, result);
+				return result;
+			}
+			while (result < maxlen && position < _size) {
+				int32 index = int32(position / _chunkSize);
+				if (index != _chunkIndex && !readChunk(index)) {
+					return result ? result : -1;
+				}
+				qint64 offset = position - qint64(index) * _chunkSize, chunkLen = *(const quint32*)(_block.constData() + sizeof(quint32));
+				qint64 count = qMin(maxlen - result, chunkLen - offset);
+				memcpy(data + result, _block.constData() + tdfStreamChunkHeaderLen + offset, count);
+				result += count;
+				position += count;
+			}
+			return result;
+		}
+
+		qint64 writeData(const char *data, qint64 len) override {
+			return -1;
+		}
+
+	private:
+
+		bool readChunk(int32 index) {
+			quint32 len = quint32(qMin(qint64(_chunkSize), _size - qint64(index) * _chunkSize));
+			uint32 blockSize = _cacheStreamBlockSize(len);
+			if (!_file.seek(tdfStreamHeaderLen + qint64(index) * (0x10 + _cacheStreamBlockSize(_chunkSize)))) {
+				return false;
+			}
+			_encrypted.resize(0x10 + blockSize);
+			if (_file.read(_encrypted.data(), _encrypted.size()) != _encrypted.size()) {
+				return false;
+			}
+			_block.resize(blockSize);
+			MTP::aesDecryptLocal(_encrypted.constData() + 0x10, _block.data(), blockSize, &_localKey, _encrypted.constData());
+
+			uchar sha1Buffer[20];
+			const char *block = _block.constData();
+			if (memcmp(hashSha1(block, blockSize, sha1Buffer), _encrypted.constData(), 0x10)) {
+				LOG(("App Error: bad cache stream chunk %1 key in '%2'").arg(index).arg(_file.fileName()));
+				_chunkIndex = -1;
+				return false;
+			}
+			if (*(const quint32*)block != quint32(index) || *(const quint32*)(block + sizeof(quint32)) != len || *(const quint64*)(block + 2 * sizeof(quint32)) != quint64(_size)) {
+				LOG(("App Error: bad cache stream chunk %1 header in '%2'").arg(index).arg(_file.fileName()));
+				_chunkIndex = -1;
+				return false;
+			}
+			_chunkIndex = index;
+			return true;
+		}
+
+		FileKey _key;
+		QFile _file;
+		QByteArray _pending;
+		qint64 _size;
+		quint32 _chunkSize;
+		int32 _chunkIndex;
+		QByteArray _encrypted, _block;
+
+	};
+
 	bool readEncryptedFile(FileReadDescriptor &result, const FileKey &fkey, int options = UserPath | SafePath, const MTP::AuthKey &key = _localKey) {
+		if (options & UserPath) {
+			QByteArray pending;
+			bool streamed = false;
+			if (_cacheWriter.pending(fkey, pending, streamed)) {
+				if (streamed) return false; // read it with CacheStreamReader
+
+				result.version = AppVersion;
+				result.data = pending;
+				result.buffer.setBuffer(&result.data);
+				result.buffer.open(QIODevice::ReadOnly);
+				result.buffer.seek(sizeof(uint32)); // skip len
+				result.stream.setDevice(&result.buffer);
+				result.stream.setVersion(QDataStream::Qt_5_1);
+				return true;
+			}
+
+			qint32 version = 0;
+			QByteArray encrypted;
+			if (_packedCache.read(fkey, version, encrypted)) {
+				EncryptedDescriptor data;
+				if (!decryptLocal(data, encrypted, key)) {
+					return false;
+				}
+				result.version = version;
+				result.data = data.data;
+				result.buffer.setBuffer(&result.data);
+				result.buffer.open(QIODevice::ReadOnly);
+				result.buffer.seek(data.buffer.pos());
+				result.stream.setDevice(&result.buffer);
+				result.stream.setVersion(QDataStream::Qt_5_1);
+				return true;
+			}
+		}
 		return readEncryptedFile(result, toFilePart(fkey), options, key);
 	}
 
+	void writeCacheEntry(const FileKey &key, EncryptedDescriptor &data) {
+		data.finish();
+		if (!_cacheWriter.push(key, data.data, false)) {
+			_writeCacheEntryNow(key, data.data);
+		}
+	}
+
+	// raw content is written without a descriptor so that it can be read with CacheStreamReader
+	void writeCacheStream(const FileKey &key, const QByteArray &content) {
+		if (!_cacheWriter.push(key, content, true)) {
+			_writeCacheStreamNow(key, content);
+		}
+	}
+
 	FileKey _dataNameKey = 0;
 
 	enum { // Local Storage Keys
@@ -557,6 +1385,9 @@ namespace {
 		lskReportSpamStatuses    = 0x0d, // no data
 		lskSavedGifsOld          = 0x0e, // no data
 		lskSavedGifs             = 0x0f, // no data
+		lskHistoryCache          = 0x10, // data: PeerId peer
+		lskPackedCache           = 0x11, // no data
+		lskCacheAccess           = 0x12, // no data
 	};
 
 	enum {
@@ -612,6 +1443,7 @@ namespace {
 		dbiAutoPlay = 0x37,
 		dbiAdaptiveForWide = 0x38,
 		dbiHiddenPinnedMessages = 0x39,
+		dbiCacheSizeLimits = 0x3a,
 
 		dbiEncryptedWithSalt = 333,
 		dbiEncrypted = 444,
@@ -627,6 +1459,15 @@ namespace {
 	typedef QMap<PeerId, bool> DraftsNotReadMap;
 	DraftsNotReadMap _draftsNotReadMap;
 
+	struct HistoryCacheDesc {
+		HistoryCacheDesc(FileKey key = 0, MsgId minId = 0, MsgId maxId = 0) : key(key), minId(minId), maxId(maxId) {
+		}
+		FileKey key;
+		MsgId minId, maxId; // kept in map to drop stale caches without reading them
+	};
+	typedef QMap<PeerId, HistoryCacheDesc> HistoryCacheMap;
+	HistoryCacheMap _historyCacheMap;
+
 	typedef QPair<FileKey, qint32> FileDesc; // file, size
 
 	typedef QMultiMap<MediaKey, FileLocation> FileLocations;
@@ -639,6 +1480,21 @@ namespace {
 	typedef QMap<QString, FileDesc> WebFilesMap;
 	WebFilesMap _webFilesMap;
 	uint64 _storageWebFilesSize = 0;
+	struct DownloadDesc { // not finished download of a file
+		QString fname;
+		qint32 size;
+		Local::DownloadedParts parts;
+	};
+	typedef QMap<MediaKey, DownloadDesc> DownloadsMap;
+	DownloadsMap _downloads;
+	struct UploadDesc { // not finished upload of a local file
+		QDateTime modified, saved;
+		qint32 size;
+		quint64 fileId;
+		qint32 partSize, partsCount, sentParts;
+	};
+	typedef QMap<QString, UploadDesc> UploadsMap;
+	UploadsMap _uploads;
 	FileKey _locationsKey = 0, _reportSpamStatusesKey = 0;
 
 	FileKey _recentStickersKeyOld = 0, _stickersKey = 0, _savedGifsKey = 0;
@@ -656,6 +1512,19 @@ namespace {
 	StorageMap _imagesMap, _stickerImagesMap, _audiosMap;
 	int32 _storageImagesSize = 0, _storageStickersSize = 0, _storageAudiosSize = 0;
 
+	// last access stamp of cache entries, used to evict least recently used ones,
+	// stamps come from a counter, so any access after an eviction snapshot changes the stamp
+	typedef QMap<FileKey, quint64> CacheAccessMap;
+	CacheAccessMap _cacheAccess;
+	quint64 _cacheAccessCounter = 0;
+	bool _cacheAccessChanged = false;
+	bool _cacheEvicting = false;
+
+	void _cacheAccessed(const FileKey &key) {
+		_cacheAccess[key] = ++_cacheAccessCounter;
+		_cacheAccessChanged = true;
+	}
+
 	bool _mapChanged = false;
 	int32 _oldMapVersion = 0, _oldSettingsVersion = 0;
 
@@ -675,7 +1544,7 @@ namespace {
 		if (!_working()) return;
 
 		_manager->writingLocations();
-		if (_fileLocations.isEmpty() && _webFilesMap.isEmpty()) {
+		if (_fileLocations.isEmpty() && _webFilesMap.isEmpty() && _downloads.isEmpty() && _uploads.isEmpty()) {
 			if (_locationsKey) {
 				clearKey(_locationsKey);
 				_locationsKey = 0;
@@ -719,6 +1588,18 @@ namespace {
 				size += _stringSize(i.key()) + sizeof(quint64) + sizeof(qint32);
 			}
 
+			size += sizeof(quint32); // downloads count
+			for (DownloadsMap::const_iterator i = _downloads.cbegin(), e = _downloads.cend(); i != e; ++i) {
+				// location + name + size + parts count + parts
+				size += sizeof(quint64) * 2 + _stringSize(i.value().fname) + sizeof(qint32) + sizeof(quint32) + i.value().parts.size() * sizeof(qint32) * 2;
+			}
+
+			size += sizeof(quint32); // uploads count
+			for (UploadsMap::const_iterator i = _uploads.cbegin(), e = _uploads.cend(); i != e; ++i) {
+				// name + modified + saved + size + file id + part size + parts count + sent parts
+				size += _stringSize(i.key()) + _dateTimeSize() * 2 + sizeof(qint32) + sizeof(quint64) + sizeof(qint32) * 3;
+			}
+
 			EncryptedDescriptor data(size);
 			for (FileLocations::const_iterator i = _fileLocations.cbegin(); i != _fileLocations.cend(); ++i) {
 				data.stream << quint64(i.key().first) << quint64(i.key().second) << quint32(i.value().type) << i.value().name();
@@ -744,6 +1625,21 @@ namespace {
 				data.stream << i.key() << quint64(i.value().first) << qint32(i.value().second);
 			}
 
+			data.stream << quint32(_downloads.size());
+			for (DownloadsMap::const_iterator i = _downloads.cbegin(), e = _downloads.cend(); i != e; ++i) {
+				data.stream << quint64(i.key().first) << quint64(i.key().second) << i.value().fname << qint32(i.value().size) << quint32(i.value().parts.size());
+				for (Local::DownloadedParts::const_iterator j = i.value().parts.cbegin(), end = i.value().parts.cend(); j != end; ++j) {
+					data.stream << qint32(j.key()) << qint32(j.value());
+				}
+			}
+
+			data.stream << quint32(_uploads.size());
+			for (UploadsMap::const_iterator i = _uploads.cbegin(), e = _uploads.cend(); i != e; ++i) {
+				const UploadDesc &upload(i.value());
+				data.stream << i.key() << upload.modified << upload.saved << qint32(upload.size) << quint64(upload.fileId);
+				data.stream << qint32(upload.partSize) << qint32(upload.partsCount) << qint32(upload.sentParts);
+			}
+
 			FileWriteDescriptor file(_locationsKey);
 			file.writeEncrypted(data);
 		}
@@ -807,6 +1703,47 @@ namespace {
 					_storageWebFilesSize += size;
 				}
 			}
+
+			if (!locations.stream.atEnd()) {
+				_downloads.clear();
+
+				quint32 downloadsCount;
+				locations.stream >> downloadsCount;
+				for (quint32 i = 0; i < downloadsCount; ++i) {
+					quint64 first, second;
+					DownloadDesc download;
+					quint32 partsCount;
+					locations.stream >> first >> second >> download.fname >> download.size >> partsCount;
+					for (quint32 j = 0; j < partsCount; ++j) {
+						qint32 offset, length;
+						locations.stream >> offset >> length;
+						download.parts.insert(offset, length);
+					}
+					if (!_checkStreamStatus(locations.stream)) {
+						_downloads.clear();
+						break;
+					}
+					_downloads.insert(MediaKey(first, second), download);
+				}
+			}
+
+			if (!locations.stream.atEnd()) {
+				_uploads.clear();
+
+				quint32 uploadsCount;
+				locations.stream >> uploadsCount;
+				for (quint32 i = 0; i < uploadsCount; ++i) {
+					QString fname;
+					UploadDesc upload;
+					locations.stream >> fname >> upload.modified >> upload.saved >> upload.size >> upload.fileId;
+					locations.stream >> upload.partSize >> upload.partsCount >> upload.sentParts;
+					if (!_checkStreamStatus(locations.stream)) {
+						_uploads.clear();
+						break;
+					}
+					_uploads.insert(fname, upload);
+				}
+			}
 		}
 	}
 
@@ -1342,6 +2279,17 @@ namespace {
 			Global::SetHiddenPinnedMessages(v);
 		} break;
 
+		case dbiCacheSizeLimits: {
+			qint32 images, stickers, audios, webFiles;
+			stream >> images >> stickers >> audios >> webFiles;
+			if (!_checkStreamStatus(stream)) return false;
+
+			cSetCacheImagesSizeLimit(images);
+			cSetCacheStickersSizeLimit(stickers);
+			cSetCacheAudiosSizeLimit(audios);
+			cSetCacheWebFilesSizeLimit(webFiles);
+		} break;
+
 		case dbiDialogLastPath: {
 			QString path;
 			stream >> path;
@@ -1586,6 +2534,7 @@ namespace {
 		size += sizeof(quint32) + sizeof(qint32) + (cRecentStickersPreload().isEmpty() ? cGetRecentStickers().size() : cRecentStickersPreload().size()) * (sizeof(uint64) + sizeof(ushort));
 		size += sizeof(quint32) + _stringSize(cDialogLastPath());
 		size += sizeof(quint32) + 3 * sizeof(qint32);
+		size += sizeof(quint32) + 4 * sizeof(qint32);
 		if (!Global::HiddenPinnedMessages().isEmpty()) {
 			size += sizeof(quint32) + sizeof(qint32) + Global::HiddenPinnedMessages().size() * (sizeof(PeerId) + sizeof(MsgId));
 		}
@@ -1610,6 +2559,7 @@ namespace {
 		data.stream << quint32(dbiSongVolume) << qint32(qRound(cSongVolume() * 1e6));
 		data.stream << quint32(dbiAutoDownload) << qint32(cAutoDownloadPhoto()) << qint32(cAutoDownloadAudio()) << qint32(cAutoDownloadGif());
 		data.stream << quint32(dbiAutoPlay) << qint32(cAutoPlayGif() ? 1 : 0);
+		data.stream << quint32(dbiCacheSizeLimits) << qint32(cCacheImagesSizeLimit()) << qint32(cCacheStickersSizeLimit()) << qint32(cCacheAudiosSizeLimit()) << qint32(cCacheWebFilesSizeLimit());
 
 		{
 			RecentEmojisPreload v(cRecentEmojisPreload());
@@ -1707,6 +2657,34 @@ namespace {
 		}
 	}
 
+	class PackedCacheCompactTask : public Task {
+	public:
+		PackedCacheCompactTask() : _compacted(false) {
+		}
+		void process() {
+			_compacted = _packedCache.compact();
+		}
+		void finish() {
+			_packedCacheCompacting = false;
+			if (_compacted) {
+				_mapChanged = true;
+				_writeMap();
+			}
+		}
+
+	private:
+		bool _compacted;
+
+	};
+
+	void _checkPackedCache() {
+		if (_packedCacheCompacting || !_localLoader) return;
+		if (_packedCache.needsCompaction()) {
+			_packedCacheCompacting = true;
+			_localLoader->addTask(new PackedCacheCompactTask());
+		}
+	}
+
 	Local::ReadMapState _readMap(const QByteArray &pass) {
 		uint64 ms = getms();
 		QByteArray dataNameUtf8 = (cDataFile() + (cTestMode() ? qsl(":/test/") : QString())).toUtf8();
@@ -1756,6 +2734,8 @@ namespace {
 
 		DraftsMap draftsMap, draftCursorsMap;
 		DraftsNotReadMap draftsNotReadMap;
+		HistoryCacheMap historyCacheMap;
+		CacheAccessMap cacheAccess;
 		StorageMap imagesMap, stickerImagesMap, audiosMap;
 		qint64 storageImagesSize = 0, storageStickersSize = 0, storageAudiosSize = 0;
 		quint64 locationsKey = 0, reportSpamStatusesKey = 0;
@@ -1786,6 +2766,17 @@ namespace {
 					draftCursorsMap.insert(p, key);
 				}
 			} break;
+			case lskHistoryCache: {
+				quint32 count = 0;
+				map.stream >> count;
+				for (quint32 i = 0; i < count; ++i) {
+					FileKey key;
+					quint64 p;
+					qint32 minId, maxId;
+					map.stream >> key >> p >> minId >> maxId;
+					historyCacheMap.insert(p, HistoryCacheDesc(key, minId, maxId));
+				}
+			} break;
 			case lskImages: {
 				quint32 count = 0;
 				map.stream >> count;
@@ -1822,6 +2813,18 @@ namespace {
 					storageAudiosSize += size;
 				}
 			} break;
+			case lskPackedCache: {
+				_packedCache.readIndex(map.stream);
+			} break;
+			case lskCacheAccess: {
+				quint32 count = 0;
+				map.stream >> count;
+				for (quint32 i = 0; i < count; ++i) {
+					quint64 key, access;
+					map.stream >> key >> access;
+					cacheAccess.insert(key, access);
+				}
+			} break;
 			case lskLocations: {
 				map.stream >> locationsKey;
 			} break;
@@ -1865,6 +2868,7 @@ namespace {
 		_draftsMap = draftsMap;
 		_draftCursorsMap = draftCursorsMap;
 		_draftsNotReadMap = draftsNotReadMap;
+		_historyCacheMap = historyCacheMap;
 
 		_imagesMap = imagesMap;
 		_storageImagesSize = storageImagesSize;
@@ -1872,6 +2876,12 @@ namespace {
 		_storageStickersSize = storageStickersSize;
 		_audiosMap = audiosMap;
 		_storageAudiosSize = storageAudiosSize;
+		_cacheAccess = cacheAccess;
+		_cacheAccessCounter = 0;
+		for (CacheAccessMap::const_iterator i = _cacheAccess.cbegin(), e = _cacheAccess.cend(); i != e; ++i) {
+			_cacheAccessCounter = qMax(_cacheAccessCounter, i.value());
+		}
+		_cacheAccessChanged = false;
 
 		_locationsKey = locationsKey;
 		_reportSpamStatusesKey = reportSpamStatusesKey;
@@ -1897,6 +2907,20 @@ namespace {
 			_readReportSpamStatuses();
 		}
 
+		// forget access times of the entries that were removed without updating them
+		QSet<FileKey> cacheKeys;
+		for (StorageMap::const_iterator i = _imagesMap.cbegin(), e = _imagesMap.cend(); i != e; ++i) cacheKeys.insert(i.value().first);
+		for (StorageMap::const_iterator i = _stickerImagesMap.cbegin(), e = _stickerImagesMap.cend(); i != e; ++i) cacheKeys.insert(i.value().first);
+		for (StorageMap::const_iterator i = _audiosMap.cbegin(), e = _audiosMap.cend(); i != e; ++i) cacheKeys.insert(i.value().first);
+		for (WebFilesMap::const_iterator i = _webFilesMap.cbegin(), e = _webFilesMap.cend(); i != e; ++i) cacheKeys.insert(i.value().first);
+		for (CacheAccessMap::iterator i = _cacheAccess.begin(); i != _cacheAccess.end();) {
+			if (cacheKeys.contains(i.key())) {
+				++i;
+			} else {
+				i = _cacheAccess.erase(i);
+			}
+		}
+
 		_readUserSettings();
 		_readMtpData();
 
@@ -1943,9 +2967,12 @@ namespace {
 		uint32 mapSize = 0;
 		if (!_draftsMap.isEmpty()) mapSize += sizeof(quint32) * 2 + _draftsMap.size() * sizeof(quint64) * 2;
 		if (!_draftCursorsMap.isEmpty()) mapSize += sizeof(quint32) * 2 + _draftCursorsMap.size() * sizeof(quint64) * 2;
+		if (!_historyCacheMap.isEmpty()) mapSize += sizeof(quint32) * 2 + _historyCacheMap.size() * (sizeof(quint64) * 2 + sizeof(qint32) * 2);
 		if (!_imagesMap.isEmpty()) mapSize += sizeof(quint32) * 2 + _imagesMap.size() * (sizeof(quint64) * 3 + sizeof(qint32));
 		if (!_stickerImagesMap.isEmpty()) mapSize += sizeof(quint32) * 2 + _stickerImagesMap.size() * (sizeof(quint64) * 3 + sizeof(qint32));
 		if (!_audiosMap.isEmpty()) mapSize += sizeof(quint32) * 2 + _audiosMap.size() * (sizeof(quint64) * 3 + sizeof(qint32));
+		if (!_packedCache.isEmpty()) mapSize += sizeof(quint32) + _packedCache.indexSize();
+		if (!_cacheAccess.isEmpty()) mapSize += sizeof(quint32) * 2 + _cacheAccess.size() * sizeof(quint64) * 2;
 		if (_locationsKey) mapSize += sizeof(quint32) + sizeof(quint64);
 		if (_reportSpamStatusesKey) mapSize += sizeof(quint32) + sizeof(quint64);
 		if (_recentStickersKeyOld) mapSize += sizeof(quint32) + sizeof(quint64);
@@ -1968,6 +2995,12 @@ namespace {
 				mapData.stream << quint64(i.value()) << quint64(i.key());
 			}
 		}
+		if (!_historyCacheMap.isEmpty()) {
+			mapData.stream << quint32(lskHistoryCache) << quint32(_historyCacheMap.size());
+			for (HistoryCacheMap::const_iterator i = _historyCacheMap.cbegin(), e = _historyCacheMap.cend(); i != e; ++i) {
+				mapData.stream << quint64(i.value().key) << quint64(i.key()) << qint32(i.value().minId) << qint32(i.value().maxId);
+			}
+		}
 		if (!_imagesMap.isEmpty()) {
 			mapData.stream << quint32(lskImages) << quint32(_imagesMap.size());
 			for (StorageMap::const_iterator i = _imagesMap.cbegin(), e = _imagesMap.cend(); i != e; ++i) {
@@ -1986,6 +3019,16 @@ namespace {
 				mapData.stream << quint64(i.value().first) << quint64(i.key().first) << quint64(i.key().second) << qint32(i.value().second);
 			}
 		}
+		if (!_packedCache.isEmpty()) {
+			mapData.stream << quint32(lskPackedCache);
+			_packedCache.writeIndex(mapData.stream);
+		}
+		if (!_cacheAccess.isEmpty()) {
+			mapData.stream << quint32(lskCacheAccess) << quint32(_cacheAccess.size());
+			for (CacheAccessMap::const_iterator i = _cacheAccess.cbegin(), e = _cacheAccess.cend(); i != e; ++i) {
+				mapData.stream << quint64(i.key()) << quint64(i.value());
+			}
+		}
 		if (_locationsKey) {
 			mapData.stream << quint32(lskLocations) << quint64(_locationsKey);
 		}
@@ -2015,7 +3058,9 @@ namespace {
 		}
 		map.writeEncrypted(mapData);
 
-		_mapChanged = false;
+		_mapChanged = _cacheAccessChanged = false;
+
+		_checkPackedCache();
 	}
 
 }
@@ -2076,8 +3121,17 @@ namespace Local {
 
 	void finish() {
 		if (_manager) {
+			if (_localWriter) {
+				_localWriter->stop();
+			}
+			_cacheWriter.flush(); // before the packed cache index is written with the map
+			delete _localWriter;
+			_localWriter = 0;
+
+			if (_cacheAccessChanged) _mapChanged = true;
 			_writeMap(WriteMapNow);
 			_manager->finish();
+			_packedCache.finish();
 			_manager->deleteLater();
 			_manager = 0;
 			delete _localLoader;
@@ -2090,6 +3144,7 @@ namespace Local {
 
 		_manager = new _local_inner::Manager();
 		_localLoader = new TaskQueue(0, FileLoaderQueueStopTimeout);
+		_localWriter = new TaskQueue(0, FileLoaderQueueStopTimeout);
 
 		_basePath = cWorkingDir() + qsl("tdata/");
 		if (!QDir().exists(_basePath)) QDir().mkpath(_basePath);
@@ -2266,13 +3321,23 @@ namespace Local {
 		if (_localLoader) {
 			_localLoader->stop();
 		}
+		if (_localWriter) {
+			_localWriter->stop();
+		}
+		_cacheWriter.clear();
+		_cacheWriter.flush();
 
 		_passKeySalt.clear(); // reset passcode, local key
 		_draftsMap.clear();
 		_draftCursorsMap.clear();
+		_historyCacheMap.clear();
+		_packedCache.clear();
+		_cacheAccess.clear();
 		_fileLocations.clear();
 		_fileLocationPairs.clear();
 		_fileLocationAliases.clear();
+		_downloads.clear();
+		_uploads.clear();
 		_imagesMap.clear();
 		_draftsNotReadMap.clear();
 		_stickerImagesMap.clear();
@@ -2311,6 +3376,12 @@ namespace Local {
 
 	ReadMapState readMap(const QByteArray &pass) {
 		ReadMapState result = _readMap(pass);
+		if (result != ReadMapPassNeeded) {
+			if (result == ReadMapFailed) {
+				_packedCache.clear(); // segments left without index are removed in start()
+			}
+			_packedCache.start(_userBasePath);
+		}
 		if (result == ReadMapFailed) {
 			_mapChanged = true;
 			_writeMap(WriteMapNow);
@@ -2478,6 +3549,279 @@ namespace Local {
 		return (_draftCursorsMap.constFind(peer) != _draftCursorsMap.cend());
 	}
 
+	void clearHistoryCache(const PeerId &peer) {
+		HistoryCacheMap::iterator i = _historyCacheMap.find(peer);
+		if (i != _historyCacheMap.cend()) {
+			clearKey(i.value().key);
+			_historyCacheMap.erase(i);
+			_mapChanged = true;
+			_writeMap(WriteMapSoon);
+		}
+	}
+
+	PeerId _historyCacheChatPeer(const MTPChat &chat) {
+		switch (chat.type()) {
+		case mtpc_chat: return peerFromChat(chat.c_chat().vid);
+		case mtpc_chatForbidden: return peerFromChat(chat.c_chatForbidden().vid);
+		case mtpc_channel: return peerFromChannel(chat.c_channel().vid);
+		case mtpc_channelForbidden: return peerFromChannel(chat.c_channelForbidden().vid);
+		}
+		return 0;
+	}
+
+	UserId _historyCacheUserId(const MTPUser &user) {
+		return (user.type() == mtpc_user) ? user.c_user().vid.v : 0;
+	}
+
+	void _writeHistoryCache(const PeerId &peer, const QVector<MTPMessage> &messages, const QVector<MTPChat> &chats, const QVector<MTPUser> &users) {
+		if (!_working()) return;
+
+		QVector<MTPMessage> cached;
+		cached.reserve(qMin(messages.size(), int(HistoryCacheMessagesCount)));
+		MsgId minId = 0, maxId = 0;
+		for (QVector<MTPMessage>::const_iterator i = messages.cbegin(), e = messages.cend(); i != e; ++i) {
+			if (i->type() == mtpc_messageEmpty) continue;
+
+			MsgId msgId = idFromMessage(*i);
+			if (!maxId || msgId > maxId) maxId = msgId;
+			if (!minId || msgId < minId) minId = msgId;
+			cached.push_back(*i);
+			if (cached.size() >= HistoryCacheMessagesCount) break;
+		}
+		if (cached.isEmpty()) {
+			return clearHistoryCache(peer);
+		}
+
+		mtpBuffer buffer;
+		MTPmessages_Messages(MTP_messages_messages(MTP_vector<MTPMessage>(cached), MTP_vector<MTPChat>(chats), MTP_vector<MTPUser>(users))).write(buffer);
+		QByteArray serialized(reinterpret_cast<const char*>(buffer.constData()), buffer.size() * sizeof(mtpPrime));
+
+		HistoryCacheMap::iterator i = _historyCacheMap.find(peer);
+		if (i == _historyCacheMap.cend()) {
+			i = _historyCacheMap.insert(peer, HistoryCacheDesc(genKey(), minId, maxId));
+			_mapChanged = true;
+			_writeMap(WriteMapFast);
+		} else if (i.value().minId != minId || i.value().maxId != maxId) {
+			i.value().minId = minId;
+			i.value().maxId = maxId;
+			_mapChanged = true;
+			_writeMap();
+		}
+
+		EncryptedDescriptor data(sizeof(quint64) + _bytearraySize(serialized));
+		data.stream << quint64(peer) << serialized;
+
+		FileWriteDescriptor file(i.value().key);
+		file.writeEncrypted(data);
+	}
+
+	void writeHistoryCache(const PeerId &peer, const MTPmessages_Messages &messages) {
+		switch (messages.type()) {
+		case mtpc_messages_messages: {
+			const MTPDmessages_messages &d(messages.c_messages_messages());
+			_writeHistoryCache(peer, d.vmessages.c_vector().v, d.vchats.c_vector().v, d.vusers.c_vector().v);
+		} break;
+		case mtpc_messages_messagesSlice: {
+			const MTPDmessages_messagesSlice &d(messages.c_messages_messagesSlice());
+			_writeHistoryCache(peer, d.vmessages.c_vector().v, d.vchats.c_vector().v, d.vusers.c_vector().v);
+		} break;
+		case mtpc_messages_channelMessages: {
+			const MTPDmessages_channelMessages &d(messages.c_messages_channelMessages());
+			if (d.has_collapsed() && !d.vcollapsed.c_vector().v.isEmpty()) {
+				// we don't cache collapsed channel groups, they depend on important / all mode
+				return clearHistoryCache(peer);
+			}
+			_writeHistoryCache(peer, d.vmessages.c_vector().v, d.vchats.c_vector().v, d.vusers.c_vector().v);
+		} break;
+		}
+	}
+
+	bool _readHistoryCache(const PeerId &peer, QVector<MTPMessage> &messages, QVector<MTPChat> &chats, QVector<MTPUser> &users) {
+		HistoryCacheMap::const_iterator j = _historyCacheMap.constFind(peer);
+		if (j == _historyCacheMap.cend()) {
+			return false;
+		}
+
+		FileReadDescriptor cache;
+		if (!readEncryptedFile(cache, j.value().key)) {
+			clearHistoryCache(peer);
+			return false;
+		}
+
+		quint64 cachePeer = 0;
+		QByteArray serialized;
+		cache.stream >> cachePeer >> serialized;
+		if (!_checkStreamStatus(cache.stream) || cachePeer != peer || serialized.isEmpty() || (serialized.size() % sizeof(mtpPrime))) {
+			clearHistoryCache(peer);
+			return false;
+		}
+
+		MTPmessages_Messages result;
+		const mtpPrime *from = reinterpret_cast<const mtpPrime*>(serialized.constData()), *end = from + (serialized.size() / sizeof(mtpPrime));
+		try {
+			result.read(from, end);
+		} catch (Exception &) {
+			LOG(("App Error: could not parse cached history for peer %1").arg(peer));
+			clearHistoryCache(peer);
+			return false;
+		}
+		if (result.type() != mtpc_messages_messages) {
+			clearHistoryCache(peer);
+			return false;
+		}
+
+		const MTPDmessages_messages &d(result.c_messages_messages());
+		messages = d.vmessages.c_vector().v;
+		chats = d.vchats.c_vector().v;
+		users = d.vusers.c_vector().v;
+		return true;
+	}
+
+	void appendHistoryCache(const PeerId &peer, const MTPmessages_Messages &messages, MsgId afterId) {
+		HistoryCacheMap::const_iterator j = _historyCacheMap.constFind(peer);
+		if (j == _historyCacheMap.cend() || j.value().maxId != afterId) {
+			return;
+		}
+
+		const QVector<MTPMessage> *newerMessages = 0;
+		const QVector<MTPChat> *newerChats = 0;
+		const QVector<MTPUser> *newerUsers = 0;
+		switch (messages.type()) {
+		case mtpc_messages_messages: {
+			const MTPDmessages_messages &d(messages.c_messages_messages());
+			newerMessages = &d.vmessages.c_vector().v;
+			newerChats = &d.vchats.c_vector().v;
+			newerUsers = &d.vusers.c_vector().v;
+		} break;
+		case mtpc_messages_messagesSlice: {
+			const MTPDmessages_messagesSlice &d(messages.c_messages_messagesSlice());
+			newerMessages = &d.vmessages.c_vector().v;
+			newerChats = &d.vchats.c_vector().v;
+			newerUsers = &d.vusers.c_vector().v;
+		} break;
+		case mtpc_messages_channelMessages: {
+			const MTPDmessages_channelMessages &d(messages.c_messages_channelMessages());
+			if (d.has_collapsed() && !d.vcollapsed.c_vector().v.isEmpty()) {
+				return clearHistoryCache(peer);
+			}
+			newerMessages = &d.vmessages.c_vector().v;
+			newerChats = &d.vchats.c_vector().v;
+			newerUsers = &d.vusers.c_vector().v;
+		} break;
+		}
+		if (!newerMessages || newerMessages->isEmpty()) return;
+
+		QVector<MTPMessage> cachedMessages;
+		QVector<MTPChat> cachedChats;
+		QVector<MTPUser> cachedUsers;
+		if (!_readHistoryCache(peer, cachedMessages, cachedChats, cachedUsers)) {
+			return;
+		}
+
+		// both slices are ordered from the newest message to the oldest one
+		QVector<MTPMessage> resultMessages(*newerMessages);
+		resultMessages.reserve(resultMessages.size() + cachedMessages.size());
+		for (QVector<MTPMessage>::const_iterator i = cachedMessages.cbegin(), e = cachedMessages.cend(); i != e; ++i) {
+			if (idFromMessage(*i) <= afterId) {
+				resultMessages.push_back(*i);
+			}
+		}
+		QVector<MTPChat> resultChats(*newerChats);
+		for (QVector<MTPChat>::const_iterator i = cachedChats.cbegin(), e = cachedChats.cend(); i != e; ++i) {
+			PeerId chatPeer = _historyCacheChatPeer(*i);
+			bool found = false;
+			for (QVector<MTPChat>::const_iterator j = newerChats->cbegin(), en = newerChats->cend(); j != en; ++j) {
+				if (_historyCacheChatPeer(*j) == chatPeer) {
+					found = true;
+					break;
+				}
+			}
+			if (!found) resultChats.push_back(*i);
+		}
+		QVector<MTPUser> resultUsers(*newerUsers);
+		for (QVector<MTPUser>::const_iterator i = cachedUsers.cbegin(), e = cachedUsers.cend(); i != e; ++i) {
+			UserId userId = _historyCacheUserId(*i);
+			bool found = false;
+			for (QVector<MTPUser>::const_iterator j = newerUsers->cbegin(), en = newerUsers->cend(); j != en; ++j) {
+				if (_historyCacheUserId(*j) == userId) {
+					found = true;
+					break;
+				}
+			}
+			if (!found) resultUsers.push_back(*i);
+		}
+		_writeHistoryCache(peer, resultMessages, resultChats, resultUsers);
+	}
+
+	bool readHistoryCache(const PeerId &peer, MTPmessages_Messages &result) {
+		uint64 ms = getms();
+
+		QVector<MTPMessage> messages;
+		QVector<MTPChat> chats;
+		QVector<MTPUser> users;
+		if (!_readHistoryCache(peer, messages, chats, users)) {
+			return false;
+		}
+
+		// don't override already received peers with the cached ones
+		QVector<MTPChat> unknownChats;
+		for (QVector<MTPChat>::const_iterator i = chats.cbegin(), e = chats.cend(); i != e; ++i) {
+			PeerId chatPeer = _historyCacheChatPeer(*i);
+			if (chatPeer && !App::peerLoaded(chatPeer)) {
+				unknownChats.push_back(*i);
+			}
+		}
+		QVector<MTPUser> unknownUsers;
+		for (QVector<MTPUser>::const_iterator i = users.cbegin(), e = users.cend(); i != e; ++i) {
+			UserId userId = _historyCacheUserId(*i);
+			if (userId && !App::userLoaded(userId)) {
+				unknownUsers.push_back(*i);
+			}
+		}
+
+		result = MTP_messages_messages(MTP_vector<MTPMessage>(messages), MTP_vector<MTPChat>(unknownChats), MTP_vector<MTPUser>(unknownUsers));
+
+		DEBUG_LOG(("History cache read time: %1 for %2 messages").arg(getms() - ms).arg(messages.size()));
+		return true;
+	}
+
+	void historyCacheMessageEdited(const PeerId &peer, MsgId msgId) {
+		HistoryCacheMap::const_iterator i = _historyCacheMap.constFind(peer);
+		if (i != _historyCacheMap.cend() && msgId >= i.value().minId && msgId <= i.value().maxId) {
+			clearHistoryCache(peer);
+		}
+	}
+
+	void historyCacheMessagesDeleted(ChannelId channelId, const QVector<MTPint> &msgsIds) {
+		if (channelId != NoChannel) {
+			PeerId peer = peerFromChannel(channelId);
+			HistoryCacheMap::const_iterator j = _historyCacheMap.constFind(peer);
+			if (j == _historyCacheMap.cend()) return;
+
+			for (QVector<MTPint>::const_iterator i = msgsIds.cbegin(), e = msgsIds.cend(); i != e; ++i) {
+				if (i->v >= j.value().minId && i->v <= j.value().maxId) {
+					return clearHistoryCache(peer);
+				}
+			}
+			return;
+		}
+
+		// message ids are common for all non-channel peers, so check each cached range
+		QList<PeerId> toClear;
+		for (HistoryCacheMap::const_iterator j = _historyCacheMap.cbegin(), e = _historyCacheMap.cend(); j != e; ++j) {
+			if (peerIsChannel(j.key())) continue;
+			for (QVector<MTPint>::const_iterator i = msgsIds.cbegin(), en = msgsIds.cend(); i != en; ++i) {
+				if (i->v >= j.value().minId && i->v <= j.value().maxId) {
+					toClear.push_back(j.key());
+					break;
+				}
+			}
+		}
+		for (QList<PeerId>::const_iterator i = toClear.cbegin(), e = toClear.cend(); i != e; ++i) {
+			clearHistoryCache(*i);
+		}
+	}
+
 	void writeFileLocation(MediaKey location, const FileLocation &local) {
 		if (local.fname.isEmpty()) return;
 
@@ -2531,6 +3875,100 @@ namespace Local {
 		return FileLocation();
 	}
 
+	void writeDownloadedParts(const MediaKey &location, const QString &fname, int32 size, const DownloadedParts &parts) {
+		if (fname.isEmpty() || !size) return;
+
+		DownloadDesc &download(_downloads[location]);
+		download.fname = fname;
+		download.size = size;
+		download.parts = parts;
+		_writeLocations();
+	}
+
+	bool readDownloadedParts(const MediaKey &location, const QString &fname, int32 size, DownloadedParts &parts) {
+		DownloadsMap::const_iterator i = _downloads.constFind(location);
+		if (i == _downloads.cend()) return false;
+
+		// parts are saved after they were written and flushed, so the file should contain all of them
+		QFileInfo info(fname);
+		bool valid = (i.value().fname == fname) && (i.value().size == size) && info.exists() && !i.value().parts.isEmpty();
+		for (DownloadedParts::const_iterator j = i.value().parts.cbegin(), e = i.value().parts.cend(); valid && j != e; ++j) {
+			if (j.key() < 0 || j.value() <= 0 || j.key() + j.value() > size || j.key() + j.value() > info.size()) {
+				valid = false;
+			}
+		}
+		if (!valid) {
+			clearDownloadedParts(location);
+			return false;
+		}
+		parts = i.value().parts;
+		return true;
+	}
+
+	void clearDownloadedParts(const MediaKey &location) {
+		if (_downloads.remove(location)) {
+			_writeLocations();
+		}
+	}
+
+	QString downloadedPartsFileName(const MediaKey &location) {
+		DownloadsMap::const_iterator i = _downloads.constFind(location);
+		if (i == _downloads.cend() || !QFileInfo(i.value().fname).exists()) {
+			return QString();
+		}
+		return i.value().fname;
+	}
+
+	void writeUploadedParts(const QString &fname, uint64 fileId, int32 size, int32 partSize, int32 partsCount, int32 sentParts) {
+		if (fname.isEmpty() || !size || sentParts <= 0) return;
+
+		UploadDesc &upload(_uploads[fname]);
+		if (upload.fileId != fileId) { // new upload of this file, remember the file state it started from
+			upload.modified = QFileInfo(fname).lastModified();
+			upload.fileId = fileId;
+		}
+		upload.saved = QDateTime::currentDateTime();
+		upload.size = size;
+		upload.partSize = partSize;
+		upload.partsCount = partsCount;
+		upload.sentParts = sentParts;
+		_writeLocations();
+	}
+
+	bool readUploadedParts(const QString &fname, int32 size, uint64 &fileId, int32 &partSize, int32 &partsCount, int32 &sentParts) {
+		UploadsMap::const_iterator i = _uploads.constFind(fname);
+		if (i == _uploads.cend()) return false;
+
+		// the file must be the same and the server must still have the parts
+		const UploadDesc &upload(i.value());
+		QFileInfo info(fname);
+		bool valid = info.exists() && (info.size() == size) && (upload.size == size) && (info.lastModified() == upload.modified);
+		if (valid) {
+			valid = (upload.saved.secsTo(QDateTime::currentDateTime()) < UploadedPartsKeepTime);
+		}
+		if (valid) {
+			valid = (upload.partSize > 0) && (upload.partsCount == (size / upload.partSize) + ((size % upload.partSize) ? 1 : 0));
+		}
+		if (valid) {
+			valid = (upload.sentParts > 0) && (upload.sentParts < upload.partsCount);
+		}
+		if (!valid) {
+			clearUploadedParts(fname);
+			return false;
+		}
+		fileId = upload.fileId;
+		partSize = upload.partSize;
+		partsCount = upload.partsCount;
+		sentParts = upload.sentParts;
+		return true;
+	}
+
+	void clearUploadedParts(const QString &fname) {
+		if (_uploads.remove(fname)) {
+			_writeLocations();
+		}
+	}
+
 	qint32 _storageImageSize(qint32 rawlen) {
 		// fulllen + storagekey + type + len + data
 		qint32 result = sizeof(uint32) + sizeof(quint64) * 2 + sizeof(quint32) + sizeof(quint32) + rawlen;
@@ -2547,7 +3985,15 @@ namespace Local {
 		return result;
 	}
 
+	bool _audioStreamed(qint32 rawlen) {
+		return rawlen > PackedCacheEntryMaxSize;
+	}
+
 	qint32 _storageAudioSize(qint32 rawlen) {
+		if (_audioStreamed(rawlen)) {
+			return qint32(_cacheStreamFileSize(rawlen, CacheStreamChunkSize));
+		}
+
 		// fulllen + storagekey + len + data
 		qint32 result = sizeof(uint32) + sizeof(quint64) * 2 + sizeof(quint32) + rawlen;
 		if (result & 0x0F) result += 0x10 - (result & 0x0F);
@@ -2555,6 +4001,127 @@ namespace Local {
 		return result;
 	}
 
+	enum CacheClass {
+		CacheImages,
+		CacheStickers,
+		CacheAudios,
+		CacheWebFiles,
+	};
+
+	// victims are chosen in the local loader thread, but they are removed in the main thread
+	// and only if they were not accessed since the snapshot, so a new write is never lost
+	class CacheEvictTask : public Task {
+	public:
+		struct Entry {
+			FileKey key;
+			qint32 size;
+			quint64 access;
+		};
+		typedef QVector<Entry> Entries;
+
+		CacheEvictTask(CacheClass cacheClass, const Entries &entries, qint64 toFree)
+			: _cacheClass(cacheClass)
+			, _entries(entries)
+			, _toFree(toFree) {
+		}
+		void process() {
+			std::sort(_entries.begin(), _entries.end(), [](const Entry &a, const Entry &b) -> bool {
+				return a.access < b.access;
+			});
+			qint64 freed = 0;
+			for (Entries::const_iterator i = _entries.cbegin(), e = _entries.cend(); i != e && freed < _toFree; ++i) {
+				_victims.insert(i->key, i->access);
+				freed += i->size;
+			}
+		}
+		void finish() {
+			_cacheEvicting = false;
+			for (QMap<FileKey, quint64>::const_iterator i = _victims.cbegin(), e = _victims.cend(); i != e; ++i) {
+				CacheAccessMap::iterator j = _cacheAccess.find(i.key());
+				quint64 access = (j == _cacheAccess.cend()) ? 0 : j.value();
+				if (access != i.value()) continue; // accessed or written again after the snapshot
+
+				if (j != _cacheAccess.cend()) {
+					_cacheAccess.erase(j);
+					_cacheAccessChanged = true;
+				}
+				clearKey(i.key(), UserPath);
+				_evicted.insert(i.key());
+			}
+			switch (_cacheClass) {
+			case CacheImages: evictFrom(_imagesMap, _storageImagesSize); break;
+			case CacheStickers: evictFrom(_stickerImagesMap, _storageStickersSize); break;
+			case CacheAudios: evictFrom(_audiosMap, _storageAudiosSize); break;
+			case CacheWebFiles: {
+				bool changed = false;
+				for (WebFilesMap::iterator i = _webFilesMap.begin(); i != _webFilesMap.end();) {
+					if (_evicted.contains(i.value().first)) {
+						_storageWebFilesSize -= i.value().second;
+						i = _webFilesMap.erase(i);
+						changed = true;
+					} else {
+						++i;
+					}
+				}
+				if (changed) _writeLocations();
+			} break;
+			}
+			DEBUG_LOG(("App Info: evicted %1 of %2 chosen entries from local cache %3").arg(_evicted.size()).arg(_victims.size()).arg(_cacheClass));
+		}
+
+	private:
+		void evictFrom(StorageMap &map, int32 &storageSize) {
+			for (StorageMap::iterator i = map.begin(); i != map.end();) {
+				if (_evicted.contains(i.value().first)) {
+					storageSize -= i.value().second;
+					i = map.erase(i);
+					_mapChanged = true;
+				} else {
+					++i;
+				}
+			}
+			if (_mapChanged) _writeMap();
+		}
+
+		CacheClass _cacheClass;
+		Entries _entries;
+		qint64 _toFree;
+		QMap<FileKey, quint64> _victims; // key -> access stamp in the snapshot
+		QSet<FileKey> _evicted;
+
+	};
+
+	template <typename Map>
+	bool _checkCacheLimit(CacheClass cacheClass, const Map &map, qint64 storageSize, int32 limitMb) {
+		qint64 limit = qint64(limitMb) * 1024 * 1024;
+		if (!limit || storageSize <= limit) return false;
+
+		CacheEvictTask::Entries entries;
+		entries.reserve(map.size());
+		for (typename Map::const_iterator i = map.cbegin(), e = map.cend(); i != e; ++i) {
+			CacheEvictTask::Entry entry;
+			entry.key = i.value().first;
+			entry.size = i.value().second;
+			entry.access = _cacheAccess.value(entry.key, 0);
+			entries.push_back(entry);
+		}
+
+		// free a bit more than needed so that we don't evict after each write
+		qint64 toFree = storageSize - (limit - limit / 5);
+		_cacheEvicting = true;
+		_localLoader->addTask(new CacheEvictTask(cacheClass, entries, toFree));
+		return true;
+	}
+
+	void _checkCacheLimits() {
+		if (_cacheEvicting || !_localLoader) return;
+
+		if (_checkCacheLimit(CacheImages, _imagesMap, _storageImagesSize, cCacheImagesSizeLimit())) return;
+		if (_checkCacheLimit(CacheStickers, _stickerImagesMap, _storageStickersSize, cCacheStickersSizeLimit())) return;
+		if (_checkCacheLimit(CacheAudios, _audiosMap, _storageAudiosSize, cCacheAudiosSizeLimit())) return;
+		_checkCacheLimit(CacheWebFiles, _webFilesMap, _storageWebFilesSize, cCacheWebFilesSizeLimit());
+	}
+
 	void writeImage(const StorageKey &location, const ImagePtr &image) {
 		if (image->isNull() || !image->loaded()) return;
 		if (_imagesMap.constFind(location) != _imagesMap.cend()) return;
@@ -2589,13 +4156,14 @@ namespace Local {
 		}
 		EncryptedDescriptor data(sizeof(quint64) * 2 + sizeof(quint32) + sizeof(quint32) + image.data.size());
 		data.stream << quint64(location.first) << quint64(location.second) << quint32(image.type) << image.data;
-		FileWriteDescriptor file(i.value().first, UserPath);
-		file.writeEncrypted(data);
+		writeCacheEntry(i.value().first, data);
+		_cacheAccessed(i.value().first);
 		if (i.value().second != size) {
 			_storageImagesSize += size;
 			_storageImagesSize -= i.value().second;
 			_imagesMap[location].second = size;
 		}
+		_checkCacheLimits();
 	}
 
 	class AbstractCachedLoadTask : public Task {
@@ -2689,6 +4257,7 @@ namespace Local {
 		if (j == _imagesMap.cend() || !_localLoader) {
 			return 0;
 		}
+		_cacheAccessed(j->first);
 		return _localLoader->addTask(new ImageLoadTask(j->first, location, loader));
 	}
 
@@ -2715,13 +4284,14 @@ namespace Local {
 		}
 		EncryptedDescriptor data(sizeof(quint64) * 2 + sizeof(quint32) + sizeof(quint32) + sticker.size());
 		data.stream << quint64(location.first) << quint64(location.second) << sticker;
-		FileWriteDescriptor file(i.value().first, UserPath);
-		file.writeEncrypted(data);
+		writeCacheEntry(i.value().first, data);
+		_cacheAccessed(i.value().first);
 		if (i.value().second != size) {
 			_storageStickersSize += size;
 			_storageStickersSize -= i.value().second;
 			_stickerImagesMap[location].second = size;
 		}
+		_checkCacheLimits();
 	}
 
 	class StickerImageLoadTask : public AbstractCachedLoadTask {
@@ -2748,6 +4318,7 @@ namespace Local {
 		if (j == _stickerImagesMap.cend() || !_localLoader) {
 			return 0;
 		}
+		_cacheAccessed(j->first);
 		return _localLoader->addTask(new StickerImageLoadTask(j->first, location, loader));
 	}
 
@@ -2785,15 +4356,20 @@ namespace Local {
 		} else if (!overwrite) {
 			return;
 		}
-		EncryptedDescriptor data(sizeof(quint64) * 2 + sizeof(quint32) + sizeof(quint32) + audio.size());
-		data.stream << quint64(location.first) << quint64(location.second) << audio;
-		FileWriteDescriptor file(i.value().first, UserPath);
-		file.writeEncrypted(data);
+		if (_audioStreamed(audio.size())) {
+			writeCacheStream(i.value().first, audio);
+		} else {
+			EncryptedDescriptor data(sizeof(quint64) * 2 + sizeof(quint32) + sizeof(quint32) + audio.size());
+			data.stream << quint64(location.first) << quint64(location.second) << audio;
+			writeCacheEntry(i.value().first, data);
+		}
+		_cacheAccessed(i.value().first);
 		if (i.value().second != size) {
 			_storageAudiosSize += size;
 			_storageAudiosSize -= i.value().second;
 			_audiosMap[location].second = size;
 		}
+		_checkCacheLimits();
 	}
 
 	class AudioLoadTask : public AbstractCachedLoadTask {
@@ -2801,6 +4377,25 @@ namespace Local {
 		AudioLoadTask(const FileKey &key, const StorageKey &location, mtpFileLoader *loader) :
 		AbstractCachedLoadTask(key, location, false, loader) {
 		}
+		void process() {
+			// large audios are read chunk by chunk right to the result without whole encrypted copies,
+			// the loader keeps the whole audio data for playing it, so only the result is allocated at once
+			CacheStreamReader stream(_key);
+			if (!stream.open(QIODevice::ReadOnly)) {
+				AbstractCachedLoadTask::process();
+				return;
+			}
+			QByteArray data(stream.size(), Qt::Uninitialized);
+			for (qint64 offset = 0, size = data.size(); offset < size;) {
+				qint64 part = qMin(qint64(CacheStreamChunkSize), size - offset);
+				if (stream.read(data.data() + offset, part) != part) {
+					LOG(("App Error: could not read cached audio %1 at offset %2 of %3, loading it again").arg(_key).arg(offset).arg(size));
+					return;
+				}
+				offset += part;
+			}
+			_result = new Result(StorageFilePartial, data, _readImageFlag);
+		}
 		void readFromStream(QDataStream &stream, quint64 &first, quint64 &second, quint32 &type, QByteArray &data) {
 			stream >> first >> second >> data;
 			type = StorageFilePartial;
@@ -2820,6 +4415,7 @@ namespace Local {
 		if (j == _audiosMap.cend() || !_localLoader) {
 			return 0;
 		}
+		_cacheAccessed(j->first);
 		return _localLoader->addTask(new AudioLoadTask(j->first, location, loader));
 	}
 
@@ -2831,6 +4427,14 @@ namespace Local {
 		return _storageAudiosSize;
 	}
 
+	qint64 cacheWriteQueuedBytes() {
+		return _cacheWriter.queuedBytes();
+	}
+
+	float64 cacheWriteAverageTime() {
+		return _cacheWriter.averageWriteTime();
+	}
+
 	qint32 _storageWebFileSize(const QString &url, qint32 rawlen) {
 		// fulllen + url + len + data
 		qint32 result = sizeof(uint32) + _stringSize(url) + sizeof(quint32) + rawlen;
@@ -2853,13 +4457,14 @@ namespace Local {
 		}
 		EncryptedDescriptor data(_stringSize(url) + sizeof(quint32) + sizeof(quint32) + content.size());
 		data.stream << url << content;
-		FileWriteDescriptor file(i.value().first, UserPath);
-		file.writeEncrypted(data);
+		writeCacheEntry(i.value().first, data);
+		_cacheAccessed(i.value().first);
 		if (i.value().second != size) {
 			_storageWebFilesSize += size;
 			_storageWebFilesSize -= i.value().second;
 			_webFilesMap[url].second = size;
 		}
+		_checkCacheLimits();
 	}
 
 	class WebFileLoadTask : public Task {
@@ -2924,6 +4529,7 @@ namespace Local {
 		if (j == _webFilesMap.cend() || !_localLoader) {
 			return 0;
 		}
+		_cacheAccessed(j->first);
 		return _localLoader->addTask(new WebFileLoadTask(j->first, url, loader));
 	}
 
@@ -3919,6 +5525,9 @@ namespace Local {
 		if (!data->tasks.isEmpty() && (data->tasks.at(0) == ClearManagerAll)) return true;
 		if (task == ClearManagerAll) {
 			data->tasks.clear();
+			_cacheWriter.clear();
+			_packedCache.clear();
+			_cacheAccess.clear();
 			if (!_imagesMap.isEmpty()) {
 				_imagesMap.clear();
 				_storageImagesSize = 0;
@@ -3942,6 +5551,8 @@ namespace Local {
 				_draftCursorsMap.clear();
 				_mapChanged = true;
 			}
+			_downloads.clear();
+			_uploads.clear();
 			if (_locationsKey) {
 				_locationsKey = 0;
 				_mapChanged = true;
@@ -3969,6 +5580,9 @@ namespace Local {
 			_writeMap();
 		} else {
 			if (task & ClearManagerStorage) {
+				_cacheWriter.clear();
+				_packedCache.clear(); // only cache entries are stored there
+				_cacheAccess.clear();
 				if (data->images.isEmpty()) {
 					data->images = _imagesMap;
 				} else {
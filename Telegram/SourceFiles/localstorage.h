@@ -117,9 +117,26 @@ namespace Local {
 	void writeDraftCursors(const PeerId &peer, const MessageCursor &msgCursor, const MessageCursor &editCursor);
 	bool hasDraftCursors(const PeerId &peer);
 
+	void writeHistoryCache(const PeerId &peer, const MTPmessages_Messages &messages);
+	void appendHistoryCache(const PeerId &peer, const MTPmessages_Messages &messages, MsgId afterId); // newer messages loaded after afterId
+	bool readHistoryCache(const PeerId &peer, MTPmessages_Messages &result);
+	void clearHistoryCache(const PeerId &peer);
+	void historyCacheMessagesDeleted(ChannelId channelId, const QVector<MTPint> &msgsIds);
+	void historyCacheMessageEdited(const PeerId &peer, MsgId msgId);
+
 	void writeFileLocation(MediaKey location, const FileLocation &local);
 	FileLocation readFileLocation(MediaKey location, bool check = true);
 
+	typedef QMap<int32, int32> DownloadedParts; // offset -> length of the parts already written to the file
+	void writeDownloadedParts(const MediaKey &location, const QString &fname, int32 size, const DownloadedParts &parts);
+	bool readDownloadedParts(const MediaKey &location, const QString &fname, int32 size, DownloadedParts &parts); // checks the partial file
+	void clearDownloadedParts(const MediaKey &location);
+	QString downloadedPartsFileName(const MediaKey &location); // partial file of a not finished download, if it exists
+
+	void writeUploadedParts(const QString &fname, uint64 fileId, int32 size, int32 partSize, int32 partsCount, int32 sentParts); // sentParts - confirmed by the server from the start
+	bool readUploadedParts(const QString &fname, int32 size, uint64 &fileId, int32 &partSize, int32 &partsCount, int32 &sentParts); // checks the source file size and modification time
+	void clearUploadedParts(const QString &fname);
+
 	void writeImage(const StorageKey &location, const ImagePtr &img);
 	void writeImage(const StorageKey &location, const StorageImageSaved &jpeg, bool overwrite = true);
 	TaskId startImageLoad(const StorageKey &location, mtpFileLoader *loader);
@@ -143,6 +160,9 @@ namespace Local {
 	int32 hasWebFiles();
 	qint64 storageWebFilesSize();
 
+	qint64 cacheWriteQueuedBytes(); // cache data waiting to be written in background
+	float64 cacheWriteAverageTime(); // average ms spent writing one cache entry
+
 	void countVoiceWaveform(DocumentData *document);
 
 	void cancelTask(TaskId id);
@@ -1044,6 +1044,7 @@ void MainWidget::removeDialog(History *history) {
 }
 
 void MainWidget::deleteConversation(PeerData *peer, bool deleteHistory) {
+	Local::clearHistoryCache(peer->id);
 	if (activePeer() == peer) {
 		Ui::showChatsList();
 	}
@@ -1113,6 +1114,7 @@ void MainWidget::deleteAllFromUserPart(DeleteAllFromUserParams params, const MTP
 }
 
 void MainWidget::clearHistory(PeerData *peer) {
+	Local::clearHistoryCache(peer->id);
 	if (History *h = App::historyLoaded(peer->id)) {
 		if (h->lastMsg) {
 			Local::addSavedPeer(h->peer, h->lastMsg->date);
@@ -4650,6 +4652,7 @@ void MainWidget::feedUpdate(const MTPUpdate &update) {
 		// update before applying skipped
 		if (d.vmessage.type() == mtpc_message) { // apply message edit
 			App::updateEditedMessage(d.vmessage.c_message());
+			Local::historyCacheMessageEdited(peerFromMessage(d.vmessage), d.vmessage.c_message().vid.v);
 		}
 		if (channel && !_handlingChannelDifference) {
 			channel->ptsApplySkippedUpdates();
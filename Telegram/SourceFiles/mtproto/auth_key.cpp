@@ -23,37 +23,66 @@ Copyright (c) 2014-2016 John Preston, https://desktop.telegram.org
 #include "mtproto/auth_key.h"
 
 #include <openssl/aes.h>
+#include <openssl/evp.h>
 
 namespace MTP {
 
-void aesIgeEncrypt(const void *src, void *dst, uint32 len, const void *key, const void *iv) {
-	uchar aes_key[32], aes_iv[32];
-	memcpy(aes_key, key, 32);
-	memcpy(aes_iv, iv, 32);
+namespace {
+
+// IGE is built on the EVP ecb cipher instead of AES_ige_encrypt(), so that AES-NI is used if the cpu has it
+// encrypt: out[i] = E(in[i] ^ out[i - 1]) ^ in[i - 1], decrypt: out[i] = D(in[i] ^ out[i - 1]) ^ in[i - 1]
+void aesIge(const void *src, void *dst, uint32 len, const void *key, const void *iv, bool encrypt) {
+	const uchar *from = static_cast<const uchar*>(src), *ivec = static_cast<const uchar*>(iv);
+	uchar *to = static_cast<uchar*>(dst);
+
+	uchar prevIn[AES_BLOCK_SIZE], prevOut[AES_BLOCK_SIZE], in[AES_BLOCK_SIZE], block[AES_BLOCK_SIZE];
+	memcpy(encrypt ? prevOut : prevIn, ivec, AES_BLOCK_SIZE);
+	memcpy(encrypt ? prevIn : prevOut, ivec + AES_BLOCK_SIZE, AES_BLOCK_SIZE);
 
-	AES_KEY aes;
-	AES_set_encrypt_key(aes_key, 256, &aes);
-	AES_ige_encrypt(static_cast<const uchar*>(src), static_cast<uchar*>(dst), len, &aes, aes_iv, AES_ENCRYPT);
+	EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new();
+	EVP_CipherInit_ex(context, EVP_aes_256_ecb(), 0, static_cast<const uchar*>(key), 0, encrypt ? 1 : 0);
+	EVP_CIPHER_CTX_set_padding(context, 0);
+	for (uint32 offset = 0; offset + AES_BLOCK_SIZE <= len; offset += AES_BLOCK_SIZE) {
+		memcpy(in, from + offset, AES_BLOCK_SIZE); // src and dst may be the same buffer
+		for (int i = 0; i < AES_BLOCK_SIZE; ++i) {
+			block[i] = in[i] ^ prevOut[i];
+		}
+		int written = 0;
+		EVP_CipherUpdate(context, block, &written, block, AES_BLOCK_SIZE);
+		for (int i = 0; i < AES_BLOCK_SIZE; ++i) {
+			prevOut[i] = to[offset + i] = block[i] ^ prevIn[i];
+		}
+		memcpy(prevIn, in, AES_BLOCK_SIZE);
+	}
+	EVP_CIPHER_CTX_free(context);
 }
 
-void aesIgeDecrypt(const void *src, void *dst, uint32 len, const void *key, const void *iv) {
-	uchar aes_key[32], aes_iv[32];
-	memcpy(aes_key, key, 32);
-	memcpy(aes_iv, iv, 32);
+} // namespace
+
+void aesIgeEncrypt(const void *src, void *dst, uint32 len, const void *key, const void *iv) {
+	aesIge(src, dst, len, key, iv, true);
+}
 
-	AES_KEY aes;
-	AES_set_decrypt_key(aes_key, 256, &aes);
-	AES_ige_encrypt(static_cast<const uchar*>(src), static_cast<uchar*>(dst), len, &aes, aes_iv, AES_DECRYPT);
+void aesIgeDecrypt(const void *src, void *dst, uint32 len, const void *key, const void *iv) {
+	aesIge(src, dst, len, key, iv, false);
 }
 
-void aesCtrEncrypt(void *data, uint32 len, const void *key, CTRState *state) {
-	AES_KEY aes;
-	AES_set_encrypt_key(static_cast<const uchar*>(key), 256, &aes);
+CTRState::~CTRState() {
+	if (context) EVP_CIPHER_CTX_free(context);
+}
 
+void aesCtrPrepare(const void *key, const void *ivec, CTRState *state) {
 	static_assert(CTRState::IvecSize == AES_BLOCK_SIZE, "Wrong size of ctr ivec!");
-	static_assert(CTRState::EcountSize == AES_BLOCK_SIZE, "Wrong size of ctr ecount!");
 
-	AES_ctr128_encrypt(static_cast<const uchar*>(data), static_cast<uchar*>(data), len, &aes, state->ivec, state->ecount, &state->num);
+	if (!state->context) state->context = EVP_CIPHER_CTX_new();
+	EVP_EncryptInit_ex(state->context, EVP_aes_256_ctr(), 0, static_cast<const uchar*>(key), static_cast<const uchar*>(ivec));
+}
+
+void aesCtrEncrypt(void *data, uint32 len, CTRState *state) {
+	if (!state->context) return; // not prepared, nothing was sent yet
+
+	int written = 0;
+	EVP_EncryptUpdate(state->context, static_cast<uchar*>(data), &written, static_cast<const uchar*>(data), len);
 }
 
 } // namespace MTP
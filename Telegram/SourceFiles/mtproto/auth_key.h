@@ -20,6 +20,8 @@ Copyright (c) 2014-2016 John Preston, https://desktop.telegram.org
 */
 #pragma once
 
+struct evp_cipher_ctx_st;
+
 namespace MTP {
 
 class AuthKey {
@@ -149,12 +151,15 @@ inline void aesDecryptLocal(const void *src, void *dst, uint32 len, const AuthKe
 struct CTRState {
 	static constexpr int KeySize = 32;
 	static constexpr int IvecSize = 16;
-	static constexpr int EcountSize = 16;
 
-	uchar ivec[IvecSize] = { 0 };
-	uint32 num = 0;
-	uchar ecount[EcountSize] = { 0 };
+	CTRState() = default;
+	CTRState(const CTRState &other) = delete;
+	CTRState &operator=(const CTRState &other) = delete;
+	~CTRState();
+
+	evp_cipher_ctx_st *context = nullptr; // key schedule is expanded once in aesCtrPrepare()
 };
-void aesCtrEncrypt(void *data, uint32 len, const void *key, CTRState *state);
+void aesCtrPrepare(const void *key, const void *ivec, CTRState *state);
+void aesCtrEncrypt(void *data, uint32 len, CTRState *state);
 
 } // namespace MTP
@@ -1361,9 +1361,12 @@ void ConnectionPrivate::handleReceived() {
 	}
 
 	while (_conn->received().size()) {
-		const mtpBuffer &encryptedBuf(_conn->received().front());
+		mtpBuffer encryptedBuf; // decrypted in place and given back to the connection when the message is handled
+		qSwap(encryptedBuf, _conn->received().front());
+		_conn->received().pop_front();
+
 		uint32 len = encryptedBuf.size();
-		const mtpPrime *encrypted(encryptedBuf.data());
+		mtpPrime *encrypted(encryptedBuf.data());
 		if (len < 18) { // 2 auth_key_id, 4 msg_key, 2 salt, 2 session, 2 msg_id, 1 seq_no, 1 length, (1 data + 3 padding) min
 			LOG(("TCP Error: bad message received, len %1").arg(len * sizeof(mtpPrime)));
 			TCP_LOG(("TCP Error: bad message %1").arg(Logs::mb(encrypted, len * sizeof(mtpPrime)).str()));
@@ -1379,21 +1382,20 @@ void ConnectionPrivate::handleReceived() {
 			return restart();
 		}
 
-		QByteArray dataBuffer((len - 6) * sizeof(mtpPrime), Qt::Uninitialized);
-		mtpPrime *data((mtpPrime*)dataBuffer.data()), *msg = data + 8;
+		uint32 dataSize = (len - 6) * sizeof(mtpPrime);
+		mtpPrime *data(encrypted + 6), *msg = data + 8;
 		const mtpPrime *from(msg), *end;
 		MTPint128 msgKey(*(MTPint128*)(encrypted + 2));
 
-		aesIgeDecrypt(encrypted + 6, data, dataBuffer.size(), key, msgKey);
+		aesIgeDecrypt(data, data, dataSize, key, msgKey);
 
 		uint64 serverSalt = *(uint64*)&data[0], session = *(uint64*)&data[2], msgId = *(uint64*)&data[4];
 		uint32 seqNo = *(uint32*)&data[6], msgLen = *(uint32*)&data[7];
 		bool needAck = (seqNo & 0x01);
 
-		if (uint32(dataBuffer.size()) < msgLen + 8 * sizeof(mtpPrime) || (msgLen & 0x03)) {
-			LOG(("TCP Error: bad msg_len received %1, data size: %2").arg(msgLen).arg(dataBuffer.size()));
+		if (dataSize < msgLen + 8 * sizeof(mtpPrime) || (msgLen & 0x03)) {
+			LOG(("TCP Error: bad msg_len received %1, data size: %2").arg(msgLen).arg(dataSize));
 			TCP_LOG(("TCP Error: bad message %1").arg(Logs::mb(encrypted, len * sizeof(mtpPrime)).str()));
-			_conn->received().pop_front();
 
 			lockFinished.unlock();
 			return restart();
@@ -1402,7 +1404,6 @@ void ConnectionPrivate::handleReceived() {
 		if (memcmp(&msgKey, hashSha1(data, msgLen + 8 * sizeof(mtpPrime), sha1Buffer) + 1, sizeof(msgKey))) {
 			LOG(("TCP Error: bad SHA1 hash after aesDecrypt in message"));
 			TCP_LOG(("TCP Error: bad message %1").arg(Logs::mb(encrypted, len * sizeof(mtpPrime)).str()));
-			_conn->received().pop_front();
 
 			lockFinished.unlock();
 			return restart();
@@ -1413,14 +1414,11 @@ void ConnectionPrivate::handleReceived() {
 		if (session != serverSession) {
 			LOG(("MTP Error: bad server session received"));
 			TCP_LOG(("MTP Error: bad server session %1 instead of %2 in message received").arg(session).arg(serverSession));
-			_conn->received().pop_front();
 
 			lockFinished.unlock();
 			return restart();
 		}
 
-		_conn->received().pop_front();
-
 		int32 serverTime((int32)(msgId >> 32)), clientTime(unixtime());
 		bool isReply = ((msgId & 0x03) == 1);
 		if (!isReply && ((msgId & 0x03) != 3)) {
@@ -1471,14 +1469,7 @@ void ConnectionPrivate::handleReceived() {
 		if (needToHandle) {
 			res = handleOneReceived(from, end, msgId, serverTime, serverSalt, badTime);
 		}
-		{
-			QWriteLocker lock(sessionData->receivedIdsMutex());
-			mtpMsgIdsMap &receivedIds(sessionData->receivedIdsSet());
-			uint32 receivedIdsSize = receivedIds.size();
-			while (receivedIdsSize-- > MTPIdsBufferSize) {
-				receivedIds.erase(receivedIds.begin());
-			}
-		}
+		_conn->recycleBuffer(encryptedBuf);
 
 		// send acks
 		uint32 toAckSize = ackRequestData.size();
@@ -1729,7 +1720,6 @@ int32 ConnectionPrivate::handleOneReceived(const mtpPrime *from, const mtpPrime
 		{
 			QReadLocker lock(sessionData->receivedIdsMutex());
 			const mtpMsgIdsMap &receivedIds(sessionData->receivedIdsSet());
-			mtpMsgIdsMap::const_iterator receivedIdsEnd(receivedIds.cend());
 			uint64 minRecv = receivedIds.min(), maxRecv = receivedIds.max();
 
 			QReadLocker locker(sessionData->wereAckedMutex());
@@ -1744,15 +1734,15 @@ int32 ConnectionPrivate::handleOneReceived(const mtpPrime *from, const mtpPrime
 				} else if (reqMsgId > maxRecv) {
 					state |= 0x03;
 				} else {
-					mtpMsgIdsMap::const_iterator recv = receivedIds.constFind(reqMsgId);
-					if (recv == receivedIdsEnd) {
+					int32 recv = receivedIds.lookup(reqMsgId);
+					if (recv < 0) {
 						state |= 0x02;
 					} else {
 						state |= 0x04;
 						if (wereAcked.constFind(reqMsgId) != wereAckedEnd) {
 							state |= 0x80; // we know, that server knows, that we received request
 						}
-						if (recv.value()) { // need ack, so we sent ack
+						if (recv > 0) { // need ack, so we sent ack
 							state |= 0x08;
 						} else {
 							state |= 0x10;
@@ -1857,7 +1847,7 @@ int32 ConnectionPrivate::handleOneReceived(const mtpPrime *from, const mtpPrime
 		{
 			QReadLocker lock(sessionData->receivedIdsMutex());
 			const mtpMsgIdsMap &receivedIds(sessionData->receivedIdsSet());
-			received = (receivedIds.find(resMsgId.v) != receivedIds.cend()) && (receivedIds.min() < resMsgId.v);
+			received = receivedIds.contains(resMsgId.v) && (receivedIds.min() < resMsgId.v);
 		}
 		if (received) {
 			ackRequestData.push_back(resMsgId);
@@ -1882,7 +1872,7 @@ int32 ConnectionPrivate::handleOneReceived(const mtpPrime *from, const mtpPrime
 		{
 			QReadLocker lock(sessionData->receivedIdsMutex());
 			const mtpMsgIdsMap &receivedIds(sessionData->receivedIdsSet());
-			received = (receivedIds.find(resMsgId.v) != receivedIds.cend()) && (receivedIds.min() < resMsgId.v);
+			received = receivedIds.contains(resMsgId.v) && (receivedIds.min() < resMsgId.v);
 		}
 		if (received) {
 			ackRequestData.push_back(resMsgId);
@@ -1945,8 +1935,12 @@ int32 ConnectionPrivate::handleOneReceived(const mtpPrime *from, const mtpPrime
 
 		mtpRequestId requestId = wasSent(reqMsgId.v);
 		if (requestId && requestId != mtpRequestId(0xFFFFFFFF)) {
+			// read the typed result here, so that the main thread only calls the handler
+			mtpResponse received(response);
+			received.parsed = parseResponse(requestId, response.constData(), response.constData() + response.size());
+
 			QWriteLocker locker(sessionData->haveReceivedMutex());
-			sessionData->haveReceivedMap().insert(requestId, response); // save rpc_result for processing in main mtp thread
+			sessionData->haveReceivedMap().insert(requestId, received); // save rpc_result for processing in main mtp thread
 		} else {
 			DEBUG_LOG(("RPC Info: requestId not found for msgId %1").arg(reqMsgId.v));
 		}
@@ -29,9 +29,56 @@ Copyright (c) 2014-2016 John Preston, https://desktop.telegram.org
 namespace MTP {
 namespace internal {
 
+namespace {
+	QAtomicInt buffersAllocatedCount, buffersReusedCount;
+}
+
 AbstractConnection::~AbstractConnection() {
 }
 
+mtpBuffer AbstractConnection::takeBuffer(int32 size) {
+	int32 sizeClass = 0;
+	while (sizeClass < BufferSizeClasses && (1 << (BufferMinSizeClass + sizeClass)) < size) {
+		++sizeClass;
+	}
+
+	mtpBuffer result;
+	if (sizeClass < BufferSizeClasses && !_freeBuffers[sizeClass].isEmpty()) {
+		qSwap(result, _freeBuffers[sizeClass].back());
+		_freeBuffers[sizeClass].pop_back();
+		buffersReusedCount.ref();
+	} else {
+		if (sizeClass < BufferSizeClasses) result.reserve(1 << (BufferMinSizeClass + sizeClass));
+		buffersAllocatedCount.ref();
+	}
+	result.resize(size);
+	return result;
+}
+
+void AbstractConnection::recycleBuffer(mtpBuffer &buffer) {
+	mtpBuffer taken;
+	qSwap(taken, buffer);
+	if (!taken.isDetached()) return; // still used somewhere else
+
+	int32 capacity = taken.capacity(), sizeClass = BufferSizeClasses - 1;
+	if (capacity > (1 << (BufferMinSizeClass + sizeClass))) return;
+	while (sizeClass >= 0 && (1 << (BufferMinSizeClass + sizeClass)) > capacity) {
+		--sizeClass;
+	}
+	if (sizeClass < 0 || _freeBuffers[sizeClass].size() >= MTPRecycledBuffersPerSize) return;
+
+	taken.resize(0);
+	_freeBuffers[sizeClass].push_back(taken);
+}
+
+int32 AbstractConnection::buffersAllocated() {
+	return buffersAllocatedCount.load();
+}
+
+int32 AbstractConnection::buffersReused() {
+	return buffersReusedCount.load();
+}
+
 mtpBuffer AbstractConnection::preparePQFake(const MTPint128 &nonce) {
 	MTPReq_pq req_pq(nonce);
 	mtpBuffer buffer;
@@ -65,6 +65,12 @@ public:
 		return receivedQueue;
 	}
 
+	// received packets buffers are reused by size classes, must be called in the connection thread
+	mtpBuffer takeBuffer(int32 size);
+	void recycleBuffer(mtpBuffer &buffer);
+	static int32 buffersAllocated(); // received packets buffers allocated in all connections
+	static int32 buffersReused();
+
 signals:
 
 	void receivedData();
@@ -80,6 +86,11 @@ protected:
 	BuffersQueue receivedQueue; // list of received packets, not processed yet
 	bool _sentEncrypted;
 
+	static constexpr int BufferMinSizeClass = 6; // 64 primes
+	static constexpr int BufferSizeClasses = 11; // up to 64k primes, bigger buffers are not kept
+	typedef QVector<mtpBuffer> FreeBuffers;
+	FreeBuffers _freeBuffers[BufferSizeClasses];
+
 	// first we always send fake MTPReq_pq to see if connection works at all
 	// we send them simultaneously through TCP/HTTP/IPv4/IPv6 to choose the working one
 	static mtpBuffer preparePQFake(const MTPint128 &nonce);
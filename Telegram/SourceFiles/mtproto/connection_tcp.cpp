@@ -52,6 +52,14 @@ AbstractTCPConnection::AbstractTCPConnection(QThread *thread) : AbstractConnecti
 AbstractTCPConnection::~AbstractTCPConnection() {
 }
 
+void AbstractTCPConnection::releaseLongBuffer() {
+	if (longBuffer.capacity() > MTPLongBufferKeepSize) {
+		longBuffer.clear();
+	} else {
+		longBuffer.resize(0); // keep the memory for the next long packet
+	}
+}
+
 void AbstractTCPConnection::socketRead() {
 	if (sock.state() != QAbstractSocket::ConnectedState) {
 		LOG(("MTP error: socket not connected in socketRead(), state: %1").arg(sock.state()));
@@ -76,7 +84,7 @@ void AbstractTCPConnection::socketRead() {
 		}
 		int32 bytes = (int32)sock.read(currentPos, toRead);
 		if (bytes > 0) {
-			aesCtrEncrypt(currentPos, bytes, _receiveKey, &_receiveState);
+			aesCtrEncrypt(currentPos, bytes, &_receiveState);
 			TCP_LOG(("TCP Info: read %1 bytes").arg(bytes));
 
 			packetRead += bytes;
@@ -88,7 +96,7 @@ void AbstractTCPConnection::socketRead() {
 					currentPos = (char*)shortBuffer;
 					packetRead = packetLeft = 0;
 					readingToShort = true;
-					longBuffer.clear();
+					releaseLongBuffer();
 				} else {
 					TCP_LOG(("TCP Info: not enough %1 for packet! read %2").arg(packetLeft).arg(packetRead));
 					emit receivedSome();
@@ -118,12 +126,12 @@ void AbstractTCPConnection::socketRead() {
 					if (!packetRead) {
 						currentPos = (char*)shortBuffer;
 						readingToShort = true;
-						longBuffer.clear();
+						releaseLongBuffer();
 					} else if (!readingToShort && packetRead < MTPShortBufferSize * sizeof(mtpPrime)) {
 						memcpy(shortBuffer, currentPos - packetRead, packetRead);
 						currentPos = (char*)shortBuffer + packetRead;
 						readingToShort = true;
-						longBuffer.clear();
+						releaseLongBuffer();
 					}
 				}
 			}
@@ -165,7 +173,7 @@ mtpBuffer AbstractTCPConnection::handleResponse(const char *packet, uint32 lengt
 		return mtpBuffer(1, *packetdata);
 	}
 
-	mtpBuffer data(size);
+	mtpBuffer data(takeBuffer(size));
 	memcpy(data.data(), packetdata, size * sizeof(mtpPrime));
 
 	return data;
@@ -292,21 +300,19 @@ void AbstractTCPConnection::tcpSend(mtpBuffer &buffer) {
 		//sock.write(nonce, 64);
 
 		// prepare encryption key/iv
-		memcpy(_sendKey, nonce + 8, CTRState::KeySize);
-		memcpy(_sendState.ivec, nonce + 8 + CTRState::KeySize, CTRState::IvecSize);
+		aesCtrPrepare(nonce + 8, nonce + 8 + CTRState::KeySize, &_sendState);
 
 		// prepare decryption key/iv
 		char reversed[48];
 		memcpy(reversed, nonce + 8, sizeof(reversed));
 		std::reverse(reversed, reversed + arraysize(reversed));
-		memcpy(_receiveKey, reversed, CTRState::KeySize);
-		memcpy(_receiveState.ivec, reversed + CTRState::KeySize, CTRState::IvecSize);
+		aesCtrPrepare(reversed, reversed + CTRState::KeySize, &_receiveState);
 
 		// write protocol identifier
 		*reinterpret_cast<uint32*>(nonce + 56) = 0xefefefefU;
 
 		sock.write(nonce, 56);
-		aesCtrEncrypt(nonce, 64, _sendKey, &_sendState);
+		aesCtrEncrypt(nonce, 64, &_sendState);
 		sock.write(nonce + 56, 8);
 	}
 	++packetNum;
@@ -317,7 +323,7 @@ void AbstractTCPConnection::tcpSend(mtpBuffer &buffer) {
 		data[7] = char(size);
 		TCP_LOG(("TCP Info: write %1 packet %2").arg(packetNum).arg(len + 1));
 
-		aesCtrEncrypt(data + 7, len + 1, _sendKey, &_sendState);
+		aesCtrEncrypt(data + 7, len + 1, &_sendState);
 		sock.write(data + 7, len + 1);
 	} else {
 		data[4] = 0x7f;
@@ -326,7 +332,7 @@ void AbstractTCPConnection::tcpSend(mtpBuffer &buffer) {
 		reinterpret_cast<uchar*>(data)[7] = uchar((size >> 16) & 0xFF);
 		TCP_LOG(("TCP Info: write %1 packet %2").arg(packetNum).arg(len + 4));
 
-		aesCtrEncrypt(data + 4, len + 4, _sendKey, &_sendState);
+		aesCtrEncrypt(data + 4, len + 4, &_sendState);
 		sock.write(data + 4, len + 4);
 	}
 }
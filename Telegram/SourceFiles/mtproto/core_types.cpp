@@ -26,6 +26,130 @@ Copyright (c) 2014-2016 John Preston, https://desktop.telegram.org
 
 #include "lang.h"
 
+namespace {
+	struct CurrentArena { // QThreadStorage<T*> would delete the arena, this one does not own it
+		CurrentArena() : arena(0) {
+		}
+		mtpArena *arena;
+	};
+	QThreadStorage<CurrentArena> currentArena;
+
+	const size_t MTPDataHeaderSize = 16; // owning arena pointer, keeps the object aligned
+	const size_t MTPArenaAlign = 16;
+}
+
+mtpArena *mtpArena::current() {
+	return currentArena.hasLocalData() ? currentArena.localData().arena : 0;
+}
+
+mtpArena::mtpArena() : _refs(1), _pos(0), _left(0) {
+}
+
+void *mtpArena::allocate(size_t size) {
+	size = (size + MTPArenaAlign - 1) & ~(MTPArenaAlign - 1);
+	if (size > MTPArenaChunkSize / 4) { // big objects get their own chunk, the current one stays in use
+		char *result = new char[size];
+		_chunks.push_back(result);
+		_refs.ref();
+		return result;
+	}
+	if (size > _left) {
+		_pos = new char[MTPArenaChunkSize];
+		_left = MTPArenaChunkSize;
+		_chunks.push_back(_pos);
+	}
+	char *result = _pos;
+	_pos += size;
+	_left -= size;
+	_refs.ref();
+	return result;
+}
+
+void mtpArena::release() {
+	if (!_refs.deref()) delete this;
+}
+
+mtpArena::~mtpArena() {
+	for (QVector<char*>::const_iterator i = _chunks.cbegin(), e = _chunks.cend(); i != e; ++i) {
+		delete[] *i;
+	}
+}
+
+mtpArenaScope::mtpArenaScope() : _arena(new mtpArena()), _previous(mtpArena::current()) {
+	currentArena.localData().arena = _arena;
+}
+
+mtpArenaScope::~mtpArenaScope() { // scopes are nested, so the outer one becomes current again
+	currentArena.localData().arena = _previous;
+	_arena->release();
+}
+
+void *mtpData::operator new(size_t size) {
+	mtpArena *arena = mtpArena::current();
+	char *result = arena ? (char*)arena->allocate(MTPDataHeaderSize + size) : new char[MTPDataHeaderSize + size];
+	*(mtpArena**)result = arena;
+	return result + MTPDataHeaderSize;
+}
+
+void mtpData::operator delete(void *p) {
+	if (!p) return;
+
+	char *block = (char*)p - MTPDataHeaderSize;
+	if (mtpArena *arena = *(mtpArena**)block) {
+		arena->release();
+	} else {
+		delete[] block;
+	}
+}
+
+int32 mtpMsgIdsMap::lowerBound(mtpMsgId id) const {
+	if (!_size || at(_size - 1).id < id) return _size; // ids come almost sorted, check the end first
+
+	int32 from = 0, till = _size;
+	while (from < till) {
+		int32 middle = (from + till) / 2;
+		if (at(middle).id < id) {
+			from = middle + 1;
+		} else {
+			till = middle;
+		}
+	}
+	return from;
+}
+
+bool mtpMsgIdsMap::insert(mtpMsgId id, bool needAck) {
+	int32 index = lowerBound(id);
+	if (index < _size && at(index).id == id) {
+		MTP_LOG(-1, ("No need to handle - %1 already is in map").arg(id));
+		return false;
+	}
+	if (_size == MTPIdsBufferSize) {
+		if (!index) {
+			MTP_LOG(-1, ("No need to handle - %1 < min = %2").arg(id).arg(min()));
+			return false;
+		}
+		_start = (_start + 1) % MTPIdsBufferSize;
+		--_size;
+		--index;
+	}
+	for (int32 i = _size; i > index; --i) {
+		at(i) = at(i - 1);
+	}
+	Entry &entry(at(index));
+	entry.id = id;
+	entry.needAck = needAck;
+	++_size;
+	return true;
+}
+
+int32 mtpMsgIdsMap::lookup(mtpMsgId id) const {
+	int32 index = lowerBound(id);
+	if (index < _size && at(index).id == id) {
+		return at(index).needAck ? 1 : 0;
+	}
+	return -1;
+}
+
 QString mtpWrapNumber(float64 number) {
 	return QString::number(number);
 }
@@ -121,6 +121,13 @@ inline void mtpRequest::write(mtpBuffer &to) const {
     memcpy(to.data() + was, value->constData() + 8, s * sizeof(mtpPrime));
 }
 
+class mtpParsedResponse { // response already read to its typed result, see RPCParsedResponse
+public:
+	virtual ~mtpParsedResponse() {
+	}
+};
+typedef QSharedPointer<mtpParsedResponse> mtpParsedResponsePtr;
+
 class mtpResponse : public mtpBuffer {
 public:
 	mtpResponse() {
@@ -136,39 +143,56 @@ public:
 		uint32 seqNo = *(uint32*)(constData() + 6);
 		return (seqNo & 0x01) ? true : false;
 	}
+
+	mtpParsedResponsePtr parsed; // filled in the connection thread if the handler supports it
 };
 
 typedef QMap<mtpRequestId, mtpRequest> mtpPreRequestMap;
 typedef QMap<mtpMsgId, mtpRequest> mtpRequestMap;
 typedef QMap<mtpMsgId, bool> mtpMsgIdsSet;
-class mtpMsgIdsMap : public QMap<mtpMsgId, bool> {
+class mtpMsgIdsMap { // last MTPIdsBufferSize received msgIds with their need ack flags, sorted ring buffer
 public:
-	typedef QMap<mtpMsgId, bool> ParentType;
-
-	bool insert(const mtpMsgId &k, bool v) {
-		ParentType::const_iterator i = constFind(k);
-		if (i == cend()) {
-			if (size() >= MTPIdsBufferSize && k < min()) {
-				MTP_LOG(-1, ("No need to handle - %1 < min = %2").arg(k).arg(min()));
-				return false;
-			} else {
-				ParentType::insert(k, v);
-				return true;
-			}
-		} else {
-			MTP_LOG(-1, ("No need to handle - %1 already is in map").arg(k));
-			return false;
-		}
+	mtpMsgIdsMap() : _start(0), _size(0) {
 	}
 
-	mtpMsgId min() const {
-		return isEmpty() ? 0 : cbegin().key();
+	bool insert(mtpMsgId id, bool needAck); // the oldest id is dropped if the buffer is full
+	int32 lookup(mtpMsgId id) const; // -1 if not found, else need ack flag
+	bool contains(mtpMsgId id) const {
+		return lookup(id) >= 0;
 	}
 
+	mtpMsgId min() const {
+		return _size ? at(0).id : 0;
+	}
 	mtpMsgId max() const {
-		ParentType::const_iterator e(cend());
-		return isEmpty() ? 0 : (--e).key();
+		return _size ? at(_size - 1).id : 0;
+	}
+	int32 size() const {
+		return _size;
+	}
+	bool isEmpty() const {
+		return !_size;
+	}
+	void clear() {
+		_start = _size = 0;
 	}
+
+private:
+	struct Entry {
+		mtpMsgId id;
+		bool needAck;
+	};
+	Entry &at(int32 index) {
+		return _entries[(_start + index) % MTPIdsBufferSize];
+	}
+	const Entry &at(int32 index) const {
+		return _entries[(_start + index) % MTPIdsBufferSize];
+	}
+	int32 lowerBound(mtpMsgId id) const;
+
+	Entry _entries[MTPIdsBufferSize];
+	int32 _start, _size;
+
 };
 
 class mtpRequestIdsMap : public QMap<mtpMsgId, mtpRequestId> {
@@ -223,10 +247,43 @@ public:
 	}
 };
 
+class mtpArena { // bump allocator for the objects read from one response, freed with the last of them
+public:
+	static mtpArena *current(); // arena of the mtpArenaScope alive in this thread, if any
+
+	void *allocate(size_t size);
+	void release();
+
+private:
+	mtpArena();
+	~mtpArena();
+
+	QAtomicInt _refs; // allocated objects + the scope itself
+	QVector<char*> _chunks;
+	char *_pos;
+	size_t _left;
+
+	friend class mtpArenaScope;
+
+};
+
+class mtpArenaScope { // mtpData objects created in this thread while the scope lives are allocated from a new arena
+public:
+	mtpArenaScope();
+	~mtpArenaScope();
+
+private:
+	mtpArena *_arena, *_previous;
+
+};
+
 class mtpData {
 public:
 	mtpData() : cnt(1) {
 	}
+
+	static void *operator new(size_t size);
+	static void operator delete(void *p);
     mtpData(const mtpData &) : cnt(1) {
 	}
 
@@ -662,6 +719,41 @@ inline bool operator!=(const MTPdouble &a, const MTPdouble &b) {
 	return a.v != b.v;
 }
 
+class MTPstringRef { // serialized string read in place, points inside the buffer it was read from
+public:
+	MTPstringRef() : data(0), size(0) {
+	}
+	MTPstringRef(const mtpPrime *&from, const mtpPrime *end, mtpTypeId cons = mtpc_string) : data(0), size(0) {
+		read(from, end, cons);
+	}
+
+	void read(const mtpPrime *&from, const mtpPrime *end, mtpTypeId cons = mtpc_string) {
+		if (from + 1 > end) throw mtpErrorInsufficient();
+		if (cons != mtpc_string) throw mtpErrorUnexpected(cons, "MTPstring");
+
+		uint32 l;
+		const uchar *buf = (const uchar*)from;
+		if (buf[0] == 254) {
+			l = (uint32)buf[1] + ((uint32)buf[2] << 8) + ((uint32)buf[3] << 16);
+			buf += 4;
+			from += ((l + 4) >> 2) + (((l + 4) & 0x03) ? 1 : 0);
+		} else {
+			l = (uint32)buf[0];
+			++buf;
+			from += ((l + 1) >> 2) + (((l + 1) & 0x03) ? 1 : 0);
+		}
+		if (from > end) throw mtpErrorInsufficient();
+
+		data = (const char*)buf;
+		size = int32(l);
+	}
+
+	const char *data;
+	int32 size;
+
+};
+typedef MTPstringRef MTPbytesRef;
+
 class MTPDstring : public mtpDataImpl<MTPDstring> {
 public:
 	MTPDstring() {
@@ -711,26 +803,11 @@ public:
 		return mtpc_string;
 	}
 	void read(const mtpPrime *&from, const mtpPrime *end, mtpTypeId cons = mtpc_string) {
-		if (from + 1 > end) throw mtpErrorInsufficient();
-		if (cons != mtpc_string) throw mtpErrorUnexpected(cons, "MTPstring");
-
-		uint32 l;
-		const uchar *buf = (const uchar*)from;
-		if (buf[0] == 254) {
-			l = (uint32)buf[1] + ((uint32)buf[2] << 8) + ((uint32)buf[3] << 16);
-			buf += 4;
-			from += ((l + 4) >> 2) + (((l + 4) & 0x03) ? 1 : 0);
-		} else {
-			l = (uint32)buf[0];
-			++buf;
-			from += ((l + 1) >> 2) + (((l + 1) & 0x03) ? 1 : 0);
-		}
-		if (from > end) throw mtpErrorInsufficient();
+		MTPstringRef ref(from, end, cons);
 
 		if (!data) setData(new MTPDstring());
 		MTPDstring &v(_string());
-		v.v.resize(l);
-		memcpy(&v.v[0], buf, l);
+		v.v.assign(ref.data, ref.size);
 	}
 	void write(mtpBuffer &to) const {
 		uint32 l = c_string().v.length(), s = l + ((l < 254) ? 1 : 4), was = to.size();
@@ -36,6 +36,76 @@ namespace {
 	RequestsByDC requestsByDC;
 	QMutex requestByDCLock;
 
+	typedef QMap<DcId, int32> RequestsCountByDC; // live requests count for each bare dc
+	RequestsCountByDC requestsCountByDC;
+
+	void requestDCChanged(int32 wasDcWithShift, int32 nowDcWithShift) { // must be locked by requestByDCLock, 0 for none
+		if (wasDcWithShift) {
+			RequestsCountByDC::iterator i = requestsCountByDC.find(bareDcId(qAbs(wasDcWithShift)));
+			if (i != requestsCountByDC.end() && --i.value() <= 0) {
+				requestsCountByDC.erase(i);
+			}
+		}
+		if (nowDcWithShift) {
+			++requestsCountByDC[bareDcId(qAbs(nowDcWithShift))];
+		}
+	}
+
+	template <typename T>
+	class RequestsRegistry { // sharded by request id, so that the connection threads and the main thread rarely wait for the same lock
+	public:
+		void insert(mtpRequestId requestId, const T &value) {
+			Shard &shard(shardFor(requestId));
+			QMutexLocker locker(&shard.lock);
+			shard.map.insert(requestId, value);
+		}
+		template <typename Result>
+		bool find(mtpRequestId requestId, Result (*method)(const T &value), Result &result) const { // reads a part of the value under the lock, without copying it
+			const Shard &shard(shardFor(requestId));
+			QMutexLocker locker(&shard.lock);
+			typename Map::const_iterator i = shard.map.constFind(requestId);
+			if (i == shard.map.cend()) return false;
+
+			result = method(i.value());
+			return true;
+		}
+		bool contains(mtpRequestId requestId) const {
+			const Shard &shard(shardFor(requestId));
+			QMutexLocker locker(&shard.lock);
+			return shard.map.contains(requestId);
+		}
+		bool take(mtpRequestId requestId, T &value) {
+			Shard &shard(shardFor(requestId));
+			QMutexLocker locker(&shard.lock);
+			typename Map::iterator i = shard.map.find(requestId);
+			if (i == shard.map.end()) return false;
+
+			value = i.value();
+			shard.map.erase(i);
+			return true;
+		}
+		void remove(mtpRequestId requestId) {
+			Shard &shard(shardFor(requestId));
+			QMutexLocker locker(&shard.lock);
+			shard.map.remove(requestId);
+		}
+
+	private:
+		typedef QHash<mtpRequestId, T> Map;
+		struct Shard {
+			Map map;
+			mutable QMutex lock;
+		};
+		Shard &shardFor(mtpRequestId requestId) {
+			return _shards[uint32(requestId) % MTPRequestsShardsCount];
+		}
+		const Shard &shardFor(mtpRequestId requestId) const {
+			return _shards[uint32(requestId) % MTPRequestsShardsCount];
+		}
+		Shard _shards[MTPRequestsShardsCount];
+
+	};
+
 	typedef QMap<mtpRequestId, int32> AuthExportRequests; // holds target dcWithShift for auth export request
 	AuthExportRequests authExportRequests;
 
@@ -43,13 +113,48 @@ namespace {
 
 	uint32 layer;
 
-	typedef QMap<mtpRequestId, RPCResponseHandler> ParserMap;
-	ParserMap parserMap;
-	QMutex parserMapLock;
+	RequestsRegistry<RPCResponseHandler> parsers;
+
+	RPCParseFunction parserOf(const RPCResponseHandler &h) {
+		return h.onDone ? h.onDone->parser() : 0;
+	}
 
-	typedef QMap<mtpRequestId, mtpRequest> RequestMap;
-	RequestMap requestMap;
-	QReadWriteLock requestMapLock;
+	struct ParseStats { // time spent reading responses of each constructor in the connection threads
+		ParseStats() : count(0), total(0), max(0) {
+		}
+		int32 count;
+		qint64 total, max; // nanoseconds
+	};
+	typedef QMap<mtpTypeId, ParseStats> ParseStatsMap;
+	ParseStatsMap parseStats;
+	uint64 parseStatsLogged = 0;
+	QMutex parseStatsLock;
+
+	void parseMeasured(mtpTypeId cons, qint64 elapsed) {
+		QMutexLocker locker(&parseStatsLock);
+		ParseStats &stats(parseStats[cons]);
+		++stats.count;
+		stats.total += elapsed;
+		if (stats.max < elapsed) stats.max = elapsed;
+
+		uint64 ms = getms(true);
+		if (!cDebug() || ms < parseStatsLogged + MTPParseStatsLogPeriod) return;
+		parseStatsLogged = ms;
+		for (ParseStatsMap::const_iterator i = parseStats.cbegin(), e = parseStats.cend(); i != e; ++i) {
+			DEBUG_LOG(("RPC Info: parsed %1 times constructor %2, average %3 mcs, max %4 mcs").arg(i.value().count).arg(i.key(), 0, 16).arg(i.value().total / i.value().count / 1000).arg(i.value().max / 1000));
+		}
+
+		RequestsCountByDC counts;
+		{
+			QMutexLocker lock(&requestByDCLock);
+			counts = requestsCountByDC;
+		}
+		for (RequestsCountByDC::const_iterator i = counts.cbegin(), e = counts.cend(); i != e; ++i) {
+			DEBUG_LOG(("RPC Info: %1 live requests to dc %2").arg(i.value()).arg(i.key()));
+		}
+	}
+
+	RequestsRegistry<mtpRequest> requests;
 
 	typedef QPair<mtpRequestId, uint64> DelayedRequest;
 	typedef QList<DelayedRequest> DelayedRequestsList;
@@ -71,6 +176,59 @@ namespace {
 	QMutex toClearLock;
 	RPCCallbackClears toClear;
 
+	typedef QPair<mtpRequestId, RPCResponseHandler> CoalescedFollower;
+	typedef QList<CoalescedFollower> CoalescedFollowers;
+	struct CoalescedRequest { // identical requests, that wait for the response of the first one
+		QByteArray key;
+		CoalescedFollowers followers;
+	};
+	typedef QMap<mtpRequestId, CoalescedRequest> CoalescedRequests;
+	CoalescedRequests coalescedRequests;
+	typedef QHash<QByteArray, mtpRequestId> CoalescedKeys;
+	CoalescedKeys coalescedKeys;
+	QMutex coalescedLock;
+
+	CoalescedFollowers takeCoalesced(mtpRequestId requestId) {
+		QMutexLocker locker(&coalescedLock);
+		CoalescedRequests::iterator i = coalescedRequests.find(requestId);
+		if (i == coalescedRequests.end()) return CoalescedFollowers();
+
+		CoalescedFollowers result = i.value().followers;
+		coalescedKeys.remove(i.value().key);
+		coalescedRequests.erase(i);
+		return result;
+	}
+
+	// returns true if the request only waited for the response of an identical one,
+	// if identical requests wait for the response of the cancelled one, the first of them becomes the successor
+	bool cancelCoalesced(mtpRequestId requestId, CoalescedFollower &successor) {
+		QMutexLocker locker(&coalescedLock);
+		CoalescedRequests::iterator i = coalescedRequests.find(requestId);
+		if (i != coalescedRequests.end()) {
+			CoalescedRequest request = i.value();
+			coalescedRequests.erase(i);
+			if (request.followers.isEmpty()) {
+				coalescedKeys.remove(request.key);
+				return false;
+			}
+
+			successor = request.followers.takeFirst();
+			coalescedKeys.insert(request.key, successor.first);
+			coalescedRequests.insert(successor.first, request);
+			return false;
+		}
+		for (i = coalescedRequests.begin(); i != coalescedRequests.end(); ++i) {
+			CoalescedFollowers &followers(i.value().followers);
+			for (CoalescedFollowers::iterator j = followers.begin(), e = followers.end(); j != e; ++j) {
+				if (j->first == requestId) {
+					followers.erase(j);
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
 	RPCResponseHandler globalHandler;
 	MTPStateChangedHandler stateChangedHandler = 0;
 	MTPSessionResetHandler sessionResetHandler = 0;
@@ -92,11 +250,10 @@ namespace {
 
 		DCAuthWaiters &waiters(authWaiters[newdc]);
 		if (waiters.size()) {
-			QReadLocker locker(&requestMapLock);
 			for (DCAuthWaiters::iterator i = waiters.begin(), e = waiters.end(); i != e; ++i) {
 				mtpRequestId requestId = *i;
-				RequestMap::const_iterator j = requestMap.constFind(requestId);
-				if (j == requestMap.cend()) {
+				mtpRequest request;
+				if (!requests.find(requestId, request)) {
 					LOG(("MTP Error: could not find request %1 for resending").arg(requestId));
 					continue;
 				}
@@ -109,15 +266,17 @@ namespace {
 					}
 					if (k.value() < 0) {
 						setdc(newdc);
+						requestDCChanged(k.value(), -newdc);
 						k.value() = -newdc;
 					} else {
 						dcWithShift = shiftDcId(newdc, getDcIdShift(k.value()));
+						requestDCChanged(k.value(), dcWithShift);
 						k.value() = dcWithShift;
 					}
 					DEBUG_LOG(("MTP Info: resending request %1 to dc %2 after import auth").arg(requestId).arg(k.value()));
 				}
 				if (internal::Session *session = internal::getSession(dcWithShift)) {
-					session->sendPrepared(j.value());
+					session->sendPrepared(request);
 				}
 			}
 			waiters.clear();
@@ -197,14 +356,9 @@ namespace {
 			}
 
 			mtpRequest req;
-			{
-				QReadLocker locker(&requestMapLock);
-				RequestMap::const_iterator i = requestMap.constFind(requestId);
-				if (i == requestMap.cend()) {
-					LOG(("MTP Error: could not find request %1").arg(requestId));
-					return false;
-				}
-				req = i.value();
+			if (!requests.find(requestId, req)) {
+				LOG(("MTP Error: could not find request %1").arg(requestId));
+				return false;
 			}
 			if (internal::Session *session = internal::getSession(newdcWithShift)) {
 				internal::registerRequest(requestId, (dcWithShift < 0) ? -newdcWithShift : newdcWithShift);
@@ -264,14 +418,9 @@ namespace {
 			return true;
 		} else if (err == qsl("CONNECTION_NOT_INITED") || err == qsl("CONNECTION_LAYER_INVALID")) {
 			mtpRequest req;
-			{
-				QReadLocker locker(&requestMapLock);
-				RequestMap::const_iterator i = requestMap.constFind(requestId);
-				if (i == requestMap.cend()) {
-					LOG(("MTP Error: could not find request %1").arg(requestId));
-					return false;
-				}
-				req = i.value();
+			if (!requests.find(requestId, req)) {
+				LOG(("MTP Error: could not find request %1").arg(requestId));
+				return false;
 			}
 			int32 dcWithShift = 0;
 			{
@@ -292,14 +441,9 @@ namespace {
 			return true;
 		} else if (err == qsl("MSG_WAIT_FAILED")) {
 			mtpRequest req;
-			{
-				QReadLocker locker(&requestMapLock);
-				RequestMap::const_iterator i = requestMap.constFind(requestId);
-				if (i == requestMap.cend()) {
-					LOG(("MTP Error: could not find request %1").arg(requestId));
-					return false;
-				}
-				req = i.value();
+			if (!requests.find(requestId, req)) {
+				LOG(("MTP Error: could not find request %1").arg(requestId));
+				return false;
 			}
 			if (!req->after) {
 				LOG(("MTP Error: wait failed for not dependent request %1").arg(requestId));
@@ -386,45 +530,42 @@ bool paused() {
 void registerRequest(mtpRequestId requestId, int32 dcWithShift) {
 	{
 		QMutexLocker locker(&requestByDCLock);
-		requestsByDC.insert(requestId, dcWithShift);
+		RequestsByDC::iterator i = requestsByDC.find(requestId);
+		if (i == requestsByDC.end()) {
+			requestsByDC.insert(requestId, dcWithShift);
+			requestDCChanged(0, dcWithShift);
+		} else {
+			requestDCChanged(i.value(), dcWithShift);
+			i.value() = dcWithShift;
+		}
 	}
-	internal::performDelayedClear(); // need to do it somewhere...
 }
 
 void unregisterRequest(mtpRequestId requestId) {
 	requestsDelays.remove(requestId);
-
-	{
-		QWriteLocker locker(&requestMapLock);
-		requestMap.remove(requestId);
-	}
+	requests.remove(requestId);
 
 	QMutexLocker locker(&requestByDCLock);
-	requestsByDC.remove(requestId);
+	RequestsByDC::iterator i = requestsByDC.find(requestId);
+	if (i != requestsByDC.end()) {
+		requestDCChanged(i.value(), 0);
+		requestsByDC.erase(i);
+	}
 }
 
 mtpRequestId storeRequest(mtpRequest &request, const RPCResponseHandler &parser) {
 	mtpRequestId res = reqid();
 	request->requestId = res;
 	if (parser.onDone || parser.onFail) {
-		QMutexLocker locker(&parserMapLock);
-		parserMap.insert(res, parser);
-	}
-	{
-		QWriteLocker locker(&requestMapLock);
-		requestMap.insert(res, request);
+		parsers.insert(res, parser);
 	}
+	requests.insert(res, request);
 	return res;
 }
 
 mtpRequest getRequest(mtpRequestId reqId) {
-	static mtpRequest zero;
 	mtpRequest req;
-	{
-		QReadLocker locker(&requestMapLock);
-		RequestMap::const_iterator i = requestMap.constFind(reqId);
-		req = (i == requestMap.cend()) ? zero : i.value();
-	}
+	requests.find(reqId, req);
 	return req;
 }
 
@@ -453,19 +594,51 @@ void wrapInvokeAfter(mtpRequest &to, const mtpRequest &from, const mtpRequestMap
 
 void clearCallbacks(mtpRequestId requestId, int32 errorCode) {
 	RPCResponseHandler h;
-	bool found = false;
-	{
-		QMutexLocker locker(&parserMapLock);
-		ParserMap::iterator i = parserMap.find(requestId);
-		if (i != parserMap.end()) {
-			h = i.value();
-			found = true;
+	bool found = parsers.take(requestId, h);
+	if (errorCode && found) {
+		rpcErrorOccured(requestId, h, rpcClientError("CLEAR_CALLBACK", QString("did not handle request %1, error code %2").arg(requestId).arg(errorCode)));
+	}
 
-			parserMap.erase(i);
+	CoalescedFollowers followers = takeCoalesced(requestId);
+	if (errorCode) {
+		for (CoalescedFollowers::const_iterator i = followers.cbegin(), e = followers.cend(); i != e; ++i) {
+			rpcErrorOccured(i->first, i->second, rpcClientError("CLEAR_CALLBACK", QString("did not handle request %1, error code %2").arg(i->first).arg(errorCode)));
 		}
 	}
-	if (errorCode && found) {
-		rpcErrorOccured(requestId, h, rpcClientError("CLEAR_CALLBACK", QString("did not handle request %1, error code %2").arg(requestId).arg(errorCode)));
+}
+
+mtpRequestId joinCoalesced(const QByteArray &key, const RPCResponseHandler &callbacks) {
+	QMutexLocker locker(&coalescedLock);
+	CoalescedKeys::const_iterator i = coalescedKeys.constFind(key);
+	if (i == coalescedKeys.cend()) return 0;
+
+	mtpRequestId requestId = reqid();
+	coalescedRequests[i.value()].followers.push_back(CoalescedFollower(requestId, callbacks));
+	DEBUG_LOG(("RPC Info: request %1 joined the identical request %2").arg(requestId).arg(i.value()));
+	return requestId;
+}
+
+void startCoalesced(const QByteArray &key, mtpRequestId requestId) {
+	QMutexLocker locker(&coalescedLock);
+	coalescedKeys.insert(key, requestId);
+	coalescedRequests[requestId].key = key;
+}
+
+void finishCoalesced(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end) {
+	CoalescedFollowers followers = takeCoalesced(requestId);
+	for (CoalescedFollowers::const_iterator i = followers.cbegin(), e = followers.cend(); i != e; ++i) {
+		const RPCResponseHandler &h(i->second);
+		try {
+			if (from >= end) throw mtpErrorInsufficient();
+
+			if (*from == mtpc_rpc_error) {
+				rpcErrorOccured(i->first, h, RPCError(MTPRpcError(from, end)));
+			} else if (h.onDone) {
+				(*h.onDone)(i->first, from, end);
+			}
+		} catch (Exception &e) {
+			rpcErrorOccured(i->first, h, rpcClientError("RESPONSE_PARSE_FAILED", QString("exception text: ") + e.what()));
+		}
 	}
 }
 
@@ -481,44 +654,64 @@ void clearCallbacksDelayed(const RPCCallbackClears &requestIds) {
 		DEBUG_LOG(("RPC Info: clear callbacks delayed, msgIds: %1").arg(idsStr));
 	}
 
-	QMutexLocker lock(&toClearLock);
-	uint32 toClearNow = toClear.size();
-	if (toClearNow) {
-		toClear.resize(toClearNow + idsCount);
-		memcpy(toClear.data() + toClearNow, requestIds.constData(), idsCount * sizeof(RPCCallbackClear));
-	} else {
+	{
+		QMutexLocker lock(&toClearLock);
+		uint32 toClearNow = toClear.size();
+		if (toClearNow) { // the clear of this batch is already posted
+			toClear.resize(toClearNow + idsCount);
+			memcpy(toClear.data() + toClearNow, requestIds.constData(), idsCount * sizeof(RPCCallbackClear));
+			return;
+		}
 		toClear = requestIds;
 	}
+	if (_globalSlotCarrier) {
+		QMetaObject::invokeMethod(_globalSlotCarrier, "clearDelayed", Qt::QueuedConnection);
+	}
 }
 
 void performDelayedClear() {
-	QMutexLocker lock(&toClearLock);
-	if (!toClear.isEmpty()) {
-		for (RPCCallbackClears::iterator i = toClear.begin(), e = toClear.end(); i != e; ++i) {
-			if (cDebug()) {
-				QMutexLocker locker(&parserMapLock);
-				if (parserMap.find(i->requestId) != parserMap.end()) {
-					DEBUG_LOG(("RPC Info: clearing delayed callback %1, error code %2").arg(i->requestId).arg(i->errorCode));
-				}
-			}
-			clearCallbacks(i->requestId, i->errorCode);
-			internal::unregisterRequest(i->requestId);
+	RPCCallbackClears clears; // take the whole batch, fail handlers may add new clears while we process it
+	{
+		QMutexLocker lock(&toClearLock);
+		if (toClear.isEmpty()) return;
+
+		qSwap(clears, toClear);
+	}
+	for (RPCCallbackClears::const_iterator i = clears.cbegin(), e = clears.cend(); i != e; ++i) {
+		if (cDebug() && parsers.contains(i->requestId)) {
+			DEBUG_LOG(("RPC Info: clearing delayed callback %1, error code %2").arg(i->requestId).arg(i->errorCode));
 		}
-		toClear.clear();
+		clearCallbacks(i->requestId, i->errorCode);
+		internal::unregisterRequest(i->requestId);
 	}
 }
 
-void execCallback(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end) {
-	RPCResponseHandler h;
-	{
-		QMutexLocker locker(&parserMapLock);
-		ParserMap::iterator i = parserMap.find(requestId);
-		if (i != parserMap.cend()) {
-			h = i.value();
-			parserMap.erase(i);
+mtpParsedResponsePtr parseResponse(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end) {
+	if (from >= end || *from == mtpc_rpc_error) return mtpParsedResponsePtr();
+
+	// don't copy the handler here, the last reference to an owned handler must be released in the main thread
+	RPCParseFunction parse = 0;
+	if (!parsers.find(requestId, &parserOf, parse) || !parse) return mtpParsedResponsePtr();
+
+	QElapsedTimer timer;
+	timer.start();
+	mtpParsedResponsePtr result;
+	try {
+		mtpArenaScope arena; // all the data objects of the result share one allocation, freed with the last of them
+		result = parse(from, end);
+	} catch (Exception &e) { // will be read again and reported in execCallback()
+		return mtpParsedResponsePtr();
+	}
+	if (result) {
+		parseMeasured(mtpTypeId(*from), timer.nsecsElapsed());
+	}
+	return result;
+}
 
-			DEBUG_LOG(("RPC Info: found parser for request %1, trying to parse response...").arg(requestId));
-		}
+void execCallback(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end, const mtpParsedResponsePtr &parsed) {
+	RPCResponseHandler h;
+	if (parsers.take(requestId, h)) {
+		DEBUG_LOG(("RPC Info: found parser for request %1, trying to parse response...").arg(requestId));
 	}
 	if (h.onDone || h.onFail) {
 		try {
@@ -528,33 +721,34 @@ void execCallback(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *
 				RPCError err(MTPRpcError(from, end));
 				DEBUG_LOG(("RPC Info: error received, code %1, type %2, description: %3").arg(err.code()).arg(err.type()).arg(err.description()));
 				if (!rpcErrorOccured(requestId, h, err)) {
-					QMutexLocker locker(&parserMapLock);
-					parserMap.insert(requestId, h);
+					parsers.insert(requestId, h);
 					return;
 				}
 			} else {
 				if (h.onDone) {
 //						t_assert(App::app() != 0);
-					(*h.onDone)(requestId, from, end);
+					if (parsed) {
+						(*h.onDone)(requestId, *parsed);
+					} else {
+						(*h.onDone)(requestId, from, end);
+					}
 				}
 			}
 		} catch (Exception &e) {
 			if (!rpcErrorOccured(requestId, h, rpcClientError("RESPONSE_PARSE_FAILED", QString("exception text: ") + e.what()))) {
-				QMutexLocker locker(&parserMapLock);
-				parserMap.insert(requestId, h);
+				parsers.insert(requestId, h);
 				return;
 			}
 		}
 	} else {
 		DEBUG_LOG(("RPC Info: parser not found for %1").arg(requestId));
 	}
+	finishCoalesced(requestId, from, end);
 	unregisterRequest(requestId);
 }
 
 bool hasCallbacks(mtpRequestId requestId) {
-	QMutexLocker locker(&parserMapLock);
-	ParserMap::iterator i = parserMap.find(requestId);
-	return (i != parserMap.cend());
+	return parsers.contains(requestId);
 }
 
 void globalCallback(const mtpPrime *from, const mtpPrime *end) {
@@ -605,14 +799,9 @@ void GlobalSlotCarrier::checkDelayed() {
 		}
 
 		mtpRequest req;
-		{
-			QReadLocker locker(&requestMapLock);
-			RequestMap::const_iterator j = requestMap.constFind(requestId);
-			if (j == requestMap.cend()) {
-				DEBUG_LOG(("MTP Error: could not find request %1").arg(requestId));
-				continue;
-			}
-			req = j.value();
+		if (!requests.find(requestId, req)) {
+			DEBUG_LOG(("MTP Error: could not find request %1").arg(requestId));
+			continue;
 		}
 		if (Session *session = getSession(qAbs(dcWithShift))) {
 			session->sendPrepared(req);
@@ -624,6 +813,10 @@ void GlobalSlotCarrier::checkDelayed() {
 	}
 }
 
+void GlobalSlotCarrier::clearDelayed() {
+	performDelayedClear();
+}
+
 void GlobalSlotCarrier::connectionFinished(Connection *connection) {
 	MTPQuittingConnections::iterator i = quittingConnections.find(connection);
 	if (i != quittingConnections.cend()) {
@@ -652,6 +845,7 @@ void start() {
 	internal::DcenterMap &dcs(internal::DCMap());
 
 	_globalSlotCarrier = new internal::GlobalSlotCarrier();
+	internal::performDelayedClear(); // clears left from the previous run were not posted to any carrier
 
 	mainSession = new internal::Session(internal::mainDC());
 	sessions.insert(mainSession->getDcWithShift(), mainSession);
@@ -756,27 +950,45 @@ void ping() {
 void cancel(mtpRequestId requestId) {
 	if (!_started) return;
 
+	CoalescedFollower successor(0, RPCResponseHandler());
+	if (cancelCoalesced(requestId, successor)) return; // it waited for the response of an identical request
+
 	mtpMsgId msgId = 0;
 	requestsDelays.remove(requestId);
-	{
-		QWriteLocker locker(&requestMapLock);
-		RequestMap::iterator i = requestMap.find(requestId);
-		if (i != requestMap.end()) {
-			msgId = *(mtpMsgId*)(i.value()->constData() + 4);
-			requestMap.erase(i);
-		}
+	mtpRequest req;
+	if (requests.take(requestId, req)) {
+		msgId = *(mtpMsgId*)(req->constData() + 4);
 	}
+	int32 dcWithShift = 0;
 	{
 		QMutexLocker locker(&requestByDCLock);
 		RequestsByDC::iterator i = requestsByDC.find(requestId);
 		if (i != requestsByDC.end()) {
+			dcWithShift = i.value();
 			if (internal::Session *session = internal::getSession(qAbs(i.value()))) {
 				session->cancel(requestId, msgId);
 			}
+			requestDCChanged(i.value(), 0);
 			requestsByDC.erase(i);
 		}
 	}
 	internal::clearCallbacks(requestId);
+
+	if (successor.first) { // identical requests still wait for the response, send it again on behalf of the first of them
+		if (successor.second.onDone || successor.second.onFail) {
+			parsers.insert(successor.first, successor.second);
+		}
+		internal::Session *session = (req && dcWithShift) ? internal::getSession(qAbs(dcWithShift)) : 0;
+		if (session) {
+			mtpRequest resent(new mtpRequestData(*req));
+			resent->requestId = successor.first;
+			requests.insert(successor.first, resent);
+			internal::registerRequest(successor.first, dcWithShift);
+			session->sendPrepared(resent);
+		} else {
+			internal::clearCallbacks(successor.first, RPCError::TimeoutError);
+		}
+	}
 }
 
 void killSession(int32 dc) {
@@ -829,6 +1041,11 @@ int32 state(mtpRequestId requestId) {
 	return MTP::RequestConnecting;
 }
 
+int32 requestsCount(DcId dc) {
+	QMutexLocker locker(&requestByDCLock);
+	return requestsCountByDC.value(dc);
+}
+
 void finish() {
 	for (Sessions::iterator i = sessions.begin(), e = sessions.end(); i != e; ++i) {
 		i.value()->kill();
@@ -41,7 +41,11 @@ void wrapInvokeAfter(mtpRequest &to, const mtpRequest &from, const mtpRequestMap
 void clearCallbacks(mtpRequestId requestId, int32 errorCode = RPCError::NoError); // 0 - do not toggle onError callback
 void clearCallbacksDelayed(const RPCCallbackClears &requestIds);
 void performDelayedClear();
-void execCallback(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end);
+mtpParsedResponsePtr parseResponse(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end); // is called in the connection thread
+void execCallback(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end, const mtpParsedResponsePtr &parsed = mtpParsedResponsePtr());
+mtpRequestId joinCoalesced(const QByteArray &key, const RPCResponseHandler &callbacks); // 0 if no identical request is waiting for response
+void startCoalesced(const QByteArray &key, mtpRequestId requestId);
+void finishCoalesced(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end); // pass the response to the joined requests
 bool hasCallbacks(mtpRequestId requestId);
 void globalCallback(const mtpPrime *from, const mtpPrime *end);
 void onStateChange(int32 dcWithShift, int32 state);
@@ -54,6 +58,7 @@ inline bool rpcErrorOccured(mtpRequestId requestId, const RPCResponseHandler &ha
 // used for:
 // - resending requests by timer which were postponed by flood delay
 // - destroying MTProtoConnections whose thread has finished
+// - clearing the callbacks of the finished requests in batches, posted from the connection threads
 class GlobalSlotCarrier : public QObject {
 	Q_OBJECT
 
@@ -64,6 +69,7 @@ public:
 public slots:
 
 	void checkDelayed();
+	void clearDelayed();
 	void connectionFinished(Connection *connection);
 
 private:
@@ -162,6 +168,29 @@ template <typename TRequest>
 inline mtpRequestId send(const TRequest &request, RPCDoneHandlerPtr onDone, RPCFailHandlerPtr onFail = RPCFailHandlerPtr(), int32 dc = 0, uint64 msCanWait = 0, mtpRequestId after = 0) {
 	return send(request, RPCResponseHandler(onDone, onFail), dc, msCanWait, after);
 }
+
+// identical requests sent while the first of them waits for response are not sent again,
+// each of them gets its own request id and callbacks called with the response of the first one
+template <typename TRequest>
+inline mtpRequestId sendCoalesced(const TRequest &request, RPCResponseHandler callbacks = RPCResponseHandler(), int32 dc = 0, uint64 msCanWait = 0, mtpRequestId after = 0) {
+	mtpBuffer serialized;
+	serialized.reserve((request.innerLength() >> 2) + 2);
+	serialized.push_back(dc);
+	serialized.push_back(after); // only the requests invoked after the same one are identical
+	request.write(serialized);
+	QByteArray key(reinterpret_cast<const char*>(serialized.constData()), serialized.size() * sizeof(mtpPrime));
+	if (mtpRequestId requestId = internal::joinCoalesced(key, callbacks)) {
+		return requestId;
+	}
+
+	mtpRequestId requestId = send(request, callbacks, dc, msCanWait, after);
+	if (requestId) internal::startCoalesced(key, requestId);
+	return requestId;
+}
+template <typename TRequest>
+inline mtpRequestId sendCoalesced(const TRequest &request, RPCDoneHandlerPtr onDone, RPCFailHandlerPtr onFail = RPCFailHandlerPtr(), int32 dc = 0, uint64 msCanWait = 0, mtpRequestId after = 0) {
+	return sendCoalesced(request, RPCResponseHandler(onDone, onFail), dc, msCanWait, after);
+}
 inline void sendAnything(int32 dc = 0, uint64 msCanWait = 0) {
 	if (internal::Session *session = internal::getSession(dc)) {
 		return session->sendAnything(msCanWait);
@@ -178,6 +207,7 @@ enum {
 	RequestSending = 2
 };
 int32 state(mtpRequestId req); // < 0 means waiting for such count of ms
+int32 requestsCount(DcId dc); // requests sent to this dc and not yet finished
 
 void finish();
 
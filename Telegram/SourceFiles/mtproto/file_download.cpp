@@ -30,6 +30,8 @@ Copyright (c) 2014-2016 John Preston, https://desktop.telegram.org
 
 namespace {
 	int32 GlobalPriority = 1;
+	int64 QueueFrontOrder = 0, QueueBackOrder = 0;
+	const int32 LoadPriorityShares[LoadPriorityClassesCount] = { 4, 2, 1 }; // on screen, prefetch, background
 	struct DataRequested {
 		DataRequested() {
 			memset(v, 0, sizeof(v));
@@ -37,18 +39,82 @@ namespace {
 		int64 v[MTPDownloadSessionsCount];
 	};
 	QMap<int32, DataRequested> DataRequestedMap;
+
+	// measured document download rate of a dc, in-flight window and part size are derived from it
+	struct DownloadStats {
+		DownloadStats() : rtt(0), speed(0), received(0), periodStart(0), partSize(DocumentDownloadPartSize) {
+		}
+		uint64 rtt; // smoothed time from request till response, ms
+		int64 speed; // bytes per second
+		int64 received;
+		uint64 periodStart;
+		int32 partSize;
+	};
+	QMap<int32, DownloadStats> DownloadStatsMap;
+}
+
+struct FileLoaderQueueKey {
+	int32 priorityClass;
+	int32 priority; // greater goes first
+	uint64 deadline; // 0 - no deadline, goes last
+	int64 order;
+
+	static FileLoaderQueueKey classStart(int32 priorityClass) {
+		FileLoaderQueueKey result = { priorityClass, INT_MAX, 1, std::numeric_limits<int64>::min() };
+		return result;
+	}
+};
+inline bool operator<(const FileLoaderQueueKey &a, const FileLoaderQueueKey &b) {
+	if (a.priorityClass != b.priorityClass) return a.priorityClass < b.priorityClass;
+	if (a.priority != b.priority) return a.priority > b.priority;
+	if (a.deadline != b.deadline) return (a.deadline - 1) < (b.deadline - 1);
+	return a.order < b.order;
 }
 
 struct FileLoaderQueue {
-	FileLoaderQueue(int32 limit) : queries(0), limit(limit), start(0), end(0) {
+	FileLoaderQueue(int32 limit) : queries(0), limit(limit) {
+		memset(classQueries, 0, sizeof(classQueries));
+		memset(classLoaders, 0, sizeof(classLoaders));
 	}
 	int32 queries, limit;
-	FileLoader *start, *end;
+	int32 classQueries[LoadPriorityClassesCount];
+	int32 classLoaders[LoadPriorityClassesCount];
+
+	typedef QMap<FileLoaderQueueKey, FileLoader*> Loaders;
+	Loaders loaders;
+
+	static FileLoaderQueueKey key(const FileLoader *loader) {
+		FileLoaderQueueKey result = { loader->_priorityClass, loader->_priority, loader->_deadline, loader->_queueOrder };
+		return result;
+	}
+	void insert(FileLoader *loader) {
+		loaders.insert(key(loader), loader);
+		++classLoaders[loader->_priorityClass];
+	}
+	void remove(FileLoader *loader) {
+		if (loaders.remove(key(loader))) {
+			--classLoaders[loader->_priorityClass];
+		}
+	}
 };
 
 namespace {
 	typedef QMap<int32, FileLoaderQueue> LoaderQueues;
 	LoaderQueues queues;
+	LoaderQueues documentQueues; // their queries limit follows the measured bandwidth, see downloadPartLoaded()
+
+	FileLoaderQueue *loaderQueue(LoaderQueues &map, int32 dc) {
+		LoaderQueues::iterator i = map.find(MTP::dldDcId(dc, 0));
+		if (i == map.cend()) {
+			i = map.insert(MTP::dldDcId(dc, 0), FileLoaderQueue(MaxFileQueries));
+		}
+		return &i.value();
+	}
+
+	bool downloadingFrom(int32 dc) {
+		LoaderQueues::const_iterator i = queues.constFind(MTP::dldDcId(dc, 0)), j = documentQueues.constFind(MTP::dldDcId(dc, 0));
+		return (i != queues.cend() && i.value().queries) || (j != documentQueues.cend() && j.value().queries);
+	}
 
 	FileLoaderQueue _webQueue(MaxWebFileQueries);
 
@@ -61,9 +127,10 @@ namespace {
 }
 
 FileLoader::FileLoader(const QString &toFile, int32 size, LocationType locationType, LoadToCacheSetting toCache, LoadFromCloudSetting fromCloud, bool autoLoading)
-: _prev(0)
-, _next(0)
-, _priority(0)
+: _priority(0)
+, _priorityClass(LoadPriorityOnScreen)
+, _deadline(0)
+, _queueOrder(0)
 , _paused(false)
 , _autoLoading(autoLoading)
 , _inQueue(false)
@@ -77,6 +144,9 @@ FileLoader::FileLoader(const QString &toFile, int32 size, LocationType locationT
 , _size(size)
 , _type(mtpc_storage_fileUnknown)
 , _locationType(locationType)
+, _speed(0)
+, _speedStart(0)
+, _speedStartOffset(0)
 , _localTaskId(0) {
 }
 
@@ -118,6 +188,19 @@ int32 FileLoader::fullSize() const {
 	return _size;
 }
 
+void FileLoader::updateSpeed(int32 offset) {
+	uint64 ms = getms();
+	if (!_speedStart) {
+		_speedStart = ms;
+		_speedStartOffset = offset;
+	} else if (ms > _speedStart + DownloadStatsPeriod) {
+		int32 speed = int32((offset - _speedStartOffset) * 1000LL / int64(ms - _speedStart));
+		_speed = _speed ? ((_speed + speed) / 2) : speed;
+		_speedStart = ms;
+		_speedStartOffset = offset;
+	}
+}
+
 bool FileLoader::setFileName(const QString &fileName) {
 	if (_toCache != LoadToCacheAsWell || !_fname.isEmpty()) return fileName.isEmpty();
 	_fname = fileName;
@@ -131,30 +214,31 @@ void FileLoader::permitLoadFromCloud() {
 
 void FileLoader::loadNext() {
 	if (_queue->queries >= _queue->limit) return;
-	for (FileLoader *i = _queue->start; i;) {
-		if (i->loadPart()) {
+
+	int32 shares = 0;
+	for (int32 i = 0; i < LoadPriorityClassesCount; ++i) {
+		if (_queue->classLoaders[i]) shares += LoadPriorityShares[i];
+	}
+	for (FileLoaderQueue::Loaders::iterator i = _queue->loaders.begin(); i != _queue->loaders.end();) {
+		FileLoaderQueueKey key = i.key();
+		if (_queue->classQueries[key.priorityClass] >= qMax(_queue->limit * LoadPriorityShares[key.priorityClass] / shares, 1)) {
+			i = _queue->loaders.lowerBound(FileLoaderQueueKey::classStart(key.priorityClass + 1)); // this class used its share
+			continue;
+		}
+
+		// the loader can leave the queue in loadPart(), so we look for the place again
+		if (i.value()->loadPart()) {
 			if (_queue->queries >= _queue->limit) return;
+			i = _queue->loaders.lowerBound(key);
 		} else {
-			i = i->_next;
+			i = _queue->loaders.upperBound(key);
 		}
 	}
 }
 
 void FileLoader::removeFromQueue() {
 	if (!_inQueue) return;
-	if (_next) {
-		_next->_prev = _prev;
-	}
-	if (_prev) {
-		_prev->_next = _next;
-	}
-	if (_queue->end == this) {
-		_queue->end = _prev;
-	}
-	if (_queue->start == this) {
-		_queue->start = _next;
-	}
-	_next = _prev = 0;
+	_queue->remove(this);
 	_inQueue = false;
 }
 
@@ -208,6 +292,14 @@ void FileLoader::localLoaded(const StorageImageSaved &result, const QByteArray &
 }
 
 void FileLoader::start(bool loadFirst, bool prior) {
+	schedule(prior ? LoadPriorityOnScreen : LoadPriorityBackground, 0, loadFirst);
+}
+
+bool FileLoader::onScreen() const {
+	return _inQueue && _priorityClass == LoadPriorityOnScreen && _priority == GlobalPriority;
+}
+
+void FileLoader::schedule(LoadPriorityClass priorityClass, uint64 deadline, bool loadFirst) {
 	if (_paused) {
 		_paused = false;
 	}
@@ -219,98 +311,25 @@ void FileLoader::start(bool loadFirst, bool prior) {
 	}
 
 	if (!_fname.isEmpty() && _toCache == LoadToFileOnly && !_fileIsOpen) {
-		_fileIsOpen = _file.open(QIODevice::WriteOnly);
+		_fileIsOpen = resumeFile() || _file.open(QIODevice::WriteOnly);
 		if (!_fileIsOpen) {
 			return cancel(true);
 		}
 	}
 
-	FileLoader *before = 0, *after = 0;
-	if (prior) {
-		if (_inQueue && _priority == GlobalPriority) {
-			if (loadFirst) {
-				if (!_prev) return startLoading(loadFirst, prior);
-				before = _queue->start;
-			} else {
-				if (!_next || _next->_priority < GlobalPriority) return startLoading(loadFirst, prior);
-				after = _next;
-				while (after->_next && after->_next->_priority == GlobalPriority) {
-					after = after->_next;
-				}
-			}
-		} else {
-			_priority = GlobalPriority;
-			if (loadFirst) {
-				if (_inQueue && !_prev) return startLoading(loadFirst, prior);
-				before = _queue->start;
-			} else {
-				if (_inQueue) {
-					if (_next && _next->_priority == GlobalPriority) {
-						after = _next;
-					} else if (_prev && _prev->_priority < GlobalPriority) {
-						before = _prev;
-						while (before->_prev && before->_prev->_priority < GlobalPriority) {
-							before = before->_prev;
-						}
-					} else {
-						return startLoading(loadFirst, prior);
-					}
-				} else {
-					if (_queue->start && _queue->start->_priority == GlobalPriority) {
-						after = _queue->start;
-					} else {
-						before = _queue->start;
-					}
-				}
-				if (after) {
-					while (after->_next && after->_next->_priority == GlobalPriority) {
-						after = after->_next;
-					}
-				}
-			}
-		}
-	} else {
-		if (loadFirst) {
-			if (_inQueue && (!_prev || _prev->_priority == GlobalPriority)) return startLoading(loadFirst, prior);
-			before = _prev;
-			while (before->_prev && before->_prev->_priority != GlobalPriority) {
-				before = before->_prev;
-			}
-		} else {
-			if (_inQueue && !_next) return startLoading(loadFirst, prior);
-			after = _queue->end;
-		}
-	}
-
-	removeFromQueue();
+	int32 priority = (priorityClass == LoadPriorityOnScreen) ? GlobalPriority : 0;
+	bool samePlace = _inQueue && _priorityClass == priorityClass && _priority == priority && _deadline == deadline;
+	if (!samePlace || loadFirst) {
+		removeFromQueue();
 
-	_inQueue = true;
-	if (!_queue->start) {
-		_queue->start = _queue->end = this;
-	} else if (before) {
-		if (before != _next) {
-			_prev = before->_prev;
-			_next = before;
-			_next->_prev = this;
-			if (_prev) {
-				_prev->_next = this;
-			}
-			if (_queue->start->_prev) _queue->start = _queue->start->_prev;
-		}
-	} else if (after) {
-		if (after != _prev) {
-			_next = after->_next;
-			_prev = after;
-			after->_next = this;
-			if (_next) {
-				_next->_prev = this;
-			}
-			if (_queue->end->_next) _queue->end = _queue->end->_next;
-		}
-	} else {
-		LOG(("Queue Error: _start && !before && !after"));
+		_priorityClass = priorityClass;
+		_priority = priority;
+		_deadline = deadline;
+		_queueOrder = loadFirst ? --QueueFrontOrder : ++QueueBackOrder;
+		_queue->insert(this);
+		_inQueue = true;
 	}
-	return startLoading(loadFirst, prior);
+	return startLoading(loadFirst && priorityClass == LoadPriorityOnScreen);
 }
 
 void FileLoader::cancel() {
@@ -326,6 +345,7 @@ void FileLoader::cancel(bool fail) {
 		_file.close();
 		_fileIsOpen = false;
 		_file.remove();
+		clearResumeData();
 	}
 	_data = QByteArray();
 	if (fail) {
@@ -338,8 +358,8 @@ void FileLoader::cancel(bool fail) {
 	loadNext();
 }
 
-void FileLoader::startLoading(bool loadFirst, bool prior) {
-	if ((_queue->queries >= _queue->limit && (!loadFirst || !prior)) || _complete) return;
+void FileLoader::startLoading(bool force) {
+	if ((_queue->queries >= _queue->limit && !force) || _complete) return;
 	loadPart();
 }
 
@@ -352,11 +372,7 @@ mtpFileLoader::mtpFileLoader(const StorageImageLocation *location, int32 size, L
 , _location(location)
 , _id(0)
 , _access(0) {
-	LoaderQueues::iterator i = queues.find(MTP::dldDcId(_dc, 0));
-	if (i == queues.cend()) {
-		i = queues.insert(MTP::dldDcId(_dc, 0), FileLoaderQueue(MaxFileQueries));
-	}
-	_queue = &i.value();
+	_queue = loaderQueue(queues, _dc);
 }
 
 mtpFileLoader::mtpFileLoader(int32 dc, const uint64 &id, const uint64 &access, LocationType type, const QString &to, int32 size, LoadToCacheSetting toCache, LoadFromCloudSetting fromCloud, bool autoLoading)
@@ -368,11 +384,7 @@ mtpFileLoader::mtpFileLoader(int32 dc, const uint64 &id, const uint64 &access, L
 , _location(0)
 , _id(id)
 , _access(access) {
-	LoaderQueues::iterator i = queues.find(MTP::dldDcId(_dc, 0));
-	if (i == queues.cend()) {
-		i = queues.insert(MTP::dldDcId(_dc, 0), FileLoaderQueue(MaxFileQueries));
-	}
-	_queue = &i.value();
+	_queue = loaderQueue(documentQueues, _dc);
 }
 
 int32 mtpFileLoader::currentOffset(bool includeSkipped) const {
@@ -380,12 +392,13 @@ int32 mtpFileLoader::currentOffset(bool includeSkipped) const {
 }
 
 namespace {
-	QString serializereqs(const QMap<mtpRequestId, int32> &reqs) { // serialize requests map in json-like format
+	template <typename Requests>
+	QString serializereqs(const Requests &reqs) { // serialize requests map in json-like format
 		QString result;
 		result.reserve(reqs.size() * 16 + 4);
 		result.append(qsl("{ "));
 		for (auto i = reqs.cbegin(), e = reqs.cend(); i != e;) {
-			result.append(QString::number(i.key())).append(qsl(" : ")).append(QString::number(i.value()));
+			result.append(QString::number(i.key())).append(qsl(" : ")).append(QString::number(i.value().dcIndex));
 			if (++i == e) {
 				break;
 			} else {
@@ -395,6 +408,54 @@ namespace {
 		result.append(qsl(" }"));
 		return result;
 	}
+
+	void downloadPartLoaded(int32 dc, int32 bytes, uint64 rtt) {
+		DownloadStats &stats(DownloadStatsMap[dc]);
+		stats.rtt = stats.rtt ? ((stats.rtt * 7 + rtt) / 8) : rtt;
+		stats.received += bytes;
+
+		uint64 ms = getms();
+		if (!stats.periodStart) {
+			stats.periodStart = ms;
+			return;
+		}
+		if (ms < stats.periodStart + DownloadStatsPeriod) return;
+
+		int64 speed = stats.received * 1000 / int64(ms - stats.periodStart);
+		stats.speed = stats.speed ? ((stats.speed + speed) / 2) : speed;
+		stats.received = 0;
+		stats.periodStart = ms;
+
+		// keep bandwidth-delay product in flight with a couple of parts in reserve,
+		// while it is latency-bound the measured speed grows together with the window
+		int64 inFlight = stats.speed * int64(qMax(stats.rtt, uint64(1))) / 1000;
+		int32 partSize = DocumentDownloadPartSize;
+		while (partSize < DocumentDownloadPartSizeMax && inFlight >= 8 * partSize) {
+			partSize *= 2;
+		}
+		stats.partSize = partSize;
+
+		FileLoaderQueue *queue = loaderQueue(documentQueues, dc);
+		queue->limit = snap(int32(inFlight / partSize) + 2, int32(MaxFileQueries), int32(MaxFileQueriesAdaptive));
+		if (DebugLogging::FileLoader()) DEBUG_LOG(("FileLoader: dc %1 speed %2 bytes/sec, rtt %3 ms, part size %4, queries limit %5").arg(dc).arg(stats.speed).arg(stats.rtt).arg(stats.partSize).arg(queue->limit));
+	}
+
+	void downloadFinished(int32 dc) { // don't count idle time as slow download
+		DownloadStats &stats(DownloadStatsMap[dc]);
+		stats.received = 0;
+		stats.periodStart = 0;
+	}
+}
+
+int32 mtpFileLoader::partSize() const {
+	if (_location) return DownloadPartSize;
+
+	// offset should be divisible by the part size, so the part does not cross 1mb boundary
+	int32 result = DownloadStatsMap.value(_dc).partSize;
+	while (result > DocumentDownloadPartSize && (_nextRequestOffset % result)) {
+		result /= 2;
+	}
+	return result;
 }
 
 bool mtpFileLoader::loadPart() {
@@ -402,16 +463,22 @@ bool mtpFileLoader::loadPart() {
 		if (DebugLogging::FileLoader() && _id) DEBUG_LOG(("FileLoader(%1): loadPart() returned, _complete=%2, _lastComplete=%3, _requests.size()=%4, _size=%5").arg(_id).arg(Logs::b(_complete)).arg(Logs::b(_lastComplete)).arg(_requests.size()).arg(_size));
 		return false;
 	}
+	skipDownloadedParts();
 	if (_size && _nextRequestOffset >= _size) {
 		if (DebugLogging::FileLoader() && _id) DEBUG_LOG(("FileLoader(%1): loadPart() returned, _size=%2, _nextRequestOffset=%3, _requests=%4").arg(_id).arg(_size).arg(_nextRequestOffset).arg(serializereqs(_requests)));
 		return false;
 	}
 
-	int32 limit = DocumentDownloadPartSize;
+	int32 limit = partSize();
+	if (!_downloadedParts.isEmpty()) { // don't load again the beginning of the next downloaded part
+		QMap<int32, int32>::const_iterator next = _downloadedParts.upperBound(_nextRequestOffset);
+		while (next != _downloadedParts.cend() && limit > DocumentDownloadPartSize && next.key() < _nextRequestOffset + limit) {
+			limit /= 2;
+		}
+	}
 	MTPInputFileLocation loc;
 	if (_location) {
 		loc = MTP_inputFileLocation(MTP_long(_location->volume()), MTP_int(_location->local()), MTP_long(_location->secret()));
-		limit = DownloadPartSize;
 	} else {
 		switch (_locationType) {
 		case VideoFileLocation:
@@ -435,68 +502,101 @@ bool mtpFileLoader::loadPart() {
 	mtpRequestId reqId = MTP::send(MTPupload_GetFile(MTPupload_getFile(loc, MTP_int(offset), MTP_int(limit))), rpcDone(&mtpFileLoader::partLoaded, offset), rpcFail(&mtpFileLoader::partFailed), MTP::dldDcId(_dc, dcIndex), 50);
 
 	++_queue->queries;
+	++_queue->classQueries[_priorityClass];
 	dr.v[dcIndex] += limit;
-	_requests.insert(reqId, dcIndex);
+	RequestData request = { dcIndex, limit, getms(), _priorityClass };
+	_requests.insert(reqId, request);
 	_nextRequestOffset += limit;
+	if (!_speedStart) updateSpeed(currentOffset());
 
 	if (DebugLogging::FileLoader() && _id) DEBUG_LOG(("FileLoader(%1): requested part with offset=%2, _queue->queries=%3, _nextRequestOffset=%4, _requests=%5").arg(_id).arg(offset).arg(_queue->queries).arg(_nextRequestOffset).arg(serializereqs(_requests)));
 
 	return true;
 }
 
-void mtpFileLoader::partLoaded(int32 offset, const MTPupload_File &result, mtpRequestId req) {
+void mtpFileLoader::partLoaded(int32 offset, const mtpPrime *from, const mtpPrime *end, mtpRequestId req) {
 	Requests::iterator i = _requests.find(req);
 	if (i == _requests.cend()) {
 		if (DebugLogging::FileLoader() && _id) DEBUG_LOG(("FileLoader(%1): request req=%2 for offset=%3 not found in _requests=%4").arg(_id).arg(req).arg(offset).arg(serializereqs(_requests)));
 		return loadNext();
 	}
-	if (result.type() != mtpc_upload_file) {
-		if (DebugLogging::FileLoader() && _id) DEBUG_LOG(("FileLoader(%1): bad cons received! %2").arg(_id).arg(result.type()));
+	mtpTypeId cons = (from < end) ? mtpTypeId(*from) : 0;
+	if (cons != mtpc_upload_file) {
+		if (DebugLogging::FileLoader() && _id) DEBUG_LOG(("FileLoader(%1): bad cons received! %2").arg(_id).arg(cons));
 		return cancel(true);
 	}
 
-	int32 limit = (_locationType == UnknownFileLocation) ? DownloadPartSize : DocumentDownloadPartSize;
-	int32 dcIndex = i.value();
-	DataRequestedMap[_dc].v[dcIndex] -= limit;
+	// the file bytes are not copied out of the received buffer, they are written from it directly
+	MTPstorage_FileType type;
+	MTPint mtime;
+	MTPbytesRef bytes;
+	try {
+		++from;
+		type.read(from, end);
+		mtime.read(from, end);
+		bytes.read(from, end);
+	} catch (Exception &e) {
+		if (DebugLogging::FileLoader() && _id) DEBUG_LOG(("FileLoader(%1): bad upload.file received: %2").arg(_id).arg(e.what()));
+		return cancel(true);
+	}
+
+	const RequestData request = i.value();
+	DataRequestedMap[_dc].v[request.dcIndex] -= request.limit;
 
 	--_queue->queries;
+	--_queue->classQueries[request.priorityClass];
 	_requests.erase(i);
 
-	const MTPDupload_file &d(result.c_upload_file());
-	const string &bytes(d.vbytes.c_string().v);
+	if (!_location) {
+		downloadPartLoaded(_dc, bytes.size, getms() - request.sent);
+	}
 
-	if (DebugLogging::FileLoader() && _id) DEBUG_LOG(("FileLoader(%1): got part with offset=%2, bytes=%3, _queue->queries=%4, _nextRequestOffset=%5, _requests=%6").arg(_id).arg(offset).arg(bytes.size()).arg(_queue->queries).arg(_nextRequestOffset).arg(serializereqs(_requests)));
+	if (DebugLogging::FileLoader() && _id) DEBUG_LOG(("FileLoader(%1): got part with offset=%2, bytes=%3, _queue->queries=%4, _nextRequestOffset=%5, _requests=%6").arg(_id).arg(offset).arg(bytes.size).arg(_queue->queries).arg(_nextRequestOffset).arg(serializereqs(_requests)));
 
-	if (bytes.size()) {
+	if (bytes.size) {
 		if (_fileIsOpen) {
 			int64 fsize = _file.size();
 			if (offset < fsize) {
-				_skippedBytes -= bytes.size();
+				if (!partDownloaded(offset, bytes.size)) {
+					_skippedBytes -= bytes.size;
+				}
 			} else if (offset > fsize) {
 				_skippedBytes += offset - fsize;
 			}
 			_file.seek(offset);
-			if (_file.write(bytes.data(), bytes.size()) != qint64(bytes.size())) {
+			if (_file.write(bytes.data, bytes.size) != qint64(bytes.size)) {
 				return cancel(true);
 			}
+			if (resumable()) {
+				addDownloadedPart(offset, bytes.size);
+				_downloadedNotSaved += bytes.size;
+				if (_downloadedNotSaved >= DocumentResumeCheckpointSize) {
+					if (!_file.flush()) {
+						return cancel(true);
+					}
+					saveDownloadedParts();
+				}
+			}
 		} else {
-			_data.reserve(offset + bytes.size());
+			if (_size > _data.capacity()) { // reserve the whole file once instead of reallocating for each part
+				_data.reserve(_size);
+			}
 			if (offset > _data.size()) {
 				_skippedBytes += offset - _data.size();
 				_data.resize(offset);
 			}
 			if (offset == _data.size()) {
-				_data.append(bytes.data(), bytes.size());
+				_data.append(bytes.data, bytes.size);
 			} else {
-				_skippedBytes -= bytes.size();
-				if (int64(offset + bytes.size()) > _data.size()) {
-					_data.resize(offset + bytes.size());
+				_skippedBytes -= bytes.size;
+				if (int64(offset + bytes.size) > _data.size()) {
+					_data.resize(offset + bytes.size);
 				}
-				memcpy(_data.data() + offset, bytes.data(), bytes.size());
+				memcpy(_data.data() + offset, bytes.data, bytes.size);
 			}
 		}
 	}
-	if (!bytes.size() || (bytes.size() % 1024)) { // bad next offset
+	if (!bytes.size || (bytes.size % 1024)) { // bad next offset
 		_lastComplete = true;
 	}
 	if (_requests.isEmpty() && (_lastComplete || (_size && _nextRequestOffset >= _size))) {
@@ -509,19 +609,21 @@ void mtpFileLoader::partLoaded(int32 offset, const MTPupload_File &result, mtpRe
 				return cancel(true);
 			}
 		}
-		_type = d.vtype.type();
+		_type = type.type();
 		_complete = true;
 		if (_fileIsOpen) {
 			_file.close();
 			_fileIsOpen = false;
 			psPostprocessFile(QFileInfo(_file).absoluteFilePath());
+			clearResumeData();
 		}
 		removeFromQueue();
 
 		emit App::wnd()->imageLoaded();
 
 		if (!_queue->queries) {
-			App::app()->killDownloadSessionsStart(_dc);
+			if (!downloadingFrom(_dc)) App::app()->killDownloadSessionsStart(_dc);
+			if (!_location) downloadFinished(_dc);
 		}
 
 		if (_localStatus == LocalNotFound || _localStatus == LocalFailed) {
@@ -544,6 +646,7 @@ void mtpFileLoader::partLoaded(int32 offset, const MTPupload_File &result, mtpRe
 	} else {
 		if (DebugLogging::FileLoader() && _id) DEBUG_LOG(("FileLoader(%1): not done yet, _lastComplete=%2, _size=%3, _nextRequestOffset=%4, _requests=%5").arg(_id).arg(Logs::b(_lastComplete)).arg(_size).arg(_nextRequestOffset).arg(serializereqs(_requests)));
 	}
+	updateSpeed(currentOffset());
 	emit progress(this);
 	loadNext();
 }
@@ -558,18 +661,18 @@ bool mtpFileLoader::partFailed(const RPCError &error) {
 void mtpFileLoader::cancelRequests() {
 	if (_requests.isEmpty()) return;
 
-	int32 limit = (_locationType == UnknownFileLocation) ? DownloadPartSize : DocumentDownloadPartSize;
 	DataRequested &dr(DataRequestedMap[_dc]);
 	for (Requests::const_iterator i = _requests.cbegin(), e = _requests.cend(); i != e; ++i) {
 		MTP::cancel(i.key());
-		int32 dcIndex = i.value();
-		dr.v[dcIndex] -= limit;
+		dr.v[i.value().dcIndex] -= i.value().limit;
+		--_queue->classQueries[i.value().priorityClass];
 	}
 	_queue->queries -= _requests.size();
 	_requests.clear();
 
 	if (!_queue->queries && App::app()) {
-		App::app()->killDownloadSessionsStart(_dc);
+		if (!downloadingFrom(_dc)) App::app()->killDownloadSessionsStart(_dc);
+		if (!_location) downloadFinished(_dc);
 	}
 }
 
@@ -604,8 +707,95 @@ bool mtpFileLoader::tryLoadLocal() {
 	return false;
 }
 
+bool mtpFileLoader::resumable() const {
+	return !_location && _locationType != UnknownFileLocation && _toCache == LoadToFileOnly && !_fname.isEmpty() && _size > 0;
+}
+
+bool mtpFileLoader::resumeFile() {
+	if (!resumable()) return false;
+
+	MediaKey mkey = mediaKey(_locationType, _dc, _id);
+	Local::DownloadedParts parts;
+	if (!Local::readDownloadedParts(mkey, _fname, _size, parts)) {
+		return false;
+	}
+
+	int32 downloaded = 0;
+	for (Local::DownloadedParts::const_iterator i = parts.cbegin(), e = parts.cend(); i != e; ++i) {
+		int32 end = i.key() + i.value();
+		if ((i.key() % DocumentDownloadPartSize) || (end < _size && (end % DocumentDownloadPartSize))) {
+			Local::clearDownloadedParts(mkey);
+			return false;
+		}
+		downloaded += i.value();
+	}
+	if (!_file.open(QIODevice::ReadWrite)) {
+		Local::clearDownloadedParts(mkey);
+		return false;
+	}
+
+	_downloadedParts = parts;
+	_skippedBytes = int32(_file.size()) - downloaded;
+	_nextRequestOffset = 0;
+	LOG(("FileLoader(%1): continue download to '%2', %3 of %4 bytes are already loaded").arg(_id).arg(_fname).arg(downloaded).arg(_size));
+	return true;
+}
+
+void mtpFileLoader::clearResumeData() {
+	if (!_downloadedParts.isEmpty() || resumable()) {
+		_downloadedParts.clear();
+		_downloadedNotSaved = 0;
+		Local::clearDownloadedParts(mediaKey(_locationType, _dc, _id));
+	}
+}
+
+void mtpFileLoader::addDownloadedPart(int32 offset, int32 length) {
+	QMap<int32, int32>::iterator i = _downloadedParts.insert(offset, qMax(length, _downloadedParts.value(offset)));
+	if (i != _downloadedParts.begin()) {
+		QMap<int32, int32>::iterator prev = i - 1;
+		if (prev.key() + prev.value() >= i.key()) {
+			prev.value() = qMax(prev.key() + prev.value(), i.key() + i.value()) - prev.key();
+			_downloadedParts.erase(i);
+			i = prev;
+		}
+	}
+	for (QMap<int32, int32>::iterator next = i + 1; next != _downloadedParts.end() && i.key() + i.value() >= next.key();) {
+		i.value() = qMax(i.key() + i.value(), next.key() + next.value()) - i.key();
+		next = _downloadedParts.erase(next);
+	}
+}
+
+void mtpFileLoader::saveDownloadedParts() { // the parts must be flushed to the file already
+	_downloadedNotSaved = 0;
+	Local::writeDownloadedParts(mediaKey(_locationType, _dc, _id), _fname, _size, _downloadedParts);
+}
+
+bool mtpFileLoader::partDownloaded(int32 offset, int32 length) const {
+	QMap<int32, int32>::const_iterator i = _downloadedParts.upperBound(offset);
+	if (i == _downloadedParts.cbegin()) return false;
+
+	--i;
+	return (i.key() + i.value() >= offset + length);
+}
+
+void mtpFileLoader::skipDownloadedParts() {
+	// the last part is always requested again to get the file type and finish the download
+	while (!_downloadedParts.isEmpty()) {
+		QMap<int32, int32>::const_iterator i = _downloadedParts.upperBound(_nextRequestOffset);
+		if (i == _downloadedParts.cbegin()) break;
+
+		--i;
+		int32 end = i.key() + i.value();
+		if (end <= _nextRequestOffset || end >= _size) break;
+		_nextRequestOffset = end;
+	}
+}
+
 mtpFileLoader::~mtpFileLoader() {
 	cancelRequests();
+	if (_fileIsOpen && _downloadedNotSaved && resumable() && _file.flush()) { // the last checkpoint before quit
+		saveDownloadedParts();
+	}
 }
 
 webFileLoader::webFileLoader(const QString &url, const QString &to, LoadFromCloudSetting fromCloud, bool autoLoading)
@@ -100,6 +100,16 @@ enum LoadToCacheSetting {
 	LoadToCacheAsWell,
 };
 
+// loaders of a higher priority class are served first, while loaders of
+// several classes are waiting each class gets its share of the parallel queries
+enum LoadPriorityClass {
+	LoadPriorityOnScreen, // shown right now, the latest view goes first, see MTP::clearLoaderPriorities()
+	LoadPriorityPrefetch, // is expected to be shown soon, automatic loads
+	LoadPriorityBackground, // saving files, nobody waits for them on screen
+
+	LoadPriorityClassesCount
+};
+
 class mtpFileLoader;
 class webFileLoader;
 
@@ -127,12 +137,16 @@ public:
 	float64 currentProgress() const;
 	virtual int32 currentOffset(bool includeSkipped = false) const = 0;
 	int32 fullSize() const;
+	int32 currentSpeed() const { // bytes per second, updated before progress() is emitted
+		return _speed;
+	}
 
 	bool setFileName(const QString &filename); // set filename for loaders to cache
 	void permitLoadFromCloud();
 
 	void pause();
-	void start(bool loadFirst = false, bool prior = true);
+	void start(bool loadFirst = false, bool prior = true); // prior - on screen, otherwise in background
+	void schedule(LoadPriorityClass priorityClass, uint64 deadline = 0, bool loadFirst = false); // deadline - getms() when it is needed, 0 - no hint
 	void cancel();
 
 	bool loading() const {
@@ -150,6 +164,10 @@ public:
 	bool autoLoading() const {
 		return _autoLoading;
 	}
+	LoadPriorityClass priorityClass() const {
+		return _priorityClass;
+	}
+	bool onScreen() const; // queued as on screen after the last loader priorities clearing
 
 	virtual mtpFileLoader *mtpLoader() {
 		return 0;
@@ -176,8 +194,11 @@ signals:
 
 protected:
 
-	FileLoader *_prev, *_next;
+	friend struct FileLoaderQueue;
 	int32 _priority;
+	LoadPriorityClass _priorityClass;
+	uint64 _deadline;
+	int64 _queueOrder;
 	FileLoaderQueue *_queue;
 
 	bool _paused, _autoLoading, _inQueue, _complete;
@@ -185,8 +206,13 @@ protected:
 
 	virtual bool tryLoadLocal() = 0;
 	virtual void cancelRequests() = 0;
+	virtual bool resumeFile() { // opens the partially loaded file if the download can be continued
+		return false;
+	}
+	virtual void clearResumeData() {
+	}
 
-	void startLoading(bool loadFirst, bool prior);
+	void startLoading(bool force);
 	void removeFromQueue();
 	void cancel(bool failed);
 
@@ -206,6 +232,11 @@ protected:
 	mtpTypeId _type;
 	LocationType _locationType;
 
+	int32 _speed;
+	uint64 _speedStart;
+	int32 _speedStartOffset;
+	void updateSpeed(int32 offset);
+
 	TaskId _localTaskId;
 	mutable QByteArray _imageFormat;
 	mutable QPixmap _imagePixmap;
@@ -245,12 +276,30 @@ protected:
 
 	virtual bool tryLoadLocal();
 	virtual void cancelRequests();
-
-	typedef QMap<mtpRequestId, int32> Requests;
+	virtual bool resumeFile();
+	virtual void clearResumeData();
+
+	bool resumable() const;
+	void addDownloadedPart(int32 offset, int32 length);
+	void saveDownloadedParts();
+	bool partDownloaded(int32 offset, int32 length) const;
+	void skipDownloadedParts();
+	QMap<int32, int32> _downloadedParts; // offset -> length, see Local::DownloadedParts
+	int32 _downloadedNotSaved = 0; // bytes written to the file after the last checkpoint
+
+	struct RequestData {
+		int32 dcIndex;
+		int32 limit;
+		uint64 sent;
+		LoadPriorityClass priorityClass;
+	};
+	typedef QMap<mtpRequestId, RequestData> Requests;
 	Requests _requests;
 
+	int32 partSize() const;
+
 	virtual bool loadPart();
-	void partLoaded(int32 offset, const MTPupload_File &result, mtpRequestId req);
+	void partLoaded(int32 offset, const mtpPrime *from, const mtpPrime *end, mtpRequestId req); // upload.File is parsed in place
 	bool partFailed(const RPCError &error);
 
 	bool _lastComplete;
@@ -68,12 +68,39 @@ inline bool mtpIsFlood(const RPCError &error) {
 	return error.type().startsWith(qsl("FLOOD_WAIT_"));
 }
 
+typedef mtpParsedResponsePtr (*RPCParseFunction)(const mtpPrime *from, const mtpPrime *end);
+
 class RPCAbstractDoneHandler { // abstract done
 public:
 	virtual void operator()(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end) const = 0;
+
+	// handlers of typed results read the response in the connection thread and get the typed result in the main thread,
+	// the connection thread gets only the parse function, so the handler (and its owner) is always released in the main thread
+	virtual RPCParseFunction parser() const {
+		return 0;
+	}
+	virtual void operator()(mtpRequestId requestId, const mtpParsedResponse &parsed) const {
+	}
+
 	virtual ~RPCAbstractDoneHandler() {
 	}
 };
+
+template <typename TResponse>
+class RPCParsedResponse : public mtpParsedResponse {
+public:
+	RPCParsedResponse(const mtpPrime *from, const mtpPrime *end) : result(from, end) {
+	}
+	static mtpParsedResponsePtr parse(const mtpPrime *from, const mtpPrime *end) {
+		return mtpParsedResponsePtr(new RPCParsedResponse<TResponse>(from, end));
+	}
+	static const TResponse &get(const mtpParsedResponse &parsed) {
+		return static_cast<const RPCParsedResponse<TResponse>&>(parsed).result;
+	}
+
+	TResponse result;
+
+};
 typedef QSharedPointer<RPCAbstractDoneHandler> RPCDoneHandlerPtr;
 
 class RPCAbstractFailHandler { // abstract fail
@@ -139,6 +166,12 @@ public:
 	virtual void operator()(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end) const {
 		(*_onDone)(TResponse(from, end));
 	}
+	virtual RPCParseFunction parser() const {
+		return &RPCParsedResponse<TResponse>::parse;
+	}
+	virtual void operator()(mtpRequestId requestId, const mtpParsedResponse &parsed) const {
+		(*_onDone)(RPCParsedResponse<TResponse>::get(parsed));
+	}
 
 private:
 	CallbackType _onDone;
@@ -155,6 +188,12 @@ public:
 	virtual void operator()(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end) const {
 		(*_onDone)(TResponse(from, end), requestId);
 	}
+	virtual RPCParseFunction parser() const {
+		return &RPCParsedResponse<TResponse>::parse;
+	}
+	virtual void operator()(mtpRequestId requestId, const mtpParsedResponse &parsed) const {
+		(*_onDone)(RPCParsedResponse<TResponse>::get(parsed), requestId);
+	}
 
 private:
 	CallbackType _onDone;
@@ -376,6 +415,12 @@ public:
 	virtual void operator()(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end) const {
 		if (_owner) (static_cast<TReceiver*>(_owner)->*_onDone)(TResponse(from, end));
 	}
+	virtual RPCParseFunction parser() const {
+		return &RPCParsedResponse<TResponse>::parse;
+	}
+	virtual void operator()(mtpRequestId requestId, const mtpParsedResponse &parsed) const {
+		if (_owner) (static_cast<TReceiver*>(_owner)->*_onDone)(RPCParsedResponse<TResponse>::get(parsed));
+	}
 
 private:
 	CallbackType _onDone;
@@ -392,6 +437,12 @@ public:
 	virtual void operator()(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end) const {
 		if (_owner) (static_cast<TReceiver*>(_owner)->*_onDone)(TResponse(from, end), requestId);
 	}
+	virtual RPCParseFunction parser() const {
+		return &RPCParsedResponse<TResponse>::parse;
+	}
+	virtual void operator()(mtpRequestId requestId, const mtpParsedResponse &parsed) const {
+		if (_owner) (static_cast<TReceiver*>(_owner)->*_onDone)(RPCParsedResponse<TResponse>::get(parsed), requestId);
+	}
 
 private:
 	CallbackType _onDone;
@@ -474,6 +525,12 @@ public:
 	virtual void operator()(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end) const {
 		if (_owner) (static_cast<TReceiver*>(_owner)->*_onDone)(_b, TResponse(from, end));
 	}
+	virtual RPCParseFunction parser() const {
+		return &RPCParsedResponse<TResponse>::parse;
+	}
+	virtual void operator()(mtpRequestId requestId, const mtpParsedResponse &parsed) const {
+		if (_owner) (static_cast<TReceiver*>(_owner)->*_onDone)(_b, RPCParsedResponse<TResponse>::get(parsed));
+	}
 
 private:
 	CallbackType _onDone;
@@ -491,6 +548,12 @@ public:
 	virtual void operator()(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end) const {
 		if (_owner) (static_cast<TReceiver*>(_owner)->*_onDone)(_b, TResponse(from, end), requestId);
 	}
+	virtual RPCParseFunction parser() const {
+		return &RPCParsedResponse<TResponse>::parse;
+	}
+	virtual void operator()(mtpRequestId requestId, const mtpParsedResponse &parsed) const {
+		if (_owner) (static_cast<TReceiver*>(_owner)->*_onDone)(_b, RPCParsedResponse<TResponse>::get(parsed), requestId);
+	}
 
 private:
 	CallbackType _onDone;
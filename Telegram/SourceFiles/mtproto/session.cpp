@@ -507,28 +507,25 @@ void Session::tryToReceive() {
 		_needToReceive = true;
 		return;
 	}
-	int32 cnt = 0;
 	while (true) {
-		mtpRequestId requestId;
-		mtpResponse response;
+		mtpResponseMap responses; // take all the received responses at once, so the connection thread waits for the lock only once
 		{
 			QWriteLocker locker(data.haveReceivedMutex());
-			mtpResponseMap &responses(data.haveReceivedMap());
-			mtpResponseMap::iterator i = responses.begin();
-			if (i == responses.end()) return;
+			if (data.haveReceivedMap().isEmpty()) return;
 
-			requestId = i.key();
-			response = i.value();
-			responses.erase(i);
+			qSwap(responses, data.haveReceivedMap());
 		}
-		if (requestId <= 0) {
-			if (dcWithShift == bareDcId(dcWithShift)) { // call globalCallback only in main session
-				globalCallback(response.constData(), response.constData() + response.size());
+		for (mtpResponseMap::const_iterator i = responses.cbegin(), e = responses.cend(); i != e; ++i) {
+			mtpRequestId requestId = i.key();
+			const mtpResponse &response(i.value());
+			if (requestId <= 0) {
+				if (dcWithShift == bareDcId(dcWithShift)) { // call globalCallback only in main session
+					globalCallback(response.constData(), response.constData() + response.size());
+				}
+			} else {
+				execCallback(requestId, response.constData(), response.constData() + response.size(), response.parsed);
 			}
-		} else {
-			execCallback(requestId, response.constData(), response.constData() + response.size());
 		}
-		++cnt;
 	}
 }
 
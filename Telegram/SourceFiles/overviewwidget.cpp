@@ -84,7 +84,8 @@ OverviewInner::OverviewInner(OverviewWidget *overview, ScrollArea *scroll, PeerD
 , _touchSpeedTime(0)
 , _touchAccelerationTime(0)
 , _touchTime(0)
-, _menu(0) {
+, _menu(0)
+, _thumbsLoader(this, FileLoaderQueueStopTimeout, qBound(1, QThread::idealThreadCount(), int(OverviewThumbThreadsMax))) {
 	connect(App::wnd(), SIGNAL(imageLoaded()), this, SLOT(update()));
 
 	resize(_width, st::wndMinHeight);
@@ -743,6 +744,7 @@ void OverviewInner::activate() {
 }
 
 void OverviewInner::clear() {
+	cancelPrefetches();
 	_selected.clear();
 	_dragItemIndex = _mousedItemIndex = _dragSelFromIndex = _dragSelToIndex = -1;
 	_dragItem = _mousedItem = _dragSelFrom = _dragSelTo = 0;
@@ -827,6 +829,72 @@ uint32 OverviewInner::itemSelectedValue(int32 index) const {
 	return 0;
 }
 
+void OverviewInner::prefetchMedia() {
+	if (_type != OverviewPhotos) return; // only the photos grid auto loads its media while drawing
+
+	int32 visibleTop = _scroll->scrollTop(), visibleBottom = visibleTop + _scroll->height();
+	uint64 ms = getms();
+	if (_prefetchTime && ms > _prefetchTime) {
+		float64 speed = float64(visibleTop - _prefetchTop) / (ms - _prefetchTime);
+		_prefetchSpeed = (ms - _prefetchTime < uint64(MediaPrefetchAheadTime)) ? (_prefetchSpeed + speed) / 2. : speed;
+	}
+	_prefetchTop = visibleTop;
+	_prefetchTime = ms;
+
+	int32 screen = qMax(visibleBottom - visibleTop, 1);
+	int32 ahead = qMin(int32(qAbs(_prefetchSpeed) * MediaPrefetchAheadTime), screen * (MediaPrefetchMaxScreens - MediaPrefetchScreens));
+	int32 from = visibleTop - screen * MediaPrefetchScreens - (_prefetchSpeed < 0 ? ahead : 0);
+	int32 till = visibleBottom + screen * MediaPrefetchScreens + (_prefetchSpeed > 0 ? ahead : 0);
+
+	// items are expected on screen not later than in a second for each screen of distance
+	float64 minSpeed = float64(screen) / MediaPrefetchAheadTime;
+
+	OrderedSet<HistoryItem*> prefetched;
+	int32 count = _items.size(), rowsCount = (_photosToAdd + count) / _photosInRow + (((_photosToAdd + count) % _photosInRow) ? 1 : 0);
+	int32 rowFrom = floorclamp(from - _marginTop - st::overviewPhotoSkip, _rowWidth + st::overviewPhotoSkip, 0, rowsCount);
+	int32 rowTo = ceilclamp(till - _marginTop - st::overviewPhotoSkip, _rowWidth + st::overviewPhotoSkip, 0, rowsCount);
+	for (int32 row = rowFrom; row < rowTo; ++row) {
+		int32 rowtop = _marginTop + row * (_rowWidth + st::overviewPhotoSkip) + st::overviewPhotoSkip, rowbottom = rowtop + _rowWidth;
+		bool visible = (rowbottom > visibleTop && rowtop < visibleBottom), below = (rowtop >= visibleBottom);
+		int32 distance = below ? (rowtop - visibleBottom) : (visibleTop - rowbottom);
+		float64 speed = (below == (_prefetchSpeed > 0)) ? qMax(qAbs(_prefetchSpeed), minSpeed) : minSpeed;
+		for (int32 col = 0; col < _photosInRow; ++col) {
+			int32 i = count - (row * _photosInRow + col - _photosToAdd) - 1;
+			if (i < 0 || i >= count) continue;
+
+			LayoutMediaItem *media = _items.at(i)->toLayoutMediaItem();
+			if (!media) continue;
+
+			HistoryItem *item = media->getItem();
+			prefetched.insert(item);
+			if (visible || _prefetched.contains(item)) continue; // visible media is loaded by paint()
+
+			media->prefetch(ms + uint64(distance / speed));
+		}
+	}
+
+	// stop loading media that went out of the prefetch area without being loaded
+	for (OrderedSet<HistoryItem*>::const_iterator i = _prefetched.cbegin(), e = _prefetched.cend(); i != e; ++i) {
+		if (!prefetched.contains(*i)) {
+			LayoutItems::const_iterator j = _layoutItems.constFind(*i);
+			if (j != _layoutItems.cend()) {
+				j.value()->cancelPrefetch();
+			}
+		}
+	}
+	_prefetched = prefetched;
+}
+
+void OverviewInner::cancelPrefetches() {
+	for (OrderedSet<HistoryItem*>::const_iterator i = _prefetched.cbegin(), e = _prefetched.cend(); i != e; ++i) {
+		LayoutItems::const_iterator j = _layoutItems.constFind(*i);
+		if (j != _layoutItems.cend()) {
+			j.value()->cancelPrefetch();
+		}
+	}
+	_prefetched.clear();
+}
+
 void OverviewInner::paintEvent(QPaintEvent *e) {
 	if (App::wnd() && App::wnd()->contentOverlapped(this, e)) return;
 
@@ -1811,6 +1879,8 @@ void OverviewInner::itemRemoved(HistoryItem *item) {
 		_overview->updateTopBarSelection();
 	}
 
+	_prefetched.remove(item);
+
 	LayoutItems::iterator j = _layoutItems.find(item);
 	if (j != _layoutItems.cend()) {
 		int32 index = _items.indexOf(j.value());
@@ -1910,7 +1980,7 @@ LayoutMediaItem *OverviewInner::layoutPrepare(HistoryItem *item) {
 	if (_type == OverviewPhotos) {
 		if (media && media->type() == MediaTypePhoto) {
 			if ((i = _layoutItems.constFind(item)) == _layoutItems.cend()) {
-				i = _layoutItems.insert(item, new LayoutOverviewPhoto(static_cast<HistoryPhoto*>(media)->photo(), item));
+				i = _layoutItems.insert(item, new LayoutOverviewPhoto(static_cast<HistoryPhoto*>(media)->photo(), item, &_thumbsLoader));
 				i.value()->initDimensions();
 			}
 		}
@@ -2024,6 +2094,7 @@ void OverviewWidget::onScroll() {
 	if (!_noDropResizeIndex) {
 		_inner.dropResizeIndex();
 	}
+	_inner.prefetchMedia();
 }
 
 void OverviewWidget::resizeEvent(QResizeEvent *e) {
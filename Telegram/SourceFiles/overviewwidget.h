@@ -72,6 +72,8 @@ public:
 	void repaintItem(const HistoryItem *msg);
 	void itemRemoved(HistoryItem *item);
 
+	void prefetchMedia(); // auto load photos around the visible area
+
 	void getSelectionState(int32 &selectedForForward, int32 &selectedForDelete) const;
 	void clearSelectedItems(bool onlyTextSelection = false);
 	void fillSelectedItems(SelectedItemSet &sel, bool forDelete = true);
@@ -137,6 +139,12 @@ private:
 	void recountMargins();
 	int32 countHeight();
 
+	OrderedSet<HistoryItem*> _prefetched;
+	int32 _prefetchTop = 0;
+	uint64 _prefetchTime = 0;
+	float64 _prefetchSpeed = 0.; // pixels per ms, positive when scrolling down
+	void cancelPrefetches();
+
 	OverviewWidget *_overview;
 	ScrollArea *_scroll;
 	int32 _resizeIndex, _resizeSkip;
@@ -234,6 +242,9 @@ private:
 	QTimer _touchScrollTimer;
 
 	PopupMenu *_menu;
+
+	TaskQueue _thumbsLoader; // decodes and scales photo thumbs
+
 };
 
 class OverviewWidget : public TWidget, public RPCSender {
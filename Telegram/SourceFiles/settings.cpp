@@ -161,6 +161,11 @@ int32 gAutoDownloadAudio = 0;
 int32 gAutoDownloadGif = 0;
 bool gAutoPlayGif = true;
 
+int32 gCacheImagesSizeLimit = 512;
+int32 gCacheStickersSizeLimit = 128;
+int32 gCacheAudiosSizeLimit = 256;
+int32 gCacheWebFilesSizeLimit = 64;
+
 void settingsParseArgs(int argc, char *argv[]) {
 #ifdef Q_OS_MAC
 	if (QSysInfo::macVersion() >= QSysInfo::MV_10_11) {
@@ -313,4 +313,10 @@ DeclareSetting(int32, AutoDownloadAudio);
 DeclareSetting(int32, AutoDownloadGif);
 DeclareSetting(bool, AutoPlayGif);
 
+// local cache size limits in megabytes, least recently used entries are removed above them, 0 - no limit
+DeclareSetting(int32, CacheImagesSizeLimit);
+DeclareSetting(int32, CacheStickersSizeLimit);
+DeclareSetting(int32, CacheAudiosSizeLimit);
+DeclareSetting(int32, CacheWebFilesSizeLimit);
+
 void settingsParseArgs(int argc, char *argv[]);
@@ -45,6 +45,15 @@ namespace {
 		hashMd5(both.constData(), both.size(), md5);
 		return (md5[peerId & 0x0F] & (peerIsUser(peer) ? 0x07 : 0x03));
 	}
+
+	QString withoutUniqueSuffix(const QString &fname) { // "name (2).ext" -> "name.ext", see saveFileName()
+		QFileInfo info(fname);
+		QString base = info.completeBaseName(), suffix = info.suffix();
+		static const QRegularExpression re(qsl("^(.*) \\(\\d+\\)$"));
+		QRegularExpressionMatch m = re.match(base);
+		if (m.hasMatch()) base = m.captured(1);
+		return info.absolutePath() + '/' + base + (suffix.isEmpty() ? QString() : ('.' + suffix));
+	}
 }
 
 style::color peerColor(int index) {
@@ -602,6 +611,14 @@ void PhotoData::automaticLoadSettingsChanged() {
 	full->automaticLoadSettingsChanged();
 }
 
+void PhotoData::prefetch(const HistoryItem *item, uint64 deadline) {
+	full->prefetch(item, deadline);
+}
+
+void PhotoData::cancelPrefetch() {
+	full->cancelPrefetch();
+}
+
 void PhotoData::download() {
 	full->loadEvenCancelled();
 	notifyLayoutChanged();
@@ -1108,6 +1125,13 @@ void DocumentData::forget() {
 void DocumentData::automaticLoad(const HistoryItem *item) {
 	if (loaded() || status != FileReady) return;
 
+	startAutomaticLoad(item);
+	if (loading() && saveToCache() && !_loader->onScreen()) {
+		_loader->schedule(LoadPriorityOnScreen); // it is shown right now, so it goes before all prefetched ones
+	}
+}
+
+void DocumentData::startAutomaticLoad(const HistoryItem *item) {
 	if (saveToCache() && _loader != CancelledMtpFileLoader) {
 		if (type == StickerDocument) {
 			save(QString(), _actionOnLoad, _actionOnLoadMsgId);
@@ -1142,6 +1166,26 @@ void DocumentData::automaticLoadSettingsChanged() {
 	_loader = 0;
 }
 
+void DocumentData::prefetch(const HistoryItem *item, uint64 deadline) {
+	if (loaded() || status != FileReady || _loader == CancelledMtpFileLoader) return;
+
+	if (!_loader) {
+		startAutomaticLoad(item);
+	}
+	if (loading() && _loader->autoLoading() && _loader->priorityClass() == LoadPriorityPrefetch && (_loader->loading() || _loader->paused())) {
+		_loader->schedule(LoadPriorityPrefetch, deadline);
+	}
+}
+
+void DocumentData::cancelPrefetch() {
+	if (!loading() || !_loader->loading() || !_loader->autoLoading() || _loader->priorityClass() != LoadPriorityPrefetch) return;
+
+	// keep the loaders that already got some bytes, they will be finished
+	if (!_loader->loadingLocal() && !_loader->currentOffset(true)) {
+		_loader->pause();
+	}
+}
+
 void DocumentData::performActionOnLoad() {
 	if (_actionOnLoad == ActionOnLoadNone) return;
 
@@ -1299,12 +1343,38 @@ void DocumentData::save(const QString &toFile, ActionOnLoad action, const FullMs
 
 	if (_loader) {
 		if (fromCloud == LoadFromCloudOrLocal) _loader->permitLoadFromCloud();
+		if (_loader->paused()) { // prefetch was cancelled, but it is needed now
+			if (action != ActionOnLoadNone) {
+				_loader->start();
+			} else {
+				_loader->schedule(autoLoading ? LoadPriorityPrefetch : LoadPriorityBackground);
+			}
+		}
 	} else {
 		status = FileReady;
-		_loader = new mtpFileLoader(dc, id, access, locationType(), toFile, size, (saveToCache() ? LoadToCacheAsWell : LoadToFileOnly), fromCloud, autoLoading);
+
+		// continue the download interrupted by the app restart if it is saved to the default name
+		// in the same folder again, it differs from the partial file name only by the unique suffix
+		QString to = toFile;
+		if (!to.isEmpty() && !saveToCache()) {
+			QString partial = Local::downloadedPartsFileName(mediaKey());
+			if (!partial.isEmpty()) {
+				if (withoutUniqueSuffix(partial) == withoutUniqueSuffix(to)) {
+					to = partial;
+				} else {
+					QFile::remove(partial);
+					Local::clearDownloadedParts(mediaKey());
+				}
+			}
+		}
+		_loader = new mtpFileLoader(dc, id, access, locationType(), to, size, (saveToCache() ? LoadToCacheAsWell : LoadToFileOnly), fromCloud, autoLoading);
 		_loader->connect(_loader, SIGNAL(progress(FileLoader*)), App::main(), SLOT(documentLoadProgress(FileLoader*)));
 		_loader->connect(_loader, SIGNAL(failed(FileLoader*,bool)), App::main(), SLOT(documentLoadFailed(FileLoader*,bool)));
-		_loader->start();
+		if (action != ActionOnLoadNone) {
+			_loader->start();
+		} else {
+			_loader->schedule(autoLoading ? LoadPriorityPrefetch : LoadPriorityBackground);
+		}
 	}
 	notifyLayoutChanged();
 }
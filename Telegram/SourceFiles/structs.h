@@ -848,6 +848,8 @@ public:
 
 	void automaticLoad(const HistoryItem *item);
 	void automaticLoadSettingsChanged();
+	void prefetch(const HistoryItem *item, uint64 deadline);
+	void cancelPrefetch();
 
 	void download();
 	bool loaded() const;
@@ -984,6 +986,8 @@ public:
 
 	void automaticLoad(const HistoryItem *item); // auto load sticker or video
 	void automaticLoadSettingsChanged();
+	void prefetch(const HistoryItem *item, uint64 deadline); // auto load before it is shown, deadline - getms() when it is expected on screen
+	void cancelPrefetch();
 
 	enum FilePathResolveType {
 		FilePathResolveCached,
@@ -1104,6 +1108,8 @@ private:
 	FullMsgId _actionOnLoadMsgId;
 	mutable mtpFileLoader *_loader;
 
+	void startAutomaticLoad(const HistoryItem *item);
+
 	void notifyLayoutChanged() const;
 
 };
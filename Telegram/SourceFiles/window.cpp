@@ -1014,6 +1014,14 @@ QRect Window::iconRect() const {
 	return QRect(st::titleIconPos + title->geometry().topLeft(), st::titleIconImg.pxSize());
 }
 
+bool Window::event(QEvent *e) {
+	bool result = PsMainWindow::event(e);
+	if (e->type() == QEvent::UpdateRequest) { // all the dirty widgets of the window were painted
+		App::windowPainted();
+	}
+	return result;
+}
+
 bool Window::eventFilter(QObject *obj, QEvent *e) {
 	switch (e->type()) {
 	case QEvent::MouseButtonPress:
@@ -136,6 +136,7 @@ public:
 	QWidget *filedialogParent();
 
 	bool eventFilter(QObject *obj, QEvent *evt);
+	bool event(QEvent *e);
 
 	void inactivePress(bool inactive);
 	bool inactivePress() const;